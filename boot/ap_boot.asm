@@ -0,0 +1,94 @@
+; ap_boot.asm - application processor startup trampoline
+; - smp_init() copies ap_trampoline..ap_trampoline_end to a free page
+;   below 1 MiB and sends the STARTUP IPI there; the AP starts in real
+;   mode with CS = page >> 4 and IP = 0
+; - the copy runs wherever it landed, so nothing here uses an absolute
+;   address: data is reached through offsets from ap_trampoline, jumps
+;   through the linear base computed from CS
+; - ap_params is filled in by smp_init(): the BSP's CR3/CR4/CR0, and for
+;   each AP its stack, entry point and cpu_t
+
+BITS 16
+
+global ap_trampoline
+global ap_trampoline_end
+global ap_params
+
+%define OFF(x)	((x) - ap_trampoline)
+
+; ap_params_t in smp.c
+P_CR3		equ 0
+P_CR4		equ 4
+P_CR0		equ 8
+P_STACK		equ 12
+P_ENTRY		equ 16
+P_CPU		equ 20
+
+section .rodata
+
+align 16
+ap_trampoline:
+	cli
+	cld
+	mov ax, cs
+	mov ds, ax
+	mov ss, ax
+	mov sp, 0x1000			; top of the trampoline page
+	xor ebx, ebx
+	mov bx, ax
+	shl ebx, 4				; linear base of this copy
+
+	; the GDT pointer holds a linear address
+	lea eax, [ebx + OFF(ap_gdt)]
+	mov [OFF(ap_gdt_ptr) + 2], eax
+	lgdt [OFF(ap_gdt_ptr)]
+
+	mov eax, cr0
+	or eax, 0x00000001		; CR0.PE
+	mov cr0, eax
+
+	; far return into the flat code segment at the linear address of ap_pm
+	lea eax, [ebx + OFF(ap_pm)]
+	push dword 0x08
+	push eax
+	o32 retf
+
+BITS 32
+
+ap_pm:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; paging as on the BSP; the low 4 MiB stay identity mapped, so this
+	; code keeps running once CR0.PG is set
+	lea esi, [ebx + OFF(ap_params)]
+	mov eax, [esi + P_CR4]
+	mov cr4, eax
+	mov eax, [esi + P_CR3]
+	mov cr3, eax
+	mov eax, [esi + P_CR0]
+	mov cr0, eax
+
+	mov esp, [esi + P_STACK]
+	xor ebp, ebp
+	push dword [esi + P_CPU]	; ap_main(cpu)
+	push dword 0				; ap_main never returns
+	jmp [esi + P_ENTRY]
+
+align 8
+ap_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF	; 0x08 flat code
+	dq 0x00CF92000000FFFF	; 0x10 flat data
+ap_gdt_ptr:
+	dw 3 * 8 - 1
+	dd 0					; patched with the linear address of ap_gdt
+
+align 4
+ap_params:
+	times 6 dd 0
+ap_trampoline_end:
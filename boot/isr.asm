@@ -1,27 +1,100 @@
-; isr.asm - IRQ stubs for timer (IRQ0) and keyboard (IRQ1)
+; isr.asm - interrupt entry stubs for all 256 vectors
+; - vectors without a CPU error code push a 0 in its place, then every
+;   stub pushes its vector number, so the frame is the same for all
+; - isr_common saves registers and calls isr_dispatch() in idt.c with
+;   a pointer to the frame (irq_frame_t in idt.h)
+; - an interrupt from ring 3 arrives with the user's data segments, the
+;   kernel ones are loaded for the handler (%fs is this_cpu())
+; - SYSENTER keeps a user TF, so #DB can hit the first instruction of
+;   sysenter_entry, still on the MSR stack; that one never reaches C
 
 BITS 32
 
-global irq0
-global irq1
+global isr_stub_table
+global switch_to
 
-extern irq0_handler
-extern irq1_handler
+extern isr_dispatch
+extern sysenter_entry
 
-; each stub:
-; - saves registers
-; - calls C handler
-; - restores registers
-; - iret (iretd for 32-bit)
+section .text
 
-irq0:
+; vectors where the CPU pushes an error code: #DF #TS #NP #SS #GP #PF
+; #AC #CP #VC #SX
+%assign i 0
+%rep 256
+isr%[i]:
+%if i == 1
+    cmp dword [esp], sysenter_entry     ; #DB, frame eip
+    je sysenter_debug
+%endif
+%if i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30
+%else
+    push dword 0            ; dummy error code
+%endif
+    push dword i            ; vector
+    jmp isr_common
+%assign i i+1
+%endrep
+
+isr_common:
     pusha
-    call irq0_handler
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, 0x10            ; GDT_KDATA
+    mov ds, ax
+    mov es, ax
+    mov gs, ax
+    mov ax, 0x30            ; GDT_PERCPU
+    mov fs, ax
+    cld                     ; C code expects DF clear
+    push esp                ; irq_frame_t*
+    call isr_dispatch
+    add esp, 4
+    pop gs
+    pop fs
+    pop es
+    pop ds
     popa
+    add esp, 8              ; vector and error code
     iretd
 
-irq1:
-    pusha
-    call irq1_handler
-    popa
+; #DB with TF carried into sysenter_entry from ring 3: the frame sits on
+; cpu_t.sysenter_stack, clear TF in it and run the entry again untraced
+sysenter_debug:
+    and dword [esp+8], ~0x100   ; eflags.TF
     iretd
+
+; switch_to(uint32_t* save_esp, uint32_t new_esp) - kernel thread switch
+; - callee-saved registers go on the old stack, its esp into *save_esp
+; - the new stack was left the same way by an earlier switch_to, or
+;   built by thread_create() to return into thread_start
+; - a thread preempted in an interrupt switches from isr_dispatch and
+;   carries its interrupt frame along, the iretd happens when it is
+;   switched back in
+switch_to:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+section .rodata
+
+; stub addresses, idt_install() builds the gates from these
+align 4
+isr_stub_table:
+%assign i 0
+%rep 256
+    dd isr%[i]
+%assign i i+1
+%endrep
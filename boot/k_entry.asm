@@ -1,13 +1,44 @@
 ; k_entry.asm - panacheOS Stage 2 entry
-; - loaded at physical addr 0x001000 by st1.asm
+; - loaded at physical addr 0x001000 by st1.asm, which takes the image
+;   size from the header below
+; - turns on paging and continues in the higher half at KERNEL_VBASE
 
-BITS 16
+KERNEL_VBASE	equ 0xC0000000
+KERNEL_PDE		equ (KERNEL_VBASE >> 22)
+KERNEL_MAGIC	equ 0x48434E50		; "PNCH"
+MB_MAGIC		equ 0x1BADB002
+MB_FLAGS		equ 0x00000002		; want mem_* and the memory map
 
 global stage2_start
+global multiboot_entry
 global idt_flush
 extern kernel_main
+extern __kernel_sectors
+extern __bss_start
+extern __bss_end
+
+; runs at its physical address, before paging
+section .boot progbits alloc exec write align=16
+
+BITS 16
 
 stage2_start:
+	jmp short stage2_real
+
+	; image header, st1.asm reads it at offset 4
+	align 4, db 0
+kernel_header:
+	dd KERNEL_MAGIC
+	dd __kernel_sectors		; image size in 512-byte sectors, from link.ld
+
+	; Multiboot v1 header, must sit in the first 8 KiB of kEntry.elf
+	align 4, db 0
+multiboot_header:
+	dd MB_MAGIC
+	dd MB_FLAGS
+	dd -(MB_MAGIC + MB_FLAGS)
+
+stage2_real:
 	cli
 
 	; basic segments + rm stack
@@ -46,6 +77,63 @@ pm_entry:
 	mov gs, ax
 	mov ss, ax
 	mov esp, 0x90000		; 32-bit stack
+	xor esi, esi			; no Multiboot magic/info on the BIOS path
+	xor ebp, ebp
+	jmp paging_setup
+
+; direct boot by a Multiboot loader (qemu -kernel): already in 32-bit
+; protected mode with paging off, EAX = magic, EBX = info structure
+multiboot_entry:
+	cli
+	mov esi, eax			; kept in esi/ebp until kernel_main
+	mov ebp, ebx
+	lgdt [gdt_descriptor]	; the loader's GDT may be anywhere, use ours
+	jmp CODE_SEG:.reload
+.reload:
+	mov ax, DATA_SEG
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	mov esp, 0x90000
+
+paging_setup:
+	; zero .bss through its physical address, it is not in the image
+	cld
+	mov edi, __bss_start - KERNEL_VBASE
+	mov ecx, __bss_end
+	sub ecx, __bss_start
+	shr ecx, 2				; link.ld keeps both ends dword aligned
+	xor eax, eax
+	rep stosd
+
+	; boot page directory (zeroed with .bss): first 8 MiB identity mapped
+	; and mirrored at KERNEL_VBASE with 4 MiB pages, paging_init() replaces it
+	mov edi, boot_page_dir - KERNEL_VBASE
+	mov dword [edi], 0x00000083						; present, rw, 4 MiB
+	mov dword [edi + 4], 0x00400083
+	mov dword [edi + KERNEL_PDE * 4], 0x00000083
+	mov dword [edi + KERNEL_PDE * 4 + 4], 0x00400083
+
+	mov eax, cr4
+	or eax, 0x00000010		; CR4.PSE
+	mov cr4, eax
+	mov eax, boot_page_dir - KERNEL_VBASE
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80000000		; CR0.PG
+	mov cr0, eax
+
+	mov eax, higher_half
+	jmp eax					; continue at the virtual address
+
+section .text
+
+higher_half:
+	mov esp, KERNEL_VBASE + 0x90000	; same stack through the direct map
+	push ebp				; kernel_main(mb_magic, mb_info)
+	push esi
 	call kernel_main		; jump into C kernel
 .hang:
 	hlt						; halt CPU
@@ -55,3 +143,9 @@ idt_flush:
     mov eax, [esp+4]    ; first argument (pointer to idt_ptr)
     lidt [eax]
     ret
+
+section .bss
+
+align 4096
+boot_page_dir:
+	resb 4096
@@ -1,91 +1,90 @@
 ; st1.asm - panacheOS Stage 1 bootloader
+; - moves itself to linear 0x80000 so the kernel can grow past 0x7C00
+; - reads the kernel size from the image header (see k_entry.asm)
+; - loads with INT 13h extensions (LBA packets) in large batches, or
+;   track-at-a-time CHS reads when the BIOS has no extensions (floppies)
 
 BITS 16
 ORG 0x7C00
 
+RELOC_SEG		equ 0x7840		; 0x7840:0x7C00 = linear 0x80000
+KERNEL_LOAD		equ 0x1000
+KERNEL_LBA		equ 1			; image starts right after this sector
+KERNEL_MAGIC	equ 0x48434E50	; "PNCH"
+MAX_SECTORS		equ (0x80000 - KERNEL_LOAD) / 512
+LBA_BATCH		equ 127			; largest count every BIOS accepts
+
 start:
     cli
 
-    ; basic segments + stack
+    ; copy ourselves out of the way of the kernel image
     xor ax, ax
     mov ds, ax
+    mov si, 0x7C00
+    mov ax, RELOC_SEG
     mov es, ax
+    mov di, si
+    mov cx, 256
+    cld
+    rep movsw
+    jmp RELOC_SEG:relocated
+
+relocated:
+    ; segments + stack above the kernel load area
+    mov ax, cs
+    mov ds, ax
     mov ss, ax
-    mov di, MEMMAP_BUFFER
-    mov sp, 0x7C00
+    mov sp, 0xF000
+    sti
 
     ; BIOS gives us boot drive in DL
     mov [boot_drive], dl
 
-	mov si, msg_debug
-.print_loop_debug:
-	lodsb
-	cmp al, 0
-	je .after_debug
-	mov ah, 0x0E
-	mov bh, 0x00
-	mov bl, 0x07
-	int 0x10
-	jmp .print_loop_debug
-.after_debug:
-
-    ; reset/read disk system
-    mov ah, 0x00
-    mov dl, [boot_drive]
+    ; reset disk system
+    xor ax, ax
     int 0x13
     jc disk_error				; if reset fails, bail out
 
-    ; load stage 2 (kernel) from disk
-    mov si, 3
-
- read_stage2_retry:
-    ; destination: ES:BX = 0000:1000 (physical 0x1000)
-    xor ax, ax
-    mov es, ax
-    mov bx, 0x1000
-
-    mov ah, 0x02               ; INT 13h - read sectors
-    mov al, STAGE2_SECTORS     ; how many sectors to read
-    mov ch, 0x00               ; cylinder 0
-    mov dh, 0x00               ; head 0
-    mov cl, 0x02               ; start at sector 2 (sector 1 is this boot sector)
-    mov dl, [boot_drive]       ; boot drive
+    ; INT 13h extensions present?
+    mov ah, 0x41
+    mov bx, 0x55AA
+    mov dl, [boot_drive]
     int 0x13
-	jnc read_st2_ok			   ; CF=0 > success
+    jc .geometry
+    cmp bx, 0xAA55
+    jne .geometry
+    test cl, 1					; packet interface supported
+    jz .geometry
+    inc byte [use_lba]
 
-	; if we get here: read failed
-	dec si
-	jnz read_stage2_retry
+.geometry:
+    ; drive geometry for the CHS path, keeps the 1.44M defaults on failure
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    int 0x13
+    jc .load
+    and cx, 0x3F
+    mov [sectors_per_track], cx
+    mov dl, dh
+    xor dh, dh
+    inc dx
+    mov [heads], dx
 
-disk_error:
-    ; print a simple error message using BIOS teletype
-    mov si, msg_disk_error
-.print_loop:
-    lodsb
-    cmp al, 0
-    je .hang
-    mov ah, 0x0E
-    mov bh, 0x00
-    mov bl, LOG_ERR_COLOR           
-    int 0x10
-    jmp .print_loop
-.hang:
-    cli
-    hlt
-    jmp .hang
+.load:
+    ; header sector first, it tells us how much to read
+    call read_sectors			; cur_lba/cur_seg/left preset to sector 1
+    mov ax, KERNEL_LOAD >> 4
+    mov es, ax
+    cmp dword [es:4], KERNEL_MAGIC
+    jne image_error
+    mov cx, [es:8]				; image size in sectors
+    cmp cx, MAX_SECTORS
+    ja image_error
+    dec cx
+    mov [left], cx
+    call read_sectors
 
-read_st2_ok:
-	mov si, msg_loaded
-.print_loaded:
-	lodsb
-	cmp al, 0
-	je .after_loaded
-	mov ah, 0x0E
-	mov bh, 0x00
-	mov bl, 0x07
-	int 0x10
-	jmp .print_loaded
-.after_loaded:
+	; E820 memory map to 0000:0500, entry count to 0000:04F0
 	xor ax, ax
 	mov es, ax
 	mov di, MEMMAP_BUFFER
@@ -95,41 +94,167 @@ repeat:
 	mov eax, 0xE820
 	mov edx, 0x534D4150		; set signature at addr
 	mov ecx, 24				; gimme 24 bytes plz
-	mov di, di
 	int 0x15
-	jc fbyte_error
+	jc .e820_done			; carry after the first entry means end of list
 
 	cmp eax, 0x534D4150		; verify signature
-	jc sig_error
+	jne mem_error
 
 	inc bp
 	add di, 24
 	test ebx, ebx			; have we reached end
 	jne repeat
-	mov [MEMMAP_COUNT], bp
-	jmp 0x0000:0x1000		; jump to st2asm / stage2 loaded at 0000:1000
+.e820_done:
+	test bp, bp
+	jz mem_error
+	mov [es:MEMMAP_COUNT], bp
+	cli
+	jmp 0x0000:KERNEL_LOAD	; jump to st2asm / stage2 loaded at 0000:1000
+
+; read [left] sectors starting at [cur_lba] to [cur_seg]:0000
+read_sectors:
+    mov cx, [left]
+    test cx, cx
+    jz .done
+
+    ; never cross a 64 KiB boundary (ISA DMA), never exceed LBA_BATCH
+    mov ax, [cur_seg]
+    and ax, 0x0FFF
+    neg ax
+    add ax, 0x1000
+    shr ax, 5					; sectors until the boundary
+    cmp cx, ax
+    jbe .clip_batch
+    mov cx, ax
+.clip_batch:
+    cmp cx, LBA_BATCH
+    jbe .clipped
+    mov cx, LBA_BATCH
+.clipped:
+    cmp byte [use_lba], 0
+    jne .lba
 
-sig_error:
-	mov si, msg_memsig_error
-fbyte_error:
-	mov si, msg_fbyte_error
+    ; CHS: LBA -> cylinder/head/sector, stop at the end of the track
+    mov ax, [cur_lba]
+    xor dx, dx
+    div word [sectors_per_track]	; ax = track, dx = sector - 1
+    mov bx, [sectors_per_track]
+    sub bx, dx
+    cmp cx, bx
+    jbe .chs_read
+    mov cx, bx
+.chs_read:
+    mov [batch], cx
+    inc dx
+    push dx						; 1-based sector
+    xor dx, dx
+    div word [heads]			; ax = cylinder, dx = head
+    mov dh, dl
+    pop cx
+    shl ah, 6					; cylinder bits 8-9 go to CL bits 6-7
+    or cl, ah
+    mov ch, al					; cylinder bits 0-7
+    mov al, [batch]
+    mov ah, 0x02
+    mov dl, [boot_drive]
+    mov bx, [cur_seg]
+    mov es, bx
+    xor bx, bx
+    int 0x13
+    jmp .check
+
+.lba:
+    mov [batch], cx
+    mov [dap_count], cx
+    mov ax, [cur_seg]
+    mov [dap_seg], ax
+    mov ax, [cur_lba]
+    mov [dap_lba], ax
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [boot_drive]
+    int 0x13
+
+.check:
+    jnc .advance
+    dec byte [retries]
+    jz disk_error
+    xor ax, ax					; reset and retry this batch
+    mov dl, [boot_drive]
+    int 0x13
+    jmp read_sectors
+
+.advance:
+    mov byte [retries], 3
+    mov cx, [batch]
+    sub [left], cx
+    add [cur_lba], cx
+    shl cx, 5					; 32 paragraphs per sector
+    add [cur_seg], cx
+    jmp read_sectors
+.done:
+    ret
+
+disk_error:
+    mov si, msg_disk_error
+    jmp error
+image_error:
+    mov si, msg_image_error
+    jmp error
+mem_error:
+    mov si, msg_mem_error
+
+; print message in red and stop
+error:
+    mov bl, LOG_ERR_COLOR
+    call print
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+; print zero-terminated ds:si in color bl using BIOS teletype
+print:
+    mov bh, 0x00
+.loop:
+    lodsb
+    test al, al
+    jz .done
+    mov ah, 0x0E
+    int 0x10
+    jmp .loop
+.done:
+    ret
 
 ; DATA
 
-boot_drive: db 0
+boot_drive:			db 0
+use_lba:			db 0
+retries:			db 3
+sectors_per_track:	dw 18
+heads:				dw 2
+batch:				dw 0
+
+; next read, preset for the header sector; the image ends well below
+; LBA 65536, so 16 bits are enough
+cur_lba:			dw KERNEL_LBA
+cur_seg:			dw KERNEL_LOAD >> 4
+left:				dw 1
+
+; INT 13h AH=42h disk address packet
+dap:				db 0x10, 0
+dap_count:			dw 0
+					dw 0			; offset, always 0
+dap_seg:			dw 0
+dap_lba:			dd 0, 0
 
-; how many sectors of Stage 2 to load
-; 1 sector = 512 bytes. 8 sectors = 4096 bytes.
-STAGE2_SECTORS equ 32
 MEMMAP_BUFFER equ 0x0500
 
 MEMMAP_COUNT equ 0x04F0
 
-msg_disk_error: db "Disk read error", 0
-msg_memsig_error: db "Error getting valid memory map signature", 0
-msg_fbyte_error: db "Error fetching memory", 0
-msg_debug: db "Hi...",13,10,0
-msg_loaded: db "Stage2 loaded jump to kernel", 13, 10, 0
+msg_disk_error: db "Disk error", 0
+msg_image_error: db "Bad image", 0
+msg_mem_error: db "E820 error", 0
 LOG_ERR_COLOR	equ 0x0C ; color for error msg (light red)
 
 ; boot sector signature
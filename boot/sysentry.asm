@@ -0,0 +1,138 @@
+; sysentry.asm - system call entry from ring 3, and the way out to it
+; - int 0x80 and SYSENTER both build an irq_frame_t (idt.h) on the
+;   thread's kernel stack and call syscall_dispatch() in syscall.c with
+;   interrupts on; the result goes back in the frame's eax
+; - SYSENTER loads ESP from an MSR that points at this CPU's
+;   sysenter_esp0 (smp.h), which holds &tss.esp0, which holds the running
+;   process's kernel stack top; the words below sysenter_esp0 are a
+;   small stack for the #DB a user TF raises on the first instruction
+; - vsyscall_page is copied into a page mapped read-only into every
+;   process at USER_VSYSCALL (syscall.h); its SYSENTER stub keeps the user
+;   stack pointer in ebp, SYSEXIT returns to the instruction after it
+
+BITS 32
+
+global syscall_int80
+global sysenter_entry
+global enter_user
+global vsyscall_page
+global vsyscall_page_end
+
+extern syscall_dispatch
+
+USER_VSYSCALL   equ 0xBFFFF000  ; syscall.h
+SYSENTER_FRAME  equ 0x100       ; irq_frame_t.vector of a SYSENTER call
+SYSENTER_RET    equ USER_VSYSCALL + (vsys_sysenter_ret - vsyscall_page)
+
+%macro SAVE_SEGMENTS 0
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, 0x10            ; GDT_KDATA
+    mov ds, ax
+    mov es, ax
+    mov gs, ax
+    mov ax, 0x30            ; GDT_PERCPU
+    mov fs, ax
+%endmacro
+
+%macro RESTORE_SEGMENTS 0
+    pop gs
+    pop fs
+    pop es
+    pop ds
+%endmacro
+
+section .text
+
+; int 0x80, through a ring 3 interrupt gate
+syscall_int80:
+    push dword 0            ; error code
+    push dword 0x80         ; SYSCALL_VECTOR
+    pusha
+    SAVE_SEGMENTS
+    cld
+    sti
+    push esp                ; irq_frame_t*
+    call syscall_dispatch
+    add esp, 4
+    cli
+    RESTORE_SEGMENTS
+    popa
+    add esp, 8
+    iretd
+
+; SYSENTER: CS/SS from the MSRs, interrupts off, nothing saved; the user
+; return address is fixed and the stub left its esp in ebp
+sysenter_entry:
+    mov esp, [esp]          ; &tss.esp0
+    mov esp, [esp]          ; tss.esp0
+    push dword 0x23         ; user ss
+    push ebp                ; user esp
+    pushfd
+    or dword [esp], 0x200   ; the user's IF, SYSENTER cleared it
+    push dword 0x2          ; SYSENTER keeps the user's NT, AC and DF:
+    popfd                   ; an iretd with NT set would switch tasks
+    push dword 0x1B         ; user cs
+    push dword SYSENTER_RET
+    push dword 0
+    push dword SYSENTER_FRAME
+    pusha
+    SAVE_SEGMENTS
+    cld
+    sti
+    push esp
+    call syscall_dispatch
+    add esp, 4
+    cli
+    RESTORE_SEGMENTS
+    popa
+    add esp, 8
+    mov edx, [esp]          ; eip
+    mov ecx, [esp+12]       ; esp
+    sti                     ; takes effect after sysexit
+    sysexit
+
+; enter_user(uint32_t eip, uint32_t esp) - first switch of a process
+; thread to ring 3, never returns; registers start out zeroed
+enter_user:
+    cli
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+    mov cx, 0x23            ; GDT_UDATA | 3
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    push dword 0x23         ; ss
+    push edx                ; esp
+    push dword 0x202        ; eflags, IF
+    push dword 0x1B         ; cs, GDT_UCODE | 3
+    push eax                ; eip
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    iretd
+
+section .rodata
+
+; offsets as in syscall.h: VSYS_INT80, VSYS_SYSENTER, VSYS_ENTRY
+align 16
+vsyscall_page:
+    int 0x80
+    ret
+    times 0x10 - ($ - vsyscall_page) db 0xCC
+    push ebp
+    mov ebp, esp
+    sysenter
+vsys_sysenter_ret:
+    pop ebp
+    ret
+    times 0x20 - ($ - vsyscall_page) db 0xCC
+    dd 0                    ; filled in by syscall_init()
+vsyscall_page_end:
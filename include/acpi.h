@@ -0,0 +1,24 @@
+// acpi.h - just enough ACPI to find firmware tables
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#pragma once
+#include <stdint.h>
+
+typedef struct {
+	char signature[4];
+	uint32_t length;		// including this header
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// the table with this signature, ioremap()ed; NULL if missing or corrupt
+acpi_header_t* acpi_find_table(const char* signature);
+
+#endif
@@ -0,0 +1,42 @@
+// apic.h - local APIC and IOAPIC
+
+#ifndef APIC_H
+#define APIC_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APIC_MAX_CPUS		16
+#define APIC_SPURIOUS_VECTOR	0xFF
+
+// ICR low word
+#define ICR_FIXED			0x000
+#define ICR_INIT			0x500
+#define ICR_STARTUP			0x600
+#define ICR_ASSERT			0x4000
+#define ICR_ALL_BUT_SELF	0xC0000
+
+extern bool apic_active;		// interrupts go through LAPIC/IOAPIC, 8259 masked
+extern bool x2apic;				// LAPIC registers are MSRs
+extern uint32_t lapic_timer_hz;	// after lapic_timer_calibrate(), divide by 16
+
+// from the MADT, enabled processors only
+extern uint8_t apic_cpu_ids[APIC_MAX_CPUS];
+extern int apic_cpu_count;
+
+bool apic_init(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+void lapic_ap_init(void);
+void ioapic_route(uint8_t irq, uint8_t vector);
+
+bool lapic_timer_calibrate(void);
+void lapic_timer_periodic(uint8_t vector, uint32_t count);
+void lapic_timer_oneshot(uint8_t vector, uint32_t count);
+uint32_t lapic_timer_current(void);
+
+void print_apicinfo(void);
+
+#endif
@@ -0,0 +1,15 @@
+// bench.h - hot path benchmark suite
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#pragma once
+#include <stdint.h>
+
+#define BENCH_EXIT_PORT		0xF4	// QEMU isa-debug-exit, iobase in 'make bench'
+
+uint32_t bench_median(uint32_t* v, int n);
+uint32_t bench_run(void);
+void bench_thread(void* arg);
+
+#endif
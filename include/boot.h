@@ -0,0 +1,24 @@
+// boot.h - boot information from stage 1 or a Multiboot loader
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+#define MULTIBOOT_BOOT_MAGIC	0x2BADB002	// in EAX from the loader
+#define BOOT_CMDLINE_MAX		256
+
+// raw memory map, before memory_init() sanitizes it
+extern e820_entry_t boot_memmap[E820_MAX];
+extern int boot_memmap_count;
+
+extern char boot_cmdline[BOOT_CMDLINE_MAX];
+extern bool boot_multiboot;
+
+void boot_info_init(uint32_t mb_magic, uint32_t mb_info);
+bool boot_option(const char* name);
+
+#endif
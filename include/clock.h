@@ -0,0 +1,21 @@
+// clock.h - clocksource: calibrated TSC, PIT ticks as the fallback
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAL_PIT_COUNT		11932	// ~10 ms of PIT input clocks
+
+extern uint32_t tsc_khz;		// 0 when the PIT tick is the clocksource
+
+void clock_init(void);
+void pit2_start(uint16_t count);
+bool pit2_wait(void);
+uint64_t ktime_ns(void);
+uint64_t ktime_us(void);
+void print_uptime(void);
+
+#endif
@@ -0,0 +1,121 @@
+// cpu.h - CPUID and control register helpers
+
+#ifndef CPU_H
+#define CPU_H
+
+#pragma once
+#include <stdint.h>
+
+// CR0 bits
+#define CR0_PE		(1u << 0)
+#define CR0_MP		(1u << 1)
+#define CR0_EM		(1u << 2)
+#define CR0_TS		(1u << 3)
+#define CR0_PG		(1u << 31)
+
+// CR4 bits
+#define CR4_PSE			(1u << 4)
+#define CR4_PGE			(1u << 7)
+#define CR4_OSFXSR		(1u << 9)
+#define CR4_OSXMMEXCPT	(1u << 10)
+
+// CPUID leaf 1, EDX
+#define CPUID_EDX_PSE	(1u << 3)
+#define CPUID_EDX_TSC	(1u << 4)
+#define CPUID_EDX_APIC	(1u << 9)
+#define CPUID_EDX_SEP	(1u << 11)
+#define CPUID_EDX_PGE	(1u << 13)
+#define CPUID_EDX_FXSR	(1u << 24)
+#define CPUID_EDX_SSE	(1u << 25)
+#define CPUID_EDX_SSE2	(1u << 26)
+
+// CPUID leaf 1, ECX
+#define CPUID_ECX_X2APIC	(1u << 21)
+
+// CPUID leaf 7, EBX
+#define CPUID7_EBX_ERMS	(1u << 9)
+
+// cpu_features bits, filled in once by cpu_init()
+#define CPU_FEAT_PSE	(1u << 0)
+#define CPU_FEAT_PGE	(1u << 1)
+#define CPU_FEAT_FXSR	(1u << 2)
+#define CPU_FEAT_SSE	(1u << 3)
+#define CPU_FEAT_SSE2	(1u << 4)
+#define CPU_FEAT_ERMS	(1u << 5)	// fast rep movsb/stosb
+#define CPU_FEAT_TSC	(1u << 6)
+#define CPU_FEAT_APIC	(1u << 7)
+#define CPU_FEAT_X2APIC	(1u << 8)
+#define CPU_FEAT_SEP	(1u << 9)	// SYSENTER/SYSEXIT
+
+extern uint32_t cpu_features;
+extern char cpu_vendor[13];
+
+void cpu_init(void);
+void print_cpuinfo(void);
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+	__asm__ __volatile__("cpuid"
+		: "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+		: "a"(leaf), "c"(0));
+}
+
+static inline uint32_t read_cr0(void) {
+	uint32_t v; __asm__ __volatile__("mov %%cr0, %0" : "=r"(v)); return v;
+}
+
+static inline void write_cr0(uint32_t v) {
+	__asm__ __volatile__("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+	uint32_t v; __asm__ __volatile__("mov %%cr2, %0" : "=r"(v)); return v;
+}
+
+static inline uint32_t read_cr3(void) {
+	uint32_t v; __asm__ __volatile__("mov %%cr3, %0" : "=r"(v)); return v;
+}
+
+static inline void write_cr3(uint32_t v) {
+	__asm__ __volatile__("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+	uint32_t v; __asm__ __volatile__("mov %%cr4, %0" : "=r"(v)); return v;
+}
+
+static inline void write_cr4(uint32_t v) {
+	__asm__ __volatile__("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// disable interrupts, returning the old EFLAGS for irq_restore
+static inline uint32_t irq_save(void) {
+	uint32_t flags;
+	__asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+	if (flags & (1u << 9)) __asm__ __volatile__("sti" : : : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+	__asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void invlpg(uint32_t addr) {
+	__asm__ __volatile__("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+#endif
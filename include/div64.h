@@ -0,0 +1,18 @@
+// div64.h - 64-bit by 32-bit division without libgcc
+
+#ifndef DIV64_H
+#define DIV64_H
+
+#pragma once
+#include <stdint.h>
+
+// two divl steps, high half first, so the quotient may use all 64 bits
+static inline uint64_t udiv64_32(uint64_t n, uint32_t d, uint32_t* rem) {
+	uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+	uint32_t q_hi = hi / d, r = hi % d, q_lo;
+	__asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+	if (rem) *rem = r;
+	return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+#endif
@@ -0,0 +1,27 @@
+// fpu.h - lazy FPU/SSE state switching
+
+#ifndef FPU_H
+#define FPU_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "smp.h"
+
+#define FXSAVE_SIZE		512
+#define FPU_NO_CPU		0xFF	// thread_t.fpu_cpu before its first trap
+
+void fpu_init(void);
+void fpu_cpu_init(void);
+void fpu_switch(cpu_t* cpu, thread_t* prev);
+void print_fpuinfo(void);
+
+// SIMD code paths check this first: interrupt handlers must leave the
+// vector registers alone, they belong to the interrupted thread, and so
+// do system calls, the registers hold the process's state
+static inline bool fpu_usable(void) {
+	cpu_t* cpu = this_cpu();
+	return cpu->current && !cpu->current->proc && !cpu->irq_depth;
+}
+
+#endif
@@ -0,0 +1,36 @@
+// gdt.h - per-CPU GDT and TSS
+
+#ifndef GDT_H
+#define GDT_H
+
+#pragma once
+#include <stdint.h>
+
+// selectors; SYSENTER/SYSEXIT derive the other three from GDT_KCODE, so
+// the ring 3 pair follows the kernel pair
+#define GDT_KCODE		0x08
+#define GDT_KDATA		0x10
+#define GDT_UCODE		0x18	// load with RPL 3: 0x1B
+#define GDT_UDATA		0x20	// 0x23
+#define GDT_TSS			0x28
+#define GDT_PERCPU		0x30	// %fs, based at this CPU's cpu_t
+#define GDT_ENTRIES		7
+
+typedef struct {
+	uint32_t prev;
+	uint32_t esp0, ss0;		// stack for entries from ring 3
+	uint32_t esp1, ss1;
+	uint32_t esp2, ss2;
+	uint32_t cr3, eip, eflags;
+	uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+	uint32_t es, cs, ss, ds, fs, gs;
+	uint32_t ldt;
+	uint16_t trap;
+	uint16_t iomap;
+} __attribute__((packed)) tss_t;
+
+struct cpu;
+
+void gdt_init(struct cpu* cpu);
+
+#endif
@@ -5,7 +5,32 @@
 
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+
+#define IDT_ENTRIES 256
+
+// stack frame built by isr_common in isr.asm, lowest address first; the
+// syscall entries in sysentry.asm build the same one
+typedef struct {
+    uint32_t gs, fs, es, ds;	// the interrupted code's, ring 3 has its own
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;	// pusha
+    uint32_t vector;
+    uint32_t err;				// CPU error code, 0 when there is none
+    uint32_t eip, cs, eflags;	// pushed by the CPU
+    uint32_t user_esp, user_ss;	// only when coming from ring 3 (cs & 3)
+} irq_frame_t;
+
+typedef void (*irq_handler_t)(irq_frame_t* frame, void* ctx);
 
 void idt_install(void);
+void idt_load(void);
+void idt_set_user_gate(uint8_t vector, void (*entry)(void));
+
+// claim a vector; fails if another handler already owns it. Handlers
+// of hardware IRQs send their own EOI (irq_eoi in irq.h)
+bool irq_register(uint8_t vector, irq_handler_t handler, void* ctx);
+void irq_unregister(uint8_t vector);
+
+void print_intrstats(void);
 
 #endif
@@ -6,14 +6,16 @@
 #pragma once
 
 #define INPUT_MAX 80
-#define MAX_DELAYS 4
+#define PIT_HZ 1193182u		// PIT input clock
+#define IRQ_VECTOR_BASE 0x20	// ISA IRQ n arrives on vector 0x20 + n
 
 #include <stdint.h>
 #include <stdbool.h>
 
 void irq_init(void);
-void delay(uint32_t sec);
-void check_delays(void);
+void irq_ap_init(void);
+void irq_enable(uint8_t irq);
+void irq_eoi(uint8_t irq);
 void handle_command(const char* cmd);
 void save_to_history(void);
 void kclear_screen(void);
@@ -28,14 +30,29 @@ extern volatile int line_ready;
 extern int input_len;
 
 typedef void (*delay_callback_t)(void);
-typedef struct {
-	uint32_t target_tick;
-	bool active;
-	delay_callback_t callback;
-} delay_t;
-
-extern delay_t delays[MAX_DELAYS];
 
+typedef struct {
+	uint32_t scancodes;		// pushed by irq1
+	uint32_t overflows;		// lost because the ring was full
+	uint32_t dropped;		// decoded but the input line was full
+	uint32_t max_depth;		// ring high-water mark
+} kbd_stats_t;
+
+extern kbd_stats_t kbd_stats;
+
+void kbd_process(void);
+void kbd_wait(void);
+void input_wake(void);
+void cpu_idle(void);
+void print_idleinfo(void);
+void print_irqlat(void);
+bool irq_bench_timer(uint32_t* delivery, uint32_t* handler);
+bool irq_bench_kbd(uint32_t* delivery, uint32_t* handler);
+
+extern bool tickless;
+void print_kbdinfo(void);
+
+// one-shot wrappers over the timer wheel, see timer.c
 bool start_delay(uint32_t ms, delay_callback_t cb);
 
 #endif
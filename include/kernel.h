@@ -3,6 +3,11 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
 // VGA colors (fg)
 #define VGA_COLOR_BLACK		0x00
 #define VGA_COLOR_BLUE		0x01
@@ -26,14 +31,30 @@
 #define BG_COLOR VGA_COLOR_BLACK
 
 void kputchar(char c);
+void kwrite(const char* buf, size_t len);
+void kwrite_color(const char* buf, size_t len, uint8_t fg);
 void kprint(const char* s);
 void kprintln(const char* s);
 void kprint_int(int value);
 void kprint_hex(uint32_t value);
+// uint32_t is unsigned long on i686-elf: cast it to unsigned for %u/%x
+int kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap);
+void fmt_bench(void);
+void kflush(void);
+void kconsole_hold(void);
+void kconsole_release(void);
+void kconsole_sync(void);
+bool kconsole_serial(bool on);
+bool kconsole_vga(bool on);
+void print_console_stats(void);
 
 void kprint_help(void);
 void handle_command(const char* cmd);
+unsigned int tokenize(const char* input, char* tokens[], unsigned int max_tokens);
 void shutdown(void);
+void kpanic(const char* msg);
 
 void move_cursor_left(void);
 void move_cursor_right(void);
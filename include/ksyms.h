@@ -0,0 +1,25 @@
+// ksyms.h - kernel symbol table, generated at build time
+
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#pragma once
+#include <stdint.h>
+
+typedef struct {
+	uint32_t addr;
+	const char* name;
+} ksym_t;
+
+// tools/ksyms.awk writes these from the first link pass, see the Makefile
+extern const ksym_t ksyms[];
+extern const uint32_t ksyms_count;
+
+// link.ld
+extern const uint8_t __text_start[];
+extern const uint8_t __text_end[];
+
+int ksym_index(uint32_t addr);
+const char* ksym_name(uint32_t addr, uint32_t* offset);
+
+#endif
@@ -0,0 +1,32 @@
+// log.h - kernel log ring, replayed by dmesg
+
+#ifndef LOG_H
+#define LOG_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// levels, most severe first
+#define LOG_ERR				0
+#define LOG_WARN			1
+#define LOG_INFO			2
+#define LOG_DEBUG			3
+#define LOG_LEVELS			4
+
+#define LOG_TEXT_MAX		112		// per record, longer messages are cut
+
+int log_level_parse(const char* name);	// -1 if unknown
+void klog_init(void);
+void klog_thread_init(void);
+void klog(int level, const char* msg);
+void klog_write(int level, const char* buf, size_t len);
+void klogf(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void klog_flush(void);
+void klog_panic(void);
+void klog_console_level(int level);
+void dmesg(int level);
+void print_loginfo(void);
+
+#endif
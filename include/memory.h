@@ -4,8 +4,57 @@
 #define MEMORY_H
 
 #pragma once
+#include <stdint.h>
 
+#define PAGE_SIZE		4096
+#define PAGE_SHIFT		12
+#define E820_MAX		32
+
+// E820 region types
+#define E820_USABLE		1
+#define E820_RESERVED	2
+#define E820_ACPI		3
+#define E820_NVS		4
+#define E820_BAD		5
+
+typedef struct {
+	uint64_t base;
+	uint64_t length;
+	uint32_t type;
+	uint32_t acpi;		// ACPI 3.0 extended attributes
+} __attribute__((packed)) e820_entry_t;
+
+typedef struct {
+	uint32_t total_frames;		// frames covered by usable E820 regions
+	uint32_t free_frames;
+	uint32_t reserved_frames;	// usable frames carved out at boot
+	uint32_t alloc_calls;
+	uint32_t free_calls;
+	uint32_t cache_hits;		// allocations served from the free-run cache
+	uint32_t failed_allocs;
+} meminfo_t;
+
+// sanitized (sorted, merged) memory map
+extern e820_entry_t memmap[E820_MAX];
+extern int memmap_count;
+
+void memory_init(void);
+
+// physical frame allocator, addresses are physical, 0 means failure
+uint32_t pmm_alloc_frame(void);
+void pmm_free_frame(uint32_t addr);
+uint32_t pmm_alloc_frames(uint32_t count);
+uint32_t pmm_alloc_frames_aligned(uint32_t count, uint32_t align);
+void pmm_free_frames(uint32_t addr, uint32_t count);
+uint32_t pmm_alloc_low_frame(void);
+void pmm_get_meminfo(meminfo_t* info);
+
+// slab heap, objects up to 2048 bytes come from size classes
 void* kmalloc(uint32_t size);
-void* get_memmap_count(void);
+void kfree(void* ptr);
+
+void get_memmap_count(void);
+void print_meminfo(void);
+void print_slabinfo(void);
 
 #endif
@@ -0,0 +1,62 @@
+// paging.h
+
+#ifndef PAGING_H
+#define PAGING_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "idt.h"
+
+// virtual memory layout
+//   0x00000000 - 0x003FFFFF  identity map of low memory (page 0 unmapped)
+//   0x00400000 - 0xBFFFFFFF  user space of the running process, if any
+//   0xC0000000 - 0xEFFFFFFF  direct map of physical RAM, 4 MiB pages,
+//                            kernel image at 0xC0001000
+//   0xF0000000 - 0xF7FFFFFF  vmap area, 4 KiB pages with guard pages
+#define KERNEL_VBASE		0xC0000000
+#define DIRECT_MAP_SIZE		0x30000000
+#define VMAP_START			0xF0000000
+#define VMAP_END			0xF8000000
+
+#define PHYS_TO_VIRT(p)		((void*)((uint32_t)(p) + KERNEL_VBASE))
+#define VIRT_TO_PHYS(v)		((uint32_t)(v) - KERNEL_VBASE)
+
+// page directory / table entry bits
+#define PTE_PRESENT			0x001
+#define PTE_WRITE			0x002
+#define PTE_USER			0x004
+#define PTE_PWT				0x008
+#define PTE_PCD				0x010
+#define PTE_ACCESSED		0x020
+#define PTE_DIRTY			0x040
+#define PTE_LARGE			0x080	// PDE maps a 4 MiB page
+#define PTE_GLOBAL			0x100
+#define PTE_SHARED			0x200	// available bit: frame not owned by the directory
+#define PTE_FRAME			0xFFFFF000
+
+#define LARGE_PAGE_SIZE		0x00400000
+
+// vmap flags
+#define VM_WRITE			0x01
+#define VM_LAZY				0x02	// back pages with zeroed frames on first touch
+#define VM_IO				0x04	// device memory from ioremap(), never freed
+
+extern uint32_t kernel_cr3;
+
+void paging_init(void);
+
+// process page directories, by physical address; user mappings only
+uint32_t pgdir_create(void);
+uint32_t pgdir_alloc(uint32_t pd, uint32_t va, uint32_t flags);
+bool pgdir_map(uint32_t pd, uint32_t va, uint32_t frame, uint32_t flags);
+uint32_t pgdir_lookup(uint32_t pd, uint32_t va);
+void pgdir_destroy(uint32_t pd);
+
+void* vmap(uint32_t pages, uint32_t flags, const char* name);
+void* ioremap(uint32_t phys, uint32_t size, const char* name);
+void vunmap(void* addr);
+void page_fault_handler(irq_frame_t* frame, void* ctx);
+void print_vmareas(void);
+
+#endif
@@ -0,0 +1,26 @@
+// perf.h - sampling profiler on the timer tick
+
+#ifndef PERF_H
+#define PERF_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "idt.h"
+
+#define PERF_SHIFT			4		// 16-byte buckets, one per aligned block of code
+#define PERF_TOP			16		// functions in a report
+
+extern volatile bool perf_running;
+
+void perf_record(irq_frame_t* frame);
+void perf_start(void);
+void perf_stop(void);
+void perf_report(void);
+
+// from irq0_handler, on every CPU's tick
+static inline void perf_sample(irq_frame_t* frame) {
+	if (perf_running) perf_record(frame);
+}
+
+#endif
@@ -0,0 +1,54 @@
+// process.h - user processes and system calls
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "idt.h"
+#include "sched.h"
+#include "syscall.h"
+
+#define PROC_ARGS_MAX		16
+#define PROC_KILLED			-1		// exit code of a process killed by a fault
+#define SYSENTER_FRAME		0x100	// irq_frame_t.vector of a SYSENTER call
+
+struct cpu;
+
+// one ring 3 thread in an address space of its own; owned by whoever
+// spawned it, process_wait() frees it
+typedef struct process {
+	uint32_t pid;
+	uint32_t cr3;				// page directory, physical
+	uint32_t entry;
+	uint32_t user_esp;			// initial, argc and argv on top
+	volatile bool exited;
+	bool killed;				// by a fault, exits instead of returning to ring 3
+	int exit_code;
+	uint32_t sysenter_calls;
+	uint32_t int80_calls;
+	char name[THREAD_NAME_MAX];
+	struct process* next;		// live processes
+} process_t;
+
+// process.c
+bool process_exists(const char* name);
+process_t* process_spawn(const char* name, int argc, char** argv);
+int process_wait(process_t* p);
+void process_exit(int code) __attribute__((noreturn));
+void process_fault(irq_frame_t* frame, const char* what);
+void process_check_killed(void);
+void process_switch(struct cpu* cpu, thread_t* next);
+bool process_access_ok(process_t* p, uint32_t addr, uint32_t len, bool write);
+void print_processes(void);
+
+// syscall.c
+extern uint32_t vsyscall_frame;
+
+void syscall_init(void);
+void syscall_cpu_init(struct cpu* cpu);
+void syscall_dispatch(irq_frame_t* frame);
+bool syscall_fast(void);
+
+#endif
@@ -0,0 +1,106 @@
+// sched.h - kernel threads, per-CPU priority run queues and wait queues
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+#define SCHED_PRIOS			32		// 0 is the highest, the last one is idle's
+#define PRIO_TIMER			2
+#define PRIO_SHELL			8
+#define PRIO_LOG			12
+#define PRIO_DEFAULT		16
+#define SCHED_SLICE			10		// ticks before yielding to an equal priority
+
+#define THREAD_STACK_PAGES	4
+#define THREAD_NAME_MAX		16
+
+// thread states
+#define THREAD_READY		0
+#define THREAD_RUNNING		1
+#define THREAD_BLOCKED		2
+#define THREAD_DEAD			3
+
+typedef void (*thread_fn_t)(void* arg);
+
+struct wait_queue;
+struct process;
+
+typedef struct thread {
+	uint32_t esp;				// saved by switch_to, keep first
+	uint32_t id;
+	uint8_t prio;
+	uint8_t state;
+	uint8_t slice;				// ticks left before round-robin
+	bool timed_out;				// last wq_wait ended by its timeout
+	volatile bool on_cpu;		// its stack is in use until switched away from
+	uint8_t cpu;				// CPU it last ran on, wakeups queue it there
+	int8_t bound;				// only runs on this CPU, -1 for any
+	bool fpu_used;				// FPU state live in registers, save on switch
+	uint8_t fpu_cpu;			// CPU that last loaded its FPU state
+	void* fpu;					// FXSAVE area, allocated on first FPU use
+	struct process* proc;		// user process it runs, NULL for kernel threads
+	char name[THREAD_NAME_MAX];
+	void* stack;				// vmap'd, NULL for the boot thread
+	thread_fn_t fn;
+	void* arg;
+	struct thread* next;		// run queue, wait queue or zombie list
+	struct wait_queue* wq;		// queue we are blocked on, if any
+	struct thread* sleep_next;	// timed sleepers, sorted by wake_tick
+	uint32_t wake_tick;
+	uint32_t ticks;				// ticks charged while running
+	uint32_t switches;			// times switched in
+	struct thread* all_next;
+} thread_t;
+
+// FIFO of blocked threads
+typedef struct wait_queue {
+	thread_t* head;
+} wait_queue_t;
+
+// one per CPU, rq_* helpers in sched.c; taken after sched_lock
+typedef struct {
+	spinlock_t lock;
+	struct {
+		thread_t* head;
+		thread_t* tail;
+	} prio[SCHED_PRIOS];
+	uint32_t ready_map;			// bit p set while prio[p] is not empty
+	uint32_t nr_ready;
+	uint32_t nr_bound;			// of those, bound here and not stealable
+} run_queue_t;
+
+struct cpu;
+
+void sched_init(struct cpu* cpu);
+void sched_idle(void) __attribute__((noreturn));
+
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg, uint8_t prio);
+void thread_exit(void) __attribute__((noreturn));
+void thread_yield(void);
+void thread_sleep(uint32_t ms);
+
+void thread_bind(int cpu);
+
+// check a wait condition under wq_lock(), then block on wq (may be NULL)
+// for at most timeout ticks, 0 waits forever; wq_wait returns with the
+// lock held again, false on timeout
+uint32_t wq_lock(void);
+void wq_unlock(uint32_t flags);
+bool wq_wait(wait_queue_t* wq, uint32_t timeout);
+void wake_up(wait_queue_t* wq);
+
+void preempt_disable(void);
+void preempt_enable(void);
+
+void schedule(void);
+void sched_preempt(void);
+void sched_tick(uint32_t ticks);
+bool sched_runnable(void);
+uint32_t sched_idle_ticks(uint32_t max);
+void print_threads(void);
+
+#endif
@@ -0,0 +1,26 @@
+// serial.h - COM1 16550 UART console
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define COM1_PORT			0x3F8
+#define COM1_IRQ			4
+#define SERIAL_BAUD			115200	// divisor 1, the fastest a 16550 goes
+
+extern bool serial_present;
+
+void serial_init(void);
+void serial_irq_init(void);
+void serial_write(const char* buf, size_t len);
+bool serial_rx_ready(void);
+int serial_getc(void);
+void serial_flush(void);
+void serial_panic(void);
+void print_serialinfo(void);
+
+#endif
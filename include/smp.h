@@ -0,0 +1,64 @@
+// smp.h - per-CPU data and application processor startup
+
+#ifndef SMP_H
+#define SMP_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "gdt.h"
+#include "sched.h"
+
+#define MAX_CPUS			16		// APIC_MAX_CPUS
+#define IPI_RESCHED			0xF0	// look at the run queues again
+#define IPI_TLB				0xF1	// flush the TLB, see tlb_shootdown()
+#define SYSENTER_STACK_WORDS	16		// room for a #DB frame, see isr.asm
+
+typedef struct cpu {
+	struct cpu* self;				// %fs:0, keep first
+	uint32_t index;					// 0 is the BSP
+	uint32_t apic_id;
+	volatile bool online;
+	volatile bool need_resched;
+	uint32_t preempt_count;
+	uint32_t irq_depth;				// isr_dispatch nesting
+	thread_t* volatile current;
+	thread_t* switch_from;			// until the next thread has left switch_to
+	uint32_t cr3;					// loaded page directory, see process_switch()
+	thread_t idle;
+	run_queue_t rq;
+	uint32_t switches;
+	uint32_t preemptions;
+	uint32_t steals;				// threads taken from another CPU's queue
+	uint32_t ipis;					// resched IPIs received
+	thread_t* fpu_last;				// whose state the FPU registers hold
+	uint32_t fpu_traps;
+	uint32_t fpu_saves;
+	uint32_t fpu_restores;
+	uint32_t sysenter_stack[SYSENTER_STACK_WORDS];
+	uint32_t sysenter_esp0;			// &tss.esp0, MSR_SYSENTER_ESP points here
+	uint64_t gdt[GDT_ENTRIES];
+	tss_t tss;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;			// slots in cpus[] in use
+extern volatile uint32_t cpus_online;
+
+// %fs is based at the running CPU's cpu_t; volatile since the calling
+// thread can move to another CPU at any reschedule
+static inline cpu_t* this_cpu(void) {
+	cpu_t* cpu;
+	__asm__ __volatile__("mov %%fs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+#define current_thread	(this_cpu()->current)
+
+void smp_init(void);
+void smp_send_resched(cpu_t* cpu);
+void tlb_shootdown(void);
+void print_smpinfo(void);
+void smp_bench(uint32_t max_threads);
+
+#endif
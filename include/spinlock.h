@@ -0,0 +1,57 @@
+// spinlock.h - ticket spinlocks
+// - a CPU takes a ticket and waits until owner reaches it, so waiters
+//   get the lock in arrival order and nobody starves
+// - the _irqsave variants also keep interrupts off on this CPU, which
+//   is what the uniprocessor code got from irq_save() alone
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+typedef union {
+	volatile uint32_t v;
+	struct {
+		volatile uint16_t owner;	// ticket being served
+		volatile uint16_t next;		// next ticket to hand out
+	};
+} spinlock_t;
+
+#define SPINLOCK_INIT	{ .v = 0 }
+
+static inline void cpu_relax(void) {
+	__asm__ __volatile__("pause" : : : "memory");
+}
+
+static inline void spin_lock(spinlock_t* l) {
+	uint16_t ticket = (uint16_t)(__atomic_fetch_add(&l->v, 0x10000, __ATOMIC_ACQUIRE) >> 16);
+	while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket)
+		cpu_relax();
+}
+
+static inline bool spin_trylock(spinlock_t* l) {
+	uint32_t old = __atomic_load_n(&l->v, __ATOMIC_RELAXED);
+	if ((old & 0xFFFF) != (old >> 16)) return false;	// held
+	return __atomic_compare_exchange_n(&l->v, &old, old + 0x10000, false,
+									   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void spin_unlock(spinlock_t* l) {
+	__atomic_store_n(&l->owner, (uint16_t)(l->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* l) {
+	uint32_t flags = irq_save();
+	spin_lock(l);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* l, uint32_t flags) {
+	spin_unlock(l);
+	irq_restore(flags);
+}
+
+#endif
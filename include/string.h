@@ -4,10 +4,19 @@
 #define STRING_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+// memcpy/memset run through the variant string_init() picked from CPUID
 void* memcpy(void*dst, const void *src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
 void* memset(void* dst, int value, size_t n);
-int strcmp(char* a, char *b);
+void* memsetw(uint16_t* dst, uint16_t value, size_t count);
+int memcmp(const void* a, const void* b, size_t n);
+int strcmp(const char* a, const char* b);
+int strncmp(const char* a, const char* b, size_t n);
 size_t strlen(const char* s);
 
+void string_init(void);
+const char* string_variant(void);
+
 #endif
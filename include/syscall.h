@@ -0,0 +1,41 @@
+// syscall.h - system call ABI, shared by the kernel and user programs
+// - eax holds the number, ebx, esi and edi up to three arguments; the
+//   result comes back in eax, ecx and edx are clobbered
+// - user code calls through the vsyscall page the kernel maps into every
+//   process: VSYS_ENTRY holds the address of the SYSENTER stub when the
+//   CPU has it, of the int 0x80 one otherwise
+
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#pragma once
+#include <stdint.h>
+
+#define SYS_EXIT			0	// (code)
+#define SYS_WRITE			1	// (buf, len) -> len, to the console
+#define SYS_UPTIME			2	// (sys_uptime_t*)
+#define SYS_GETPID			3	// () -> pid, does nothing else
+#define SYS_YIELD			4
+#define SYS_SLEEP			5	// (ms)
+#define SYS_COUNT			6
+
+#define SYSCALL_VECTOR		0x80
+
+// user address space; the low 4 MiB and everything from 0xC0000000 up
+// belong to the kernel
+#define USER_BASE			0x00400000
+#define USER_STACK_TOP		0xBFFFE000	// guard page above, then the vsyscall page
+#define USER_STACK_PAGES	4
+#define USER_VSYSCALL		0xBFFFF000	// keep in sync with sysentry.asm
+
+// vsyscall page layout
+#define VSYS_INT80			(USER_VSYSCALL + 0x00)
+#define VSYS_SYSENTER		(USER_VSYSCALL + 0x10)
+#define VSYS_ENTRY			(USER_VSYSCALL + 0x20)	// dword, one of the two
+
+typedef struct {
+	uint32_t sec;
+	uint32_t usec;
+} sys_uptime_t;
+
+#endif
@@ -0,0 +1,39 @@
+// timer.h - hierarchical timer wheel on timer_ticks (1 ms)
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_PERIODIC		0x01	// re-armed every period ticks after firing
+#define TIMER_AUTOFREE		0x02	// kfree'd after a one-shot fires or on cancel
+#define TIMER_PENDING		0x80	// on the wheel (internal)
+
+typedef void (*timer_fn_t)(void* ctx);
+
+// caller-owned timer; the pointer is its cancellation handle
+typedef struct ktimer {
+	struct ktimer* next;
+	struct ktimer** pprev;		// points at whatever points at us
+	uint32_t expires;			// timer_ticks value
+	uint32_t period;
+	timer_fn_t fn;
+	void* ctx;
+	uint8_t flags;
+} ktimer_t;
+
+void timer_init(ktimer_t* t, timer_fn_t fn, void* ctx);
+void timer_add(ktimer_t* t, uint32_t ms, uint32_t period);
+bool timer_cancel(ktimer_t* t);
+// the returned handle belongs to the wheel: a one-shot is freed when it
+// fires, so only use the handle while the timer is known to be pending;
+// a periodic handle stays valid until timer_cancel()
+ktimer_t* timer_start(uint32_t ms, uint32_t period, timer_fn_t fn, void* ctx);
+void timer_run(void);
+void timer_thread_init(void);
+uint32_t timer_idle_ticks(uint32_t max);
+void print_timers(void);
+
+#endif
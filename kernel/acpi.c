@@ -0,0 +1,88 @@
+// acpi.c - RSDP/RSDT lookup; tables are mapped through ioremap() since
+// firmware may put them above the direct map
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "paging.h"
+#include "string.h"
+
+#define EBDA_SEGMENT_PTR	0x0000040E
+#define BIOS_ROM_START		0x000E0000
+#define BIOS_ROM_END		0x00100000
+
+typedef struct {
+	char signature[8];		// "RSD PTR "
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	// ACPI 2.0+ fields follow, the RSDT is enough for 32-bit tables
+} __attribute__((packed)) acpi_rsdp_t;
+
+static acpi_header_t* rsdt;
+
+static bool acpi_checksum(const void* p, uint32_t len) {
+	const uint8_t* b = p;
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < len; i++) sum += b[i];
+	return sum == 0;
+}
+
+// the RSDP sits on a 16-byte boundary in the first KiB of the EBDA or
+// in the BIOS ROM area; both are inside the direct map
+static acpi_rsdp_t* acpi_find_rsdp(void) {
+	uint32_t ebda = (uint32_t)*(uint16_t*)PHYS_TO_VIRT(EBDA_SEGMENT_PTR) << 4;
+	uint32_t ranges[2][2] = {
+		{ ebda, ebda + 1024 },
+		{ BIOS_ROM_START, BIOS_ROM_END },
+	};
+
+	for (int r = 0; r < 2; r++) {
+		if (!ranges[r][0]) continue;
+		for (uint32_t p = ranges[r][0]; p < ranges[r][1]; p += 16) {
+			acpi_rsdp_t* rsdp = PHYS_TO_VIRT(p);
+			if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+				acpi_checksum(rsdp, sizeof(acpi_rsdp_t)))
+				return rsdp;
+		}
+	}
+	return NULL;
+}
+
+// map the header to learn the length, then the whole table
+static acpi_header_t* acpi_map_table(uint32_t phys) {
+	acpi_header_t* hdr = ioremap(phys, sizeof(acpi_header_t), "acpi");
+	if (!hdr) return NULL;
+	uint32_t length = hdr->length;
+	vunmap(hdr);
+
+	if (length < sizeof(acpi_header_t)) return NULL;
+	hdr = ioremap(phys, length, "acpi");
+	if (hdr && !acpi_checksum(hdr, length)) {
+		vunmap(hdr);
+		return NULL;
+	}
+	return hdr;
+}
+
+acpi_header_t* acpi_find_table(const char* signature) {
+	if (!rsdt) {
+		acpi_rsdp_t* rsdp = acpi_find_rsdp();
+		if (!rsdp) return NULL;
+		rsdt = acpi_map_table(rsdp->rsdt);
+		if (!rsdt) return NULL;
+	}
+
+	uint32_t* entries = (uint32_t*)(rsdt + 1);
+	uint32_t count = (rsdt->length - sizeof(acpi_header_t)) / sizeof(uint32_t);
+	for (uint32_t i = 0; i < count; i++) {
+		acpi_header_t* hdr = ioremap(entries[i], sizeof(acpi_header_t), "acpi");
+		if (!hdr) continue;
+		bool match = memcmp(hdr->signature, signature, 4) == 0;
+		vunmap(hdr);
+		if (match) return acpi_map_table(entries[i]);
+	}
+	return NULL;
+}
@@ -0,0 +1,328 @@
+// apic.c - local APIC and IOAPIC
+// - found through CPUID and the ACPI MADT; without both the 8259 stays
+// - the LAPIC is driven through MMIO (xAPIC) or MSRs (x2APIC), an EOI is
+//   one register write either way instead of a PIC port write
+// - ISA IRQs are routed through the first IOAPIC, honouring the MADT's
+//   interrupt source overrides (IRQ0 usually arrives on GSI 2)
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "apic.h"
+#include "acpi.h"
+#include "boot.h"
+#include "clock.h"
+#include "cpu.h"
+#include "div64.h"
+#include "irq.h"
+#include "kernel.h"
+#include "paging.h"
+#include "string.h"
+
+// LAPIC registers, MMIO offsets; x2APIC MSR = 0x800 + offset / 16
+#define LAPIC_ID			0x020
+#define LAPIC_VERSION		0x030
+#define LAPIC_TPR			0x080
+#define LAPIC_EOI			0x0B0
+#define LAPIC_SVR			0x0F0
+#define LAPIC_ICR_LOW		0x300
+#define LAPIC_ICR_HIGH		0x310
+#define LAPIC_LVT_TIMER		0x320
+#define LAPIC_LVT_LINT0		0x350
+#define LAPIC_LVT_ERROR		0x370
+#define LAPIC_TIMER_INIT	0x380
+#define LAPIC_TIMER_CUR		0x390
+#define LAPIC_TIMER_DIV		0x3E0
+
+#define LAPIC_SVR_ENABLE	0x100
+#define LVT_MASKED			0x10000
+#define LVT_TIMER_PERIODIC	0x20000
+#define LAPIC_DIV_16		0x3
+#define ICR_PENDING			0x1000
+
+#define MSR_APIC_BASE		0x1B
+#define APIC_BASE_X2APIC	(1u << 10)
+#define APIC_BASE_ENABLE	(1u << 11)
+#define X2APIC_MSR_BASE		0x800
+#define X2APIC_MSR_ICR		0x830
+
+// IOAPIC
+#define IOAPIC_REGSEL		0x00
+#define IOAPIC_WIN			0x10
+#define IOAPIC_VER			0x01
+#define IOAPIC_REDTBL(n)	(0x10 + 2 * (n))
+#define IOREDTBL_MASKED		0x10000
+#define IOREDTBL_LOW_ACTIVE	0x02000
+#define IOREDTBL_LEVEL		0x08000
+
+// MADT
+#define MADT_LAPIC			0
+#define MADT_IOAPIC			1
+#define MADT_OVERRIDE		2
+#define MADT_LAPIC_ENABLED	0x01
+#define MPS_POLARITY_LOW	0x03
+#define MPS_TRIGGER_LEVEL	0x0C
+
+typedef struct {
+	acpi_header_t header;
+	uint32_t lapic_addr;
+	uint32_t flags;
+} __attribute__((packed)) madt_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct {
+	madt_entry_t h;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed)) madt_lapic_t;
+
+typedef struct {
+	madt_entry_t h;
+	uint8_t ioapic_id;
+	uint8_t reserved;
+	uint32_t addr;
+	uint32_t gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct {
+	madt_entry_t h;
+	uint8_t bus;
+	uint8_t irq;
+	uint32_t gsi;
+	uint16_t flags;
+} __attribute__((packed)) madt_override_t;
+
+bool apic_active = false;
+bool x2apic = false;
+uint32_t lapic_timer_hz = 0;
+uint8_t apic_cpu_ids[APIC_MAX_CPUS];
+int apic_cpu_count = 0;
+
+static volatile uint32_t* lapic_mmio;
+static volatile uint32_t* ioapic_mmio;
+static uint32_t lapic_phys;
+static uint32_t ioapic_phys;
+static uint32_t ioapic_gsi_base;
+static uint32_t ioapic_entries;
+
+// ISA IRQ -> GSI and MPS polarity/trigger flags, identity unless overridden
+static uint32_t isa_gsi[16];
+static uint16_t isa_flags[16];
+
+// --- LAPIC ---
+
+static uint32_t lapic_read(uint32_t reg) {
+	if (x2apic) return (uint32_t)rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+	return lapic_mmio[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+	if (x2apic) wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+	else lapic_mmio[reg / 4] = value;
+}
+
+uint32_t lapic_id(void) {
+	uint32_t id = lapic_read(LAPIC_ID);
+	return x2apic ? id : id >> 24;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+// icr is the low ICR word (vector, delivery mode, level, shorthand);
+// x2APIC takes the whole command in one MSR write and has no busy bit
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+	if (x2apic) {
+		wrmsr(X2APIC_MSR_ICR, ((uint64_t)apic_id << 32) | icr);
+		return;
+	}
+	uint32_t flags = irq_save();
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+		__asm__ __volatile__("pause");
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, icr);
+	irq_restore(flags);
+}
+
+// the 8259 virtual-wire input and the timer stay off, errors too
+static void lapic_setup(void) {
+	lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+	lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+	lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+// --- IOAPIC ---
+
+static uint32_t ioapic_read(uint32_t reg) {
+	ioapic_mmio[IOAPIC_REGSEL / 4] = reg;
+	return ioapic_mmio[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+	ioapic_mmio[IOAPIC_REGSEL / 4] = reg;
+	ioapic_mmio[IOAPIC_WIN / 4] = value;
+}
+
+// deliver ISA irq as vector to this CPU, fixed mode, physical destination
+void ioapic_route(uint8_t irq, uint8_t vector) {
+	if (irq >= 16) return;
+	uint32_t pin = isa_gsi[irq] - ioapic_gsi_base;
+	if (pin >= ioapic_entries) return;
+
+	uint32_t low = vector;
+	if ((isa_flags[irq] & MPS_POLARITY_LOW) == MPS_POLARITY_LOW) low |= IOREDTBL_LOW_ACTIVE;
+	if ((isa_flags[irq] & MPS_TRIGGER_LEVEL) == MPS_TRIGGER_LEVEL) low |= IOREDTBL_LEVEL;
+
+	ioapic_write(IOAPIC_REDTBL(pin) + 1, lapic_id() << 24);
+	ioapic_write(IOAPIC_REDTBL(pin), low);
+}
+
+// --- MADT ---
+
+static bool madt_parse(void) {
+	madt_t* madt = (madt_t*)acpi_find_table("APIC");
+	if (!madt) return false;
+
+	lapic_phys = madt->lapic_addr;
+	for (int i = 0; i < 16; i++) {
+		isa_gsi[i] = i;
+		isa_flags[i] = 0;
+	}
+
+	uint8_t* p = (uint8_t*)(madt + 1);
+	uint8_t* end = (uint8_t*)madt + madt->header.length;
+	while (p + sizeof(madt_entry_t) <= end) {
+		madt_entry_t* e = (madt_entry_t*)p;
+		if (e->length < sizeof(madt_entry_t)) break;
+
+		if (e->type == MADT_LAPIC) {
+			madt_lapic_t* l = (madt_lapic_t*)e;
+			if ((l->flags & MADT_LAPIC_ENABLED) && apic_cpu_count < APIC_MAX_CPUS)
+				apic_cpu_ids[apic_cpu_count++] = l->apic_id;
+		} else if (e->type == MADT_IOAPIC && !ioapic_phys) {
+			madt_ioapic_t* io = (madt_ioapic_t*)e;
+			ioapic_phys = io->addr;
+			ioapic_gsi_base = io->gsi_base;
+		} else if (e->type == MADT_OVERRIDE) {
+			madt_override_t* o = (madt_override_t*)e;
+			if (o->bus == 0 && o->irq < 16) {
+				isa_gsi[o->irq] = o->gsi;
+				isa_flags[o->irq] = o->flags;
+			}
+		}
+		p += e->length;
+	}
+
+	vunmap(madt);
+	return lapic_phys && ioapic_phys;
+}
+
+// "noapic" on the kernel command line keeps the 8259 for comparisons
+static bool apic_disabled(void) {
+	size_t len = strlen(boot_cmdline);
+	for (size_t i = 0; i + 6 <= len; i++) {
+		if (strncmp(&boot_cmdline[i], "noapic", 6) == 0) return true;
+	}
+	return false;
+}
+
+bool apic_init(void) {
+	if (!(cpu_features & CPU_FEAT_APIC) || apic_disabled() || !madt_parse())
+		return false;
+
+	uint64_t base = rdmsr(MSR_APIC_BASE);
+	if (cpu_features & CPU_FEAT_X2APIC) {
+		wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+		x2apic = true;
+	} else {
+		wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+		lapic_mmio = ioremap(lapic_phys, PAGE_SIZE, "lapic");
+	}
+	ioapic_mmio = ioremap(ioapic_phys, PAGE_SIZE, "ioapic");
+	if ((!x2apic && !lapic_mmio) || !ioapic_mmio) return false;
+
+	// every IOAPIC pin masked until someone routes it
+	ioapic_entries = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+	for (uint32_t pin = 0; pin < ioapic_entries; pin++)
+		ioapic_write(IOAPIC_REDTBL(pin), IOREDTBL_MASKED);
+
+	lapic_setup();
+	apic_active = true;
+	return true;
+}
+
+// an application processor's own LAPIC, in the mode the BSP chose; the
+// xAPIC window is at the same address on every CPU
+void lapic_ap_init(void) {
+	uint64_t base = rdmsr(MSR_APIC_BASE);
+	if (x2apic) wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+	else wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+	lapic_setup();
+}
+
+// --- LAPIC TIMER ---
+
+// count the LAPIC timer against ~10 ms of PIT channel 2
+bool lapic_timer_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+	lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+	pit2_start(CAL_PIT_COUNT);
+	lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+	bool ok = pit2_wait();
+	uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+	lapic_write(LAPIC_TIMER_INIT, 0);
+
+	if (!ok || counted < CAL_PIT_COUNT) return false;
+	lapic_timer_hz = (uint32_t)udiv64_32((uint64_t)counted * PIT_HZ, CAL_PIT_COUNT, NULL);
+	return true;
+}
+
+void lapic_timer_periodic(uint8_t vector, uint32_t count) {
+	lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | vector);
+	lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+void lapic_timer_oneshot(uint8_t vector, uint32_t count) {
+	lapic_write(LAPIC_LVT_TIMER, vector);
+	lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+// counts down to 0 and stays there in one-shot mode
+uint32_t lapic_timer_current(void) {
+	return lapic_read(LAPIC_TIMER_CUR);
+}
+
+void print_apicinfo(void) {
+	if (!apic_active) {
+		kprintln("Interrupt controller: 8259 PIC (no APIC, or noapic)");
+		kprint("\n");
+		return;
+	}
+	kprint("Interrupt controller: ");
+	kprintln(x2apic ? "x2APIC + IOAPIC" : "xAPIC + IOAPIC");
+	kprint("LAPIC:  "); kprint_hex(lapic_phys); kprint(" id "); kprint_int(lapic_id());
+	kprint(" version "); kprint_hex(lapic_read(LAPIC_VERSION) & 0xFF); kprint("\n");
+	kprint("IOAPIC: "); kprint_hex(ioapic_phys); kprint(" gsi "); kprint_int(ioapic_gsi_base);
+	kprint("-"); kprint_int(ioapic_gsi_base + ioapic_entries - 1); kprint("\n");
+	kprint("CPUs:   "); kprint_int(apic_cpu_count); kprint(" (apic ids");
+	for (int i = 0; i < apic_cpu_count; i++) { kprint(" "); kprint_int(apic_cpu_ids[i]); }
+	kprint(")\n");
+	for (int i = 0; i < 16; i++) {
+		if (isa_gsi[i] == (uint32_t)i && !isa_flags[i]) continue;
+		kprint("IRQ "); kprint_int(i); kprint(" -> GSI "); kprint_int(isa_gsi[i]);
+		kprint(" flags "); kprint_hex(isa_flags[i]); kprint("\n");
+	}
+	kprint("Timer:  ");
+	if (lapic_timer_hz) { kprint_int(lapic_timer_hz); kprint(" Hz (LAPIC)\n"); }
+	else kprint("PIT\n");
+	kprint("\n");
+}
@@ -0,0 +1,198 @@
+// bench.c - fixed micro-benchmark suite for the hot paths
+// - every result is the median of BENCH_REPS runs, in TSC cycles, and is
+//   printed as one line "BENCH <name> <cycles> <unit>" so scripts can
+//   track it from release to release; BENCH-BEGIN and BENCH-END frame
+//   the suite, the latter with the number of benchmarks that failed
+// - console benchmarks render into the shadow and flush to VGA memory
+//   with the serial sink paused, the UART would set the pace otherwise
+// - booted with "bench" on the command line the suite runs once and
+//   leaves QEMU through isa-debug-exit, see 'make bench'
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "bench.h"
+#include "kernel.h"
+#include "irq.h"
+#include "memory.h"
+#include "string.h"
+#include "cpu.h"
+#include "clock.h"
+#include "smp.h"
+#include "ports.h"
+#include "log.h"
+#include "serial.h"
+
+#define BENCH_REPS			5
+#define BENCH_CHARS			1024
+#define BENCH_LINE			"The quick brown fox jumps over the lazy dog, 0123456789 ABCDEF.\n"	// 64 bytes
+#define BENCH_LINES			16
+#define BENCH_ALLOCS		64
+#define BENCH_OPS			256
+#define BENCH_COMMAND		"run echo hello world again"
+
+static uint32_t bench_failed;
+
+// sorts v in place; n is small, an insertion sort does
+uint32_t bench_median(uint32_t* v, int n) {
+	for (int i = 1; i < n; i++) {
+		for (int j = i; j > 0 && v[j] < v[j - 1]; j--) {
+			uint32_t t = v[j]; v[j] = v[j - 1]; v[j - 1] = t;
+		}
+	}
+	return v[n / 2];
+}
+
+static void report(const char* name, uint32_t cycles, const char* unit) {
+	kprintf("BENCH %s %u %s\n", name, (unsigned)cycles, unit);
+}
+
+// --- CONSOLE ---
+
+static uint32_t run_kputchar(void) {
+	uint64_t start = rdtsc();
+	for (int i = 0; i < BENCH_CHARS; i++) kputchar('.');
+	kconsole_sync();
+	uint32_t cycles = (uint32_t)(rdtsc() - start) / BENCH_CHARS;
+	kputchar('\n');
+	return cycles;
+}
+
+static uint32_t run_kprint(void) {
+	uint64_t start = rdtsc();
+	for (int i = 0; i < BENCH_LINES; i++) kprint(BENCH_LINE);
+	kconsole_sync();
+	return (uint32_t)(rdtsc() - start) / (BENCH_LINES * (sizeof(BENCH_LINE) - 1));
+}
+
+// a screenful of newlines with the cursor already on the last row: every
+// one scrolls, then all rows go to VGA memory
+static uint32_t run_scroll(void) {
+	static const char screen[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+	kwrite(screen, sizeof(screen) - 1);
+	kconsole_sync();
+	uint64_t start = rdtsc();
+	kwrite(screen, sizeof(screen) - 1);
+	kconsole_sync();
+	return (uint32_t)(rdtsc() - start);
+}
+
+// --- MEMORY AND SHELL ---
+
+// a burst of allocations, then the frees, per pair
+static uint32_t run_kmalloc(uint32_t size) {
+	void* p[BENCH_ALLOCS];
+	uint64_t start = rdtsc();
+	for (int i = 0; i < BENCH_ALLOCS; i++) p[i] = kmalloc(size);
+	for (int i = 0; i < BENCH_ALLOCS; i++) kfree(p[i]);
+	uint32_t cycles = (uint32_t)(rdtsc() - start) / BENCH_ALLOCS;
+	for (int i = 0; i < BENCH_ALLOCS; i++) {
+		if (!p[i]) return 0;
+	}
+	return cycles;
+}
+
+static uint32_t run_kmalloc_64(void) { return run_kmalloc(64); }
+static uint32_t run_kmalloc_1k(void) { return run_kmalloc(1024); }
+
+// tokenize() splits in place, so each round starts from a fresh copy
+static uint32_t run_tokenize(void) {
+	char line[sizeof(BENCH_COMMAND)];
+	char* tokens[8];
+	uint64_t start = rdtsc();
+	for (int i = 0; i < BENCH_OPS; i++) {
+		memcpy(line, BENCH_COMMAND, sizeof(line));
+		tokenize(line, tokens, 8);
+	}
+	return (uint32_t)(rdtsc() - start) / BENCH_OPS;
+}
+
+// a name no command has walks the whole strcmp chain and the program
+// table; its "Unknown command" goes nowhere with both sinks off
+static uint32_t run_dispatch(void) {
+	char line[16];
+	bool vga = kconsole_vga(false);
+	uint64_t start = rdtsc();
+	for (int i = 0; i < BENCH_OPS; i++) {
+		memcpy(line, "nosuchcommand", 14);
+		handle_command(line);
+	}
+	uint32_t cycles = (uint32_t)(rdtsc() - start) / BENCH_OPS;
+	kconsole_vga(vga);
+	return cycles;
+}
+
+typedef struct {
+	const char* name;
+	const char* unit;
+	uint32_t (*run)(void);		// 0 means it failed
+} bench_t;
+
+static const bench_t suite[] = {
+	{ "kputchar",		"cycles/byte",		run_kputchar },
+	{ "kprint",			"cycles/byte",		run_kprint },
+	{ "scroll_screen",	"cycles/screen",	run_scroll },
+	{ "kmalloc_64",		"cycles/pair",		run_kmalloc_64 },
+	{ "kmalloc_1k",		"cycles/pair",		run_kmalloc_1k },
+	{ "tokenize",		"cycles/line",		run_tokenize },
+	{ "dispatch_miss",	"cycles/command",	run_dispatch },
+};
+
+// --- IRQ ---
+
+static void run_irq(const char* name, bool (*run)(uint32_t*, uint32_t*)) {
+	uint32_t delivery, handler;
+	if (!run(&delivery, &handler)) {
+		kprintf("BENCH-FAIL %s\n", name);
+		bench_failed++;
+		return;
+	}
+	kprintf("BENCH %s_irq_delivery %u cycles\n", name, (unsigned)delivery);
+	kprintf("BENCH %s_irq_to_eoi %u cycles\n", name, (unsigned)handler);
+}
+
+// --- SUITE ---
+
+uint32_t bench_run(void) {
+	bench_failed = 0;
+	kprintf("BENCH-BEGIN cpus=%u tsc_khz=%u memcpy=%s\n", (unsigned)cpus_online, (unsigned)tsc_khz,
+			string_variant());
+	if (!(cpu_features & CPU_FEAT_TSC)) {
+		kprintln("BENCH-FAIL no TSC");
+		kprintln("BENCH-END failed=all");
+		return 1;
+	}
+
+	for (size_t b = 0; b < sizeof(suite) / sizeof(suite[0]); b++) {
+		uint32_t runs[BENCH_REPS];
+		bool serial = kconsole_serial(false);
+		for (int i = 0; i < BENCH_REPS; i++) runs[i] = suite[b].run();
+		kconsole_serial(serial);
+
+		uint32_t cycles = bench_median(runs, BENCH_REPS);
+		if (!cycles) {
+			kprintf("BENCH-FAIL %s\n", suite[b].name);
+			bench_failed++;
+			continue;
+		}
+		report(suite[b].name, cycles, suite[b].unit);
+	}
+
+	// timer and keyboard need a calibrated TSC for their deadlines
+	run_irq("timer", irq_bench_timer);
+	run_irq("kbd", irq_bench_kbd);
+
+	kprintf("BENCH-END failed=%u\n\n", (unsigned)bench_failed);
+	return bench_failed;
+}
+
+// "bench" on the command line: run once and report the result as QEMU's
+// exit status, (code << 1) | 1, so 1 means every benchmark ran
+void bench_thread(void* arg) {
+	(void)arg;
+	uint32_t failed = bench_run();
+	kconsole_sync();
+	serial_flush();
+	outb(BENCH_EXIT_PORT, failed ? 1 : 0);
+	klog(LOG_WARN, "bench: no isa-debug-exit device, staying up");
+}
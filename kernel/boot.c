@@ -0,0 +1,103 @@
+// boot.c - copy boot information out of low memory before anything allocates
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "boot.h"
+#include "memory.h"
+#include "paging.h"
+#include "string.h"
+
+// stage 1 convention: E820 entries at 0x500, count at 0x4F0
+#define MEMMAP_BUFFER ((e820_entry_t*)0x00000500)
+
+// multiboot_info_t flags
+#define MB_INFO_MEM			0x001
+#define MB_INFO_CMDLINE		0x004
+#define MB_INFO_MMAP		0x040
+
+typedef struct {
+	uint32_t flags;
+	uint32_t mem_lower;		// KiB below 1 MiB
+	uint32_t mem_upper;		// KiB above 1 MiB
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;
+	uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+	uint32_t size;			// of the rest of the entry
+	uint64_t base;
+	uint64_t length;
+	uint32_t type;
+} __attribute__((packed)) multiboot_mmap_t;
+
+volatile uint16_t* const MEMMAP_COUNT = (uint16_t*)0x000004F0;
+
+e820_entry_t boot_memmap[E820_MAX];
+int boot_memmap_count = 0;
+char boot_cmdline[BOOT_CMDLINE_MAX];
+bool boot_multiboot = false;
+
+static void boot_add_region(uint64_t base, uint64_t length, uint32_t type) {
+	if (boot_memmap_count >= E820_MAX) return;
+	boot_memmap[boot_memmap_count].base = base;
+	boot_memmap[boot_memmap_count].length = length;
+	boot_memmap[boot_memmap_count].type = type;
+	boot_memmap[boot_memmap_count].acpi = 0;
+	boot_memmap_count++;
+}
+
+// runs first in kernel_main, while the boot page directory still maps the
+// first 8 MiB; the Multiboot info sits in memory the frame allocator owns
+void boot_info_init(uint32_t mb_magic, uint32_t mb_info) {
+	if (mb_magic != MULTIBOOT_BOOT_MAGIC) {
+		int count = *MEMMAP_COUNT;
+		for (int i = 0; i < count; i++) {
+			e820_entry_t* e = &MEMMAP_BUFFER[i];
+			boot_add_region(e->base, e->length, e->type);
+		}
+		return;
+	}
+
+	multiboot_info_t* info = PHYS_TO_VIRT(mb_info);
+	boot_multiboot = true;
+
+	if (info->flags & MB_INFO_MMAP) {
+		uint32_t p = info->mmap_addr;
+		uint32_t end = p + info->mmap_length;
+		while (p < end) {
+			multiboot_mmap_t* e = PHYS_TO_VIRT(p);
+			boot_add_region(e->base, e->length, e->type);
+			p += e->size + sizeof(e->size);
+		}
+	} else if (info->flags & MB_INFO_MEM) {
+		boot_add_region(0, (uint64_t)info->mem_lower * 1024, E820_USABLE);
+		boot_add_region(0x100000, (uint64_t)info->mem_upper * 1024, E820_USABLE);
+	}
+
+	if (info->flags & MB_INFO_CMDLINE) {
+		const char* cmdline = PHYS_TO_VIRT(info->cmdline);
+		int i = 0;
+		while (cmdline[i] && i < BOOT_CMDLINE_MAX - 1) {
+			boot_cmdline[i] = cmdline[i];
+			i++;
+		}
+		boot_cmdline[i] = '\0';
+	}
+}
+
+// a whole word of the command line, e.g. "nosmp" or "bench"
+bool boot_option(const char* name) {
+	size_t len = strlen(name);
+	for (const char* p = boot_cmdline; *p; ) {
+		while (*p == ' ') p++;
+		const char* word = p;
+		while (*p && *p != ' ') p++;
+		if ((size_t)(p - word) == len && strncmp(word, name, len) == 0) return true;
+	}
+	return false;
+}
@@ -0,0 +1,108 @@
+// clock.c - clocksource
+// - the TSC is calibrated once at boot against PIT channel 2 (the speaker
+//   channel, free to use and gated through port 0x61)
+// - ktime_ns() is then one rdtsc and a multiply, no port I/O
+// - without a usable TSC the 1 ms timer_ticks count is the fallback
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "clock.h"
+#include "cpu.h"
+#include "irq.h"
+#include "ports.h"
+#include "kernel.h"
+#include "div64.h"
+
+#define CAL_RUNS			3
+#define CAL_SPIN_MAX		10000000u
+#define NS_SHIFT			24		// ns = cycles * ns_mult >> NS_SHIFT
+
+uint32_t tsc_khz = 0;
+static uint32_t ns_mult;
+static uint64_t tsc_base;
+
+static uint8_t pit2_gate;
+
+// start PIT channel 2 counting count input clocks down, for timing
+// another counter against it; pit2_wait() returns when it reaches 0
+void pit2_start(uint16_t count) {
+	pit2_gate = inb(0x61);
+	outb(0x61, (pit2_gate & ~0x02) | 0x01);	// speaker off, channel 2 gate on
+	outb(0x43, 0xB0);						// channel 2, lobyte/hibyte, mode 0
+	outb(0x42, count & 0xFF);
+	outb(0x42, count >> 8);
+}
+
+// false if OUT2 never went high (no PIT, or a broken emulation)
+bool pit2_wait(void) {
+	uint32_t spins = 0;
+	while (!(inb(0x61) & 0x20)) {			// OUT2 goes high at terminal count
+		if (++spins > CAL_SPIN_MAX) break;
+	}
+	outb(0x61, pit2_gate);
+	return spins <= CAL_SPIN_MAX;
+}
+
+// TSC cycles while PIT channel 2 counts CAL_PIT_COUNT down, 0 on timeout
+static uint32_t tsc_calibrate_once(void) {
+	pit2_start(CAL_PIT_COUNT);
+	uint64_t start = rdtsc();
+	bool ok = pit2_wait();
+	uint64_t end = rdtsc();
+	return ok ? (uint32_t)(end - start) : 0;
+}
+
+void clock_init(void) {
+	if (!(cpu_features & CPU_FEAT_TSC)) return;
+
+	// median of a few runs, an SMI or emulator hiccup skews one of them
+	uint32_t runs[CAL_RUNS];
+	for (int i = 0; i < CAL_RUNS; i++) {
+		runs[i] = tsc_calibrate_once();
+		for (int j = i; j > 0 && runs[j] < runs[j - 1]; j--) {
+			uint32_t t = runs[j]; runs[j] = runs[j - 1]; runs[j - 1] = t;
+		}
+	}
+	uint32_t cycles = runs[CAL_RUNS / 2];
+	if (!cycles) return;
+
+	tsc_khz = (uint32_t)udiv64_32((uint64_t)cycles * PIT_HZ, CAL_PIT_COUNT * 1000u, NULL);
+	if (tsc_khz < 4000) {				// ns_mult would not fit in 32 bits
+		tsc_khz = 0;
+		return;
+	}
+	ns_mult = (uint32_t)udiv64_32(1000000ull << NS_SHIFT, tsc_khz, NULL);
+
+	// keep the time since boot: the TSC starts counting at timer_ticks
+	tsc_base = rdtsc() - (uint64_t)timer_ticks * tsc_khz;
+}
+
+// nanoseconds since boot
+uint64_t ktime_ns(void) {
+	if (!tsc_khz) return (uint64_t)timer_ticks * 1000000u;
+
+	// 64x32 multiply in two halves, the full product needs 96 bits
+	uint64_t cycles = rdtsc() - tsc_base;
+	uint32_t hi = (uint32_t)(cycles >> 32), lo = (uint32_t)cycles;
+	return (((uint64_t)hi * ns_mult) << (32 - NS_SHIFT)) + (((uint64_t)lo * ns_mult) >> NS_SHIFT);
+}
+
+uint64_t ktime_us(void) {
+	return udiv64_32(ktime_ns(), 1000, NULL);
+}
+
+// seconds with microseconds, or milliseconds on the PIT fallback
+void print_uptime(void) {
+	uint32_t us;
+	uint32_t sec = (uint32_t)udiv64_32(ktime_us(), 1000000, &us);
+	char frac[7];
+	for (int i = 5; i >= 0; i--) { frac[i] = '0' + us % 10; us /= 10; }
+	frac[tsc_khz ? 6 : 3] = '\0';
+
+	kprint("Uptime: "); kprint_int(sec); kputchar('.'); kprint(frac); kprint(" s");
+	if (tsc_khz) {
+		kprint(" (tsc, "); kprint_int(tsc_khz); kprint(" kHz)\n");
+	} else {
+		kprint(" (pit)\n");
+	}
+}
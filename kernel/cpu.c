@@ -0,0 +1,79 @@
+// cpu.c - CPU feature detection
+
+#include <stdint.h>
+#include "cpu.h"
+#include "kernel.h"
+#include "string.h"
+
+uint32_t cpu_features = 0;
+char cpu_vendor[13];
+
+static const struct {
+	uint32_t bit;
+	const char* name;
+} feature_names[] = {
+	{CPU_FEAT_PSE,  "pse"},
+	{CPU_FEAT_PGE,  "pge"},
+	{CPU_FEAT_FXSR, "fxsr"},
+	{CPU_FEAT_SSE,  "sse"},
+	{CPU_FEAT_SSE2, "sse2"},
+	{CPU_FEAT_ERMS, "erms"},
+	{CPU_FEAT_TSC,  "tsc"},
+	{CPU_FEAT_APIC, "apic"},
+	{CPU_FEAT_X2APIC, "x2apic"},
+	{CPU_FEAT_SEP,  "sep"},
+};
+
+// read CPUID once, enable SSE if present; runs before anything copies
+// memory in bulk, string_init() picks its variants from the result
+void cpu_init(void) {
+	uint32_t a, b, c, d;
+
+	cpuid(0, &a, &b, &c, &d);
+	uint32_t max_leaf = a;
+	((uint32_t*)cpu_vendor)[0] = b;
+	((uint32_t*)cpu_vendor)[1] = d;
+	((uint32_t*)cpu_vendor)[2] = c;
+	cpu_vendor[12] = '\0';
+
+	cpuid(1, &a, &b, &c, &d);
+	if (d & CPUID_EDX_TSC)  cpu_features |= CPU_FEAT_TSC;
+	if (d & CPUID_EDX_PSE)  cpu_features |= CPU_FEAT_PSE;
+	if (d & CPUID_EDX_PGE)  cpu_features |= CPU_FEAT_PGE;
+	if (d & CPUID_EDX_FXSR) cpu_features |= CPU_FEAT_FXSR;
+	if (d & CPUID_EDX_SSE)  cpu_features |= CPU_FEAT_SSE;
+	if (d & CPUID_EDX_SSE2) cpu_features |= CPU_FEAT_SSE2;
+	if (d & CPUID_EDX_APIC) cpu_features |= CPU_FEAT_APIC;
+	if (c & CPUID_ECX_X2APIC) cpu_features |= CPU_FEAT_X2APIC;
+	// the Pentium Pro reports SEP without having it (family 6, model < 3,
+	// stepping < 3)
+	if ((d & CPUID_EDX_SEP) && !((a & 0xF00) == 0x600 && (a & 0xFF) < 0x33))
+		cpu_features |= CPU_FEAT_SEP;
+
+	if (max_leaf >= 7) {
+		cpuid(7, &a, &b, &c, &d);
+		if (b & CPUID7_EBX_ERMS) cpu_features |= CPU_FEAT_ERMS;
+	}
+
+	// SSE instructions fault until the OS says it saves their state
+	if ((cpu_features & (CPU_FEAT_FXSR | CPU_FEAT_SSE)) == (CPU_FEAT_FXSR | CPU_FEAT_SSE)) {
+		write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+		write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+		__asm__ __volatile__("fninit");
+	} else {
+		cpu_features &= ~(CPU_FEAT_SSE | CPU_FEAT_SSE2);
+	}
+}
+
+void print_cpuinfo(void) {
+	kprint("Vendor:   "); kprintln(cpu_vendor);
+	kprint("Features:");
+	for (unsigned int i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++) {
+		if (cpu_features & feature_names[i].bit) {
+			kprint(" "); kprint(feature_names[i].name);
+		}
+	}
+	kprint("\n");
+	kprint("memcpy:   "); kprintln(string_variant());
+	kprint("\n");
+}
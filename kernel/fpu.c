@@ -0,0 +1,108 @@
+// fpu.c - lazy FPU/SSE context switching
+// - CR0.TS is set whenever the registers may not hold the running
+//   thread's state; its first x87/SSE instruction then traps with #NM
+//   and fpu_trap() loads the thread's FXSAVE area, allocated on first use
+// - a switch saves the outgoing thread only if it touched the FPU during
+//   this run, so threads that never do pay nothing: no save, no restore,
+//   no CR0 write
+// - the state is in memory whenever a thread is off-CPU, so it can move
+//   between CPUs freely; a CPU whose registers still hold the incoming
+//   thread's last state just clears TS
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fpu.h"
+#include "cpu.h"
+#include "idt.h"
+#include "kernel.h"
+#include "memory.h"
+#include "smp.h"
+
+static uint8_t fpu_init_state[FXSAVE_SIZE] __attribute__((aligned(16)));
+static bool fpu_lazy = false;
+
+static inline void fxsave(void* area) {
+	__asm__ __volatile__("fxsave (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fxrstor(const void* area) {
+	__asm__ __volatile__("fxrstor (%0)" : : "r"(area) : "memory");
+}
+
+static inline void clts(void) {
+	__asm__ __volatile__("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+// vector 7, from thread context only
+static void fpu_trap(irq_frame_t* frame, void* ctx) {
+	(void)ctx;
+	cpu_t* cpu = this_cpu();
+	thread_t* t = cpu->current;
+
+	if (!t || cpu->irq_depth > 1) {
+		kprint("\nFPU/SSE instruction in an interrupt handler at EIP ");
+		kprint_hex(frame->eip); kprint("\n");
+		kpanic("FPU used in interrupt context");
+	}
+
+	clts();
+	cpu->fpu_traps++;
+	if (!t->fpu) {
+		// slab objects of this size class are 16-byte aligned, as fxsave needs
+		t->fpu = kmalloc(FXSAVE_SIZE);
+		if (!t->fpu) kpanic("no memory for FPU state");
+		fxrstor(fpu_init_state);
+	} else if (cpu->fpu_last != t || t->fpu_cpu != cpu->index) {
+		fxrstor(t->fpu);
+		cpu->fpu_restores++;
+	}
+	t->fpu_cpu = cpu->index;
+	t->fpu_used = true;
+	cpu->fpu_last = t;
+}
+
+// on the way out of schedule(), interrupts off
+void fpu_switch(cpu_t* cpu, thread_t* prev) {
+	if (!prev->fpu_used) return;
+	fxsave(prev->fpu);
+	prev->fpu_used = false;
+	cpu->fpu_last = prev;
+	cpu->fpu_saves++;
+	stts();
+}
+
+// keep the state cpu_init() left behind as every thread's starting point
+void fpu_init(void) {
+	if (!(cpu_features & CPU_FEAT_FXSR) || !(read_cr4() & CR4_OSFXSR)) return;
+	fxsave(fpu_init_state);
+	irq_register(7, fpu_trap, NULL);
+	fpu_lazy = true;
+}
+
+// each CPU, from sched_init(): from here on the first FPU use of every
+// thread traps; APs inherit the BSP's CR0 with TS already set
+void fpu_cpu_init(void) {
+	if (!fpu_lazy) return;
+	clts();
+	fxrstor(fpu_init_state);
+	stts();
+}
+
+void print_fpuinfo(void) {
+	kprint("Switching:         "); kprintln(fpu_lazy ? "lazy (CR0.TS + #NM)" : "off (no FXSR)");
+	kprintln("cpu  traps  saves  restores  last owner");
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		cpu_t* c = &cpus[i];
+		if (!c->online) continue;
+		kprint_int(i); kprint("  ");
+		kprint_int(c->fpu_traps); kprint("  ");
+		kprint_int(c->fpu_saves); kprint("  ");
+		kprint_int(c->fpu_restores); kprint("  ");
+		kprintln(c->fpu_last ? c->fpu_last->name : "-");
+	}
+	kprint("\n");
+}
@@ -0,0 +1,66 @@
+// gdt.c - per-CPU descriptor tables
+// - k_entry.asm's flat GDT only gets the BSP into C; every CPU then loads
+//   its own copy from its cpu_t, with a TSS and a data segment based at
+//   the cpu_t itself, so this_cpu() is a single %fs load
+// - flat ring 3 segments for user processes; page protection keeps them
+//   out of the kernel half. tss.esp0 is set per process on every switch
+
+#include <stdint.h>
+#include "gdt.h"
+#include "smp.h"
+#include "string.h"
+
+// access bytes and flag nibbles
+#define SEG_CODE		0x9A	// present, ring 0, code, readable
+#define SEG_DATA		0x92	// present, ring 0, data, writable
+#define SEG_UCODE		0xFA	// the same two at ring 3
+#define SEG_UDATA		0xF2
+#define SEG_TSS			0x89	// present, 32-bit TSS, available
+#define SEG_4K_32		0xC		// 4 KiB granularity, 32-bit
+#define SEG_BYTE_32		0x4		// byte granularity, 32-bit
+
+struct gdt_ptr {
+	uint16_t limit;
+	uint32_t base;
+} __attribute__((packed));
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+	return (uint64_t)(limit & 0xFFFF)
+		| (uint64_t)(base & 0xFFFFFF) << 16
+		| (uint64_t)access << 40
+		| (uint64_t)((limit >> 16) & 0xF) << 48
+		| (uint64_t)(flags & 0xF) << 52
+		| (uint64_t)(base >> 24) << 56;
+}
+
+// build and load cpu's GDT, then reload every segment register and the
+// task register; runs on the CPU itself
+void gdt_init(cpu_t* cpu) {
+	cpu->self = cpu;
+
+	memset(&cpu->tss, 0, sizeof(tss_t));
+	cpu->tss.ss0 = GDT_KDATA;
+	cpu->tss.iomap = sizeof(tss_t);		// no I/O bitmap
+
+	memset(cpu->gdt, 0, sizeof(cpu->gdt));
+	cpu->gdt[GDT_KCODE >> 3] = gdt_entry(0, 0xFFFFF, SEG_CODE, SEG_4K_32);
+	cpu->gdt[GDT_KDATA >> 3] = gdt_entry(0, 0xFFFFF, SEG_DATA, SEG_4K_32);
+	cpu->gdt[GDT_UCODE >> 3] = gdt_entry(0, 0xFFFFF, SEG_UCODE, SEG_4K_32);
+	cpu->gdt[GDT_UDATA >> 3] = gdt_entry(0, 0xFFFFF, SEG_UDATA, SEG_4K_32);
+	cpu->gdt[GDT_TSS >> 3] = gdt_entry((uint32_t)&cpu->tss, sizeof(tss_t) - 1, SEG_TSS, SEG_BYTE_32);
+	cpu->gdt[GDT_PERCPU >> 3] = gdt_entry((uint32_t)cpu, sizeof(cpu_t) - 1, SEG_DATA, SEG_BYTE_32);
+
+	struct gdt_ptr ptr = { sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt };
+	__asm__ __volatile__(
+		"lgdt %0\n\t"
+		"ljmp %1, $1f\n"
+		"1:\n\t"
+		"mov %w2, %%ds\n\t"
+		"mov %w2, %%es\n\t"
+		"mov %w2, %%ss\n\t"
+		"mov %w2, %%gs\n\t"
+		"mov %w3, %%fs\n\t"
+		"ltr %w4"
+		: : "m"(ptr), "i"(GDT_KCODE), "r"(GDT_KDATA), "r"(GDT_PERCPU), "r"(GDT_TSS)
+		: "memory");
+}
@@ -1,7 +1,18 @@
 // idt.c
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "idt.h"
+#include "irq.h"
+#include "kernel.h"
+#include "string.h"
+#include "cpu.h"
+#include "apic.h"
+#include "div64.h"
+#include "sched.h"
+#include "smp.h"
+#include "process.h"
+#include "ksyms.h"
 
 struct idt_entry {
     uint16_t base_low;
@@ -16,14 +27,39 @@ struct idt_ptr {
     uint32_t base;
 } __attribute__((packed));
 
-#define IDT_ENTRIES 256
+// one dispatch slot per vector
+typedef struct {
+    irq_handler_t handler;
+    void* ctx;
+} irq_slot_t;
+
+// per-CPU and per-vector, so isr_dispatch never shares a counter with
+// another CPU; print_intrstats() adds them up
+typedef struct {
+    uint32_t hits;
+    uint32_t max_cycles;
+    uint64_t cycles;		// total spent in the handler
+} irq_count_t;
 
 static struct idt_entry idt[IDT_ENTRIES];
 static struct idt_ptr   idtp;
+static irq_slot_t irq_table[IDT_ENTRIES];
+static irq_count_t irq_counts[MAX_CPUS][IDT_ENTRIES];
+static bool count_cycles = false;
 
 extern void idt_flush(uint32_t);
-extern void irq0(void);  // ASM stubs 
-extern void irq1(void);
+extern const uint32_t isr_stub_table[IDT_ENTRIES];	// isr.asm
+
+static const char* exception_names[32] = {
+    "#DE divide error", "#DB debug", "NMI", "#BP breakpoint",
+    "#OF overflow", "#BR bound range", "#UD invalid opcode", "#NM device not available",
+    "#DF double fault", "coprocessor overrun", "#TS invalid TSS", "#NP segment not present",
+    "#SS stack fault", "#GP general protection", "#PF page fault", "reserved",
+    "#MF x87 error", "#AC alignment check", "#MC machine check", "#XM SIMD error",
+    "#VE virtualization", "#CP control protection", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved",
+    "#HV hypervisor injection", "#VC VMM communication", "#SX security", "reserved",
+};
 
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
     idt[num].base_low  = base & 0xFFFF;
@@ -37,18 +73,119 @@ void idt_install(void) {
     idtp.limit = sizeof(idt) - 1;
     idtp.base  = (uint32_t)&idt;
 
-    // clear IDT
-    for (int i = 0; i < IDT_ENTRIES; i++) {
-        idt[i].base_low  = 0;
-        idt[i].base_high = 0;
-        idt[i].sel       = 0;
-        idt[i].always0   = 0;
-        idt[i].flags     = 0;
-    }
-
     // 0x8E = 1000 1110b = present, ring0, 32-bit interrupt gate
-    idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E); // IRQ0 (timer)
-    idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E); // IRQ1 (keyboard)
+    for (int i = 0; i < IDT_ENTRIES; i++)
+        idt_set_gate(i, isr_stub_table[i], 0x08, 0x8E);
+
+    count_cycles = (cpu_features & CPU_FEAT_TSC) != 0;
+    idt_flush((uint32_t)&idtp);
+}
 
+// a gate ring 3 may use with int, to entry instead of the vector's stub;
+// an interrupt gate, entry turns interrupts back on itself
+void idt_set_user_gate(uint8_t vector, void (*entry)(void)) {
+    // 0xEE = present, ring3, 32-bit interrupt gate
+    idt_set_gate(vector, (uint32_t)entry, 0x08, 0xEE);
+}
+
+// the table is shared, application processors only load it
+void idt_load(void) {
     idt_flush((uint32_t)&idtp);
 }
+
+bool irq_register(uint8_t vector, irq_handler_t handler, void* ctx) {
+    irq_slot_t* slot = &irq_table[vector];
+    if (slot->handler) return false;
+
+    uint32_t flags = irq_save();
+    slot->ctx = ctx;
+    slot->handler = handler;
+    irq_restore(flags);
+    return true;
+}
+
+void irq_unregister(uint8_t vector) {
+    uint32_t flags = irq_save();
+    irq_table[vector].handler = NULL;
+    irq_table[vector].ctx = NULL;
+    irq_restore(flags);
+}
+
+// nobody claimed the vector: exceptions are fatal, or kill the process
+// that raised them in ring 3; stray IRQs are acknowledged so they don't
+// block lower priorities
+static void unhandled(irq_frame_t* frame) {
+    uint32_t vector = frame->vector;
+
+    if (vector < 32 && (frame->cs & 3)) {
+        process_fault(frame, exception_names[vector]);
+        return;
+    }
+    if (vector < 32) {
+        kprint("\nException "); kprint_int(vector);
+        kprint(" ("); kprint(exception_names[vector]); kprint(")");
+        kprint(" error "); kprint_hex(frame->err);
+        kprint(" at EIP "); kprint_hex(frame->eip);
+        uint32_t offset;
+        const char* fn = ksym_name(frame->eip, &offset);
+        if (fn) kprintf(" (%s+0x%x)", fn, (unsigned)offset);
+        kprint("\n");
+        kpanic("unhandled exception");
+    }
+
+    if (vector == APIC_SPURIOUS_VECTOR) return;	// no EOI for spurious
+    if (vector < 48 && !apic_active) irq_eoi(vector - 32);
+    else if (apic_active) lapic_eoi();
+}
+
+// called by isr_common for every vector; a pending reschedule is taken
+// last, after the handler's cost has been booked
+void isr_dispatch(irq_frame_t* frame) {
+    irq_slot_t* slot = &irq_table[frame->vector];
+    uint64_t start = count_cycles ? rdtsc() : 0;
+
+    cpu_t* cpu = this_cpu();
+    cpu->irq_depth++;
+    if (slot->handler) slot->handler(frame, slot->ctx);
+    else unhandled(frame);
+    cpu->irq_depth--;
+
+    // the handler may have enabled interrupts, keep a nested one on this
+    // CPU out of the update
+    uint32_t flags = irq_save();
+    irq_count_t* count = &irq_counts[this_cpu()->index][frame->vector];
+    count->hits++;
+    if (count_cycles) {
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        count->cycles += cycles;
+        if (cycles > count->max_cycles) count->max_cycles = cycles;
+    }
+    irq_restore(flags);
+    sched_preempt();
+    if (frame->cs & 3) process_check_killed();
+}
+
+// vectors that fired at least once, with the cost of their handlers
+void print_intrstats(void) {
+    kprintln("vec  hits  avg cycles  max cycles  handler");
+    for (int i = 0; i < IDT_ENTRIES; i++) {
+        irq_slot_t* slot = &irq_table[i];
+        irq_count_t sum = { 0 };
+        for (int c = 0; c < MAX_CPUS; c++) {
+            irq_count_t* count = &irq_counts[c][i];
+            sum.hits += count->hits;
+            sum.cycles += count->cycles;
+            if (count->max_cycles > sum.max_cycles) sum.max_cycles = count->max_cycles;
+        }
+        if (!sum.hits) continue;
+
+        kprint_int(i);
+        kprint("  "); kprint_int(sum.hits);
+        kprint("  "); kprint_int((uint32_t)udiv64_32(sum.cycles, sum.hits, NULL));
+        kprint("  "); kprint_int(sum.max_cycles);
+        kprint("  ");
+        if (slot->handler) kprintln(i < 32 ? exception_names[i] : "registered");
+        else kprintln(i == APIC_SPURIOUS_VECTOR ? "spurious" : "unhandled");
+    }
+    kprint("\n");
+}
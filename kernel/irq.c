@@ -7,6 +7,17 @@
 #include "irq.h"
 #include "kernel.h"
 #include "string.h"
+#include "timer.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "div64.h"
+#include "sched.h"
+#include "smp.h"
+#include "serial.h"
+#include "log.h"
+#include "perf.h"
+#include "bench.h"
 
 #define INPUT_MAX 80
 
@@ -19,11 +30,19 @@ char ch;
 char input_buffer[INPUT_MAX];
 int input_len = 0;
 
-volatile int line_ready = 0; // set to 1 when Enter is pressed
+volatile int line_ready = 0; // set to 1 when Enter is pressed, cleared by the consumer
 volatile uint32_t irq0_seen = 0;
 
-static delay_t cpu_delay;
-delay_t delays[MAX_DELAYS];
+// scancodes from irq1 to the shell thread; single producer (the ISR) and
+// single consumer (kbd_process), so head and tail each have one writer
+#define KBD_RING_SIZE 128	// power of two
+static volatile uint8_t kbd_ring[KBD_RING_SIZE];
+static volatile uint32_t kbd_head = 0;	// written by irq1_handler only
+static volatile uint32_t kbd_tail = 0;	// written by kbd_process only
+static bool kbd_overflowing = false;	// warned about the current burst
+static wait_queue_t kbd_wq;
+
+kbd_stats_t kbd_stats;
 
 static const char scancode_ascii[128] =
 {
@@ -95,6 +114,36 @@ void kprint(const char *s);
 // global tick counter
 volatile uint32_t timer_ticks = 0;
 
+#define LAT_SAMPLES			64
+
+// tick source: PIT channel 0, or the LAPIC timer once it is calibrated;
+// counts are in the source's input clock
+static bool tick_lapic = false;
+static uint32_t tick_hz = PIT_HZ;
+static uint32_t tick_counts = PIT_HZ / 1000;			// per 1 ms tick
+static uint32_t oneshot_max = 0xFFFF / (PIT_HZ / 1000);	// longest one-shot, in ticks
+#define LAPIC_ONESHOT_MAX	10000						// ticks, caps idle sleeps at 10 s
+
+bool tickless = true;					// one-shot timer while idle
+static volatile bool oneshot_armed = false;
+static volatile bool oneshot_fired = false;
+static uint32_t idle_remainder = 0;		// counts short of a whole tick
+
+static struct {
+	uint32_t wakeups;					// hlt returns
+	uint32_t oneshots;					// tickless sleeps
+	uint32_t oneshot_ticks;				// ticks covered by them
+	uint32_t rate_base;
+	uint32_t rate_tick;
+	uint32_t wakeups_per_sec;
+} idle_stats;
+
+// irq0 entry timestamp and EOI cost, for the latency test
+static volatile uint64_t irq0_entry_tsc;
+static volatile uint64_t irq0_eoi_tsc;		// right after the EOI
+static uint64_t eoi_cycles;
+static uint32_t eoi_count;
+
 // --- PIC remap + PIT setup ---
 
 static void pic_remap(void) {
@@ -112,7 +161,7 @@ static void pic_remap(void) {
 void timer_phase(unsigned int hz) {
     if (hz == 0) return;                 // avoid div-by-zero
 
-    unsigned int divisor = 1193182u / hz;
+    unsigned int divisor = PIT_HZ / hz;
     if (divisor == 0) divisor = 1;       // safety: minimum divisor
 
     // 0x36 = channel 0, access mode: lobyte/hibyte, mode 3 (square wave), binary
@@ -123,60 +172,331 @@ void timer_phase(unsigned int hz) {
     outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
 }
 
-void irq_init(void) {
-    idt_install();
-    pic_remap();
+// let ISA irq through to vector 0x20 + irq on whichever controller is active
+void irq_enable(uint8_t irq) {
+    if (apic_active) {
+        ioapic_route(irq, IRQ_VECTOR_BASE + irq);
+    } else if (irq < 8) {
+        outb(0x21, inb(0x21) & ~(1u << irq));
+    } else {
+        outb(0xA1, inb(0xA1) & ~(1u << (irq - 8)));
+        outb(0x21, inb(0x21) & ~(1u << 2));		// cascade
+    }
+}
 
-    // unmask IRQ0 (bit 0) and IRQ1 (bit 1), mask others
-    // mask bits: 1 = disabled, 0 = enabled
-    outb(0x21, 0xFC); // 11111100b -> IRQ0+1 ON, others OFF
-    outb(0xA1, 0xFF); // mask all on slave PIC for now
+// one LAPIC register write, or port writes that each exit under a VM
+void irq_eoi(uint8_t irq) {
+    if (apic_active) {
+        lapic_eoi();
+        return;
+    }
+    if (irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
 
-    timer_phase(1000);				// set PTI freq to 1000Hz (1ms tick)
-    __asm__ __volatile__("sti");	// enable interrupts globally
+// credit n ticks at once; uptime follows timer_ticks
+static void ticks_advance(uint32_t n) {
+    timer_ticks += n;
+    uptime = timer_ticks / 1000;
+    sched_tick(n);
 }
 
-// --- C handlers called from isr.asm ---
+// PIT channel 0 in mode 0: one interrupt after count input clocks
+static void pit_oneshot(uint16_t count) {
+    outb(0x43, 0x30);	// channel 0, lobyte/hibyte, mode 0, binary
+    outb(0x40, (uint8_t)(count & 0xFF));
+    outb(0x40, (uint8_t)(count >> 8));
+}
 
-void irq0_handler(void) {
-    timer_ticks++;
-    if (timer_ticks % 1000 == 0) {
-        uptime++;;
+static uint16_t pit_read_count(void) {
+    outb(0x43, 0x00);	// latch channel 0
+    uint8_t lo = inb(0x40);
+    uint8_t hi = inb(0x40);
+    return (uint16_t)(lo | (hi << 8));
+}
+
+static void tick_periodic(void) {
+    if (tick_lapic) lapic_timer_periodic(IRQ_VECTOR_BASE, tick_counts);
+    else timer_phase(1000);
+}
+
+static void tick_oneshot(uint32_t count) {
+    if (tick_lapic) lapic_timer_oneshot(IRQ_VECTOR_BASE, count);
+    else pit_oneshot(count);
+}
+
+// counts since tick_oneshot(count); *late is set when it expired after
+// the cli and its IRQ is still pending
+static uint32_t tick_elapsed(uint32_t count, bool* late) {
+    if (tick_lapic) {
+        uint32_t now = lapic_timer_current();	// stops at 0 in one-shot mode
+        *late = !oneshot_fired && now == 0;
+        return count - now;
     }
-    outb(0x20, 0x20); // end of EOI to master PIC
+    // mode 0 keeps counting down past 0, a count above the start value
+    // means it has expired; the count alone decides, a periodic IRQ0
+    // latched before the one-shot was armed sets oneshot_fired too
+    uint16_t now = pit_read_count();
+    bool expired = now == 0 || now > count;
+    *late = expired && !oneshot_fired;
+    return expired ? count + ((0x10000 - now) & 0xFFFF) : count - now;
+}
+
+static void idle_rate(void) {
+    uint32_t elapsed = timer_ticks - idle_stats.rate_tick;
+    if (elapsed < 1000) return;
+    idle_stats.wakeups_per_sec = (idle_stats.wakeups - idle_stats.rate_base) * 1000 / elapsed;
+    idle_stats.rate_base = idle_stats.wakeups;
+    idle_stats.rate_tick = timer_ticks;
 }
 
-bool start_delay(uint32_t ms, delay_callback_t cb) {
-    for (int i = 0; i < MAX_DELAYS; i++) {
-        if (!delays[i].active) {
-            delays[i].target_tick = timer_ticks + ms;
-            delays[i].callback = cb;
-            delays[i].active = true;
-            return true; // delay scheduled
+// sleep until the next interrupt, run by the idle thread; with tickless
+// set and no thread due to wake soon, the periodic tick is swapped for a
+// one-shot at the first sleeper's wake time and timer_ticks is caught up
+// from the timer count on wakeup; application processors keep their
+// local tick and just halt, only the BSP's tick keeps time
+void cpu_idle(void) {
+    __asm__ __volatile__("cli");
+    if (sched_runnable()) {		// woken before we got here, don't sleep
+        __asm__ __volatile__("sti");
+        return;
+    }
+    if (this_cpu()->index) {
+        __asm__ __volatile__("sti; hlt");
+        return;
+    }
+
+    uint32_t ticks = tickless ? sched_idle_ticks(oneshot_max) : 0;
+    if (ticks <= 1) {
+        __asm__ __volatile__("sti; hlt");	// sti shadow: no wakeup is lost
+        idle_stats.wakeups++;
+        idle_rate();
+        return;
+    }
+
+    uint32_t count = ticks * tick_counts;
+    oneshot_fired = false;
+    oneshot_armed = true;
+    tick_oneshot(count);
+    __asm__ __volatile__("sti; hlt; cli");
+
+    // woken by the one-shot or by another IRQ, find out how long we slept
+    bool late;
+    uint32_t elapsed = tick_elapsed(count, &late);
+    oneshot_armed = late;	// irq0 swallows the late one
+    tick_periodic();
+
+    idle_remainder += elapsed;
+    uint32_t slept = idle_remainder / tick_counts;
+    idle_remainder %= tick_counts;
+    ticks_advance(slept);
+
+    idle_stats.wakeups++;
+    idle_stats.oneshots++;
+    idle_stats.oneshot_ticks += slept;
+    idle_rate();
+    __asm__ __volatile__("sti");
+}
+
+void print_idleinfo(void) {
+    idle_rate();
+    kprint("Mode:              "); kprintln(tickless ? "tickless" : "periodic");
+    kprint("Tick source:       "); kprintln(tick_lapic ? "LAPIC timer" : "PIT");
+    kprint("Wakeups:           "); kprint_int(idle_stats.wakeups); kprint("\n");
+    kprint("Wakeups/sec:       "); kprint_int(idle_stats.wakeups_per_sec); kprint("\n");
+    kprint("One-shot sleeps:   "); kprint_int(idle_stats.oneshots); kprint("\n");
+    kprint("Avg sleep (ms):    ");
+    kprint_int(idle_stats.oneshots ? idle_stats.oneshot_ticks / idle_stats.oneshots : 0);
+    kprint("\n\n");
+}
+
+static uint32_t cycles_to_ns(uint32_t cycles) {
+    return (uint32_t)udiv64_32((uint64_t)cycles * 1000000, tsc_khz, NULL);
+}
+
+// arm a one-tick one-shot, spin until irq0 runs, and compare its entry
+// time with when the timer was due; covers delivery through the PIC or
+// the IOAPIC/LAPIC path and the stub, not the hlt wakeup; runs on the
+// BSP, the one-shot is armed on its timer. handler gets entry to EOI.
+static uint32_t timer_lat_sample(uint32_t* handler) {
+    uint64_t due = udiv64_32((uint64_t)tick_counts * tsc_khz * 1000, tick_hz, NULL);
+    __asm__ __volatile__("cli");
+    oneshot_fired = false;
+    oneshot_armed = true;
+    tick_oneshot(tick_counts);
+    uint64_t start = rdtsc();
+    __asm__ __volatile__("sti");
+    while (!oneshot_fired) __asm__ __volatile__("pause");
+    __asm__ __volatile__("cli");
+
+    int64_t late = (int64_t)(irq0_entry_tsc - start - due);
+    if (handler) *handler = (uint32_t)(irq0_eoi_tsc - irq0_entry_tsc);
+
+    tick_periodic();
+    ticks_advance(1);
+    __asm__ __volatile__("sti");
+    return late > 0 ? (uint32_t)late : 0;
+}
+
+void print_irqlat(void) {
+    if (!tsc_khz) {
+        kprintln("irqlat needs a calibrated TSC");
+        return;
+    }
+    thread_bind(0);
+
+    uint32_t min = 0xFFFFFFFF, max = 0;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < LAT_SAMPLES; i++) {
+        uint32_t cycles = timer_lat_sample(NULL);
+        if (cycles < min) min = cycles;
+        if (cycles > max) max = cycles;
+        sum += cycles;
+    }
+
+    uint32_t avg = (uint32_t)udiv64_32(sum, LAT_SAMPLES, NULL);
+    kprint("Path:        "); kprintln(apic_active ? (tick_lapic ? "LAPIC timer" : "PIT via IOAPIC") : "PIT via 8259");
+    kprint("Latency ns:  min "); kprint_int(cycles_to_ns(min));
+    kprint("  avg "); kprint_int(cycles_to_ns(avg));
+    kprint("  max "); kprint_int(cycles_to_ns(max)); kprint("\n");
+    kprint("EOI cycles:  ");
+    kprint_int(eoi_count ? (uint32_t)udiv64_32(eoi_cycles, eoi_count, NULL) : 0);
+    kprint(" avg over "); kprint_int(eoi_count); kprint(" ticks\n\n");
+    thread_bind(-1);
+}
+
+// --- BENCHMARK HOOKS ---
+// medians over LAT_SAMPLES in cycles, both on the BSP, where the ISA IRQs
+// arrive: delivery runs from the moment the interrupt is raised (or
+// unmasked) to handler entry, handler from entry to just after the EOI
+
+static volatile bool kbd_injected = false;	// irq1's next byte is the benchmark's
+static volatile uint64_t irq1_entry_tsc;
+static volatile uint64_t irq1_eoi_tsc;
+
+bool irq_bench_timer(uint32_t* delivery, uint32_t* handler) {
+    if (!tsc_khz) return false;
+    uint32_t d[LAT_SAMPLES], h[LAT_SAMPLES];
+    thread_bind(0);
+    for (int i = 0; i < LAT_SAMPLES; i++) d[i] = timer_lat_sample(&h[i]);
+    thread_bind(-1);
+    *delivery = bench_median(d, LAT_SAMPLES);
+    *handler = bench_median(h, LAT_SAMPLES);
+    return true;
+}
+
+// the 8042's "write keyboard output buffer" command hands a byte back as
+// if the keyboard had sent it, IRQ 1 included; false if the controller
+// never takes the command
+static bool kbd_inject(uint8_t byte, uint64_t timeout) {
+    uint64_t start = rdtsc();
+    while (inb(0x64) & 0x02)			// input buffer full
+        if (rdtsc() - start > timeout) return false;
+    outb(0x64, 0xD2);
+    while (inb(0x64) & 0x02)
+        if (rdtsc() - start > timeout) return false;
+    outb(0x60, byte);
+    return true;
+}
+
+// a key pressed while this runs is swallowed with the injected bytes
+bool irq_bench_kbd(uint32_t* delivery, uint32_t* handler) {
+    if (!tsc_khz) return false;
+    uint32_t d[LAT_SAMPLES], h[LAT_SAMPLES];
+    uint64_t timeout = (uint64_t)tsc_khz * 10;	// 10 ms
+    bool ok = true;
+    thread_bind(0);
+    for (int i = 0; i < LAT_SAMPLES && ok; i++) {
+        __asm__ __volatile__("cli");
+        kbd_injected = true;
+        ok = kbd_inject(0xAA, timeout);		// a shift release, in case it leaks
+        uint64_t start = rdtsc();
+        __asm__ __volatile__("sti");
+        while (ok && kbd_injected && rdtsc() - start < timeout) __asm__ __volatile__("pause");
+        if (kbd_injected) {
+            kbd_injected = false;
+            ok = false;
         }
+        d[i] = (uint32_t)(irq1_entry_tsc - start);
+        h[i] = (uint32_t)(irq1_eoi_tsc - irq1_entry_tsc);
     }
-    return false; // no free slot
+    thread_bind(-1);
+    if (!ok) return false;
+    *delivery = bench_median(d, LAT_SAMPLES);
+    *handler = bench_median(h, LAT_SAMPLES);
+    return true;
 }
 
-void check_delays(void) {
-    for (int i = 0; i < MAX_DELAYS; i++) {
-        if (delays[i].active &&
-            (int32_t)(timer_ticks - delays[i].target_tick) >= 0) {
-            delays[i].active = false;
-            if (delays[i].callback) {
-                delays[i].callback();  }
+static void irq0_handler(irq_frame_t* frame, void* ctx);
+static void irq1_handler(irq_frame_t* frame, void* ctx);
+
+void irq_init(void) {
+    idt_install();
+    irq_register(IRQ_VECTOR_BASE + 0, irq0_handler, NULL);
+    irq_register(IRQ_VECTOR_BASE + 1, irq1_handler, NULL);
+    pic_remap();
+
+    if (apic_init()) {
+        // everything goes through the IOAPIC now, 8259 fully masked
+        outb(0x21, 0xFF);
+        outb(0xA1, 0xFF);
+        if (lapic_timer_calibrate()) {
+            tick_lapic = true;
+            tick_hz = lapic_timer_hz;
+            tick_counts = lapic_timer_hz / 1000;
+            oneshot_max = 0xFFFFFFFF / tick_counts;
+            if (oneshot_max > LAPIC_ONESHOT_MAX) oneshot_max = LAPIC_ONESHOT_MAX;
+        } else {
+            irq_enable(0);
         }
+    } else {
+        // mask bits: 1 = disabled, 0 = enabled
+        outb(0x21, 0xFF);
+        outb(0xA1, 0xFF); // mask all on slave PIC for now
+        irq_enable(0);
     }
+    irq_enable(1);
+
+    tick_periodic();				// 1000Hz (1ms tick)
+    __asm__ __volatile__("sti");	// enable interrupts globally
+}
+
+// an application processor shares the IDT and gets a LAPIC tick of its
+// own for preemption; ISA IRQs stay routed to the BSP. Without a
+// calibrated LAPIC timer its threads only switch when they block.
+void irq_ap_init(void) {
+    idt_load();
+    lapic_ap_init();
+    if (tick_lapic) lapic_timer_periodic(IRQ_VECTOR_BASE, tick_counts);
 }
 
-bool delay_expired(void) {
-    if (!cpu_delay.active) return true;
+// --- handlers, registered in irq_init ---
 
-    if ((int32_t)(timer_ticks - cpu_delay.target_tick) >= 0) {
-        cpu_delay.active = false;
-        return true;
+static void irq0_handler(irq_frame_t* frame, void* ctx) {
+    (void)ctx;
+    perf_sample(frame);
+    if (this_cpu()->index) {	// an AP's local tick
+        sched_tick(1);
+        lapic_eoi();
+        return;
+    }
+    if (oneshot_armed) {
+        if (tsc_khz) irq0_entry_tsc = rdtsc();
+        oneshot_armed = false;
+        oneshot_fired = true;	// cpu_idle() credits the ticks
+    } else
+        ticks_advance(1);
+
+    if (tsc_khz) {
+        uint64_t start = rdtsc();
+        irq_eoi(0);
+        irq0_eoi_tsc = rdtsc();
+        eoi_cycles += irq0_eoi_tsc - start;
+        eoi_count++;
+    } else {
+        irq_eoi(0);
     }
-    return false;
 }
 
 void handle_extended_key(uint8_t sc) {
@@ -188,56 +508,66 @@ void handle_extended_key(uint8_t sc) {
 	}
 }
 
-// call delay like this:
-//__asm__ __volatile__("sti"); delay(time);
+// --- LINE EDITING ---
+// shared by the keyboard and the serial line
 
-// register key events 
-void irq1_handler(void) {
-    uint8_t sc = inb(0x60);  // read scancode
+static void input_enter(void) {
+    if (input_len < INPUT_MAX) {
+        input_buffer[input_len] = '\0';	// clear string
+    }
+    line_ready=1;
+    kputchar('\n'); input_len = 0;
+}
+
+static void input_backspace(void) {
+    if (input_len > 0) {
+        input_len--; kputchar('\b');
+    }
+}
+
+static void input_append(char c) {
+    kputchar(c);
+    if (input_len < INPUT_MAX - 1) { input_buffer[input_len++] = c; }
+    else kbd_stats.dropped++;
+}
 
+// turn one scancode into echo + line editing, runs in the main loop
+static void kbd_decode(uint8_t sc) {
     ch = scancode_ascii[sc & 0x7F];
 
     if (sc==0xE0) {
     	extended=true;
-    	outb(0x20,0x20); return;
+    	return;
     }
     if (extended) {
     	handle_extended_key(sc);
     	extended=false;
-    	outb(0x20,0x20); return;
+    	return;
     }
 
     switch(sc) {
     	case 0x2A:	// left shift down
     	case 0x36:	// right shift down
     		should_cap=true;
-    		outb(0x20,0x20);
     		return;
 
     	case 0xAA:	// left shift up
     	case 0xB6:	// right shift down
     	should_cap=false;
-    	outb(0x20,0x20);
     	return;
     }
     
     if (sc & 0x80)			   // ignore break codes 
-    { outb(0x20,0x20); return; }
+    { return; }
 
     if (sc==0x0E) {				// if 'backspace'
-    	if (input_len > 0) {
-    		input_len--; kputchar('\b');
-    	}
-    	outb(0x20,0x20); return;
+    	input_backspace();
+    	return;
     }
 							
     if (sc == 0x1C) {		   // if 'enter'
-    	if (input_len < INPUT_MAX) {
-    		input_buffer[input_len] = '\0';	// clear string
-    	}
-    	line_ready=1;
-    	kputchar('\n'); input_len = 0;
-    	outb(0x20,0x20); return;
+    	input_enter();
+    	return;
     }
     
     (void)sc;
@@ -250,46 +580,149 @@ void irq1_handler(void) {
     	if (sc==0x02) {			// !
     		if (input_len<INPUT_MAX) { input_buffer[input_len++] = '!'; }
     		kputchar('!');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     	else if (sc==0x0C) {	// ?
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = '?'; }
     		kputchar('?');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     	else if (sc==0x04)	{	// #
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = '#'; }
     		kputchar('#');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     	else if (sc==0x06) {	// %
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = '%'; }
     		kputchar('%');
-    		outb(0x20,0x20); return;
+    		return;
     	}	
     	else if (sc==0x09) {	// (
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = '('; }
     		kputchar('(');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     	else if (sc==0x0A) {	// )
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = ')'; }
     		kputchar(')');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     	else if (sc==0x35) {	// _
     	if (input_len<INPUT_MAX) { input_buffer[input_len++] = '_'; }
     		kputchar('_');
-    		outb(0x20,0x20); return;
+    		return;
     	}
     }
     
-    kputchar(ch); 
-    
-    if (input_len < INPUT_MAX - 1) { input_buffer[input_len++] = ch; }
+    input_append(ch);
     //kprint_int(sc); // type scancode (debug)
+}
 
-    // EOI
-    outb(0x20, 0x20);
+// a terminal on the serial line sends characters: CR (or LF, or both)
+// for Enter, DEL or BS to erase; escape sequences such as arrow keys
+// are skipped
+static uint8_t serial_esc = 0;		// 1 after ESC, 2 inside ESC [
+static bool serial_cr = false;
+
+static void serial_decode(char c) {
+    bool after_cr = serial_cr;
+    serial_cr = false;
+
+    if (serial_esc) {
+        if (serial_esc == 1 && c == '[') serial_esc = 2;
+        else if (serial_esc == 1 || (c >= 0x40 && c <= 0x7E)) serial_esc = 0;
+        return;
+    }
+    switch (c) {
+    case 0x1B:
+        serial_esc = 1;
+        return;
+    case '\r':
+        serial_cr = true;
+        input_enter();
+        return;
+    case '\n':
+        if (!after_cr) input_enter();
+        return;
+    case '\b':
+    case 0x7F:
+        input_backspace();
+        return;
+    }
+    if (c >= ' ' && c < 0x7F) input_append(c);
+}
+
+
+// top half: queue the scancode and acknowledge, nothing else
+static void irq1_handler(irq_frame_t* frame, void* ctx) {
+    (void)frame; (void)ctx;
+    uint64_t entry = kbd_injected ? rdtsc() : 0;
+    uint8_t sc = inb(0x60);  // read scancode
+    if (kbd_injected) {		// irq_bench_kbd's byte, not a key
+        irq_eoi(1);
+        irq1_eoi_tsc = rdtsc();
+        irq1_entry_tsc = entry;
+        kbd_injected = false;
+        return;
+    }
+    uint32_t head = kbd_head;
+    uint32_t depth = head - kbd_tail;
+
+    if (depth >= KBD_RING_SIZE) {
+        if (!kbd_overflowing) klog(LOG_WARN, "kbd: scancode ring full, dropping keys");
+        kbd_overflowing = true;	// once per burst
+        kbd_stats.overflows++;	// ring full, scancode lost
+    } else {
+        kbd_overflowing = false;
+        kbd_ring[head & (KBD_RING_SIZE - 1)] = sc;
+        __asm__ __volatile__("" : : : "memory");	// slot before head
+        kbd_head = head + 1;
+        kbd_stats.scancodes++;
+        if (depth + 1 > kbd_stats.max_depth) kbd_stats.max_depth = depth + 1;
+        wake_up(&kbd_wq);
+    }
+
+    irq_eoi(1);
+}
+
+// serial input arrived, from its IRQ handler
+void input_wake(void) {
+    wake_up(&kbd_wq);
 }
 
+// block the shell until irq1 or the serial line has queued something
+void kbd_wait(void) {
+    uint32_t flags = wq_lock();
+    while (kbd_head == kbd_tail && !serial_rx_ready()) wq_wait(&kbd_wq, 0);
+    wq_unlock(flags);
+}
+
+// bottom half: decode queued scancodes and serial characters; stops
+// while a finished line is waiting, so input_buffer stays put until
+// handle_command is done with it
+void kbd_process(void) {
+    uint32_t tail = kbd_tail;
+    if (tail == kbd_head && !serial_rx_ready()) return;
+
+    kconsole_hold();	// echo a burst of keys with one flush
+    while (!line_ready && tail != kbd_head) {
+        __asm__ __volatile__("" : : : "memory");	// head before slot
+        uint8_t sc = kbd_ring[tail & (KBD_RING_SIZE - 1)];
+        tail++;
+        kbd_tail = tail;
+        kbd_decode(sc);
+    }
+    int c;
+    while (!line_ready && (c = serial_getc()) >= 0)
+        serial_decode((char)c);
+    kconsole_release();
+}
+
+void print_kbdinfo(void) {
+    kprint("Scancodes queued:  "); kprint_int(kbd_stats.scancodes); kprint("\n");
+    kprint("Ring overflows:    "); kprint_int(kbd_stats.overflows); kprint("\n");
+    kprint("Chars dropped:     "); kprint_int(kbd_stats.dropped); kprint("\n");
+    kprint("Max ring depth:    "); kprint_int(kbd_stats.max_depth);
+    kprint(" / "); kprint_int(KBD_RING_SIZE); kprint("\n");
+    kprint("\n");
+}
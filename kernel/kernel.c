@@ -2,25 +2,39 @@
 
 #include <stdint.h>
 #include "irq.h"
+#include "idt.h"
 #include "string.h"
 #include "kernel.h"
 #include "ports.h"
 #include "memory.h"
+#include "paging.h"
+#include "boot.h"
+#include "cpu.h"
+#include "timer.h"
+#include "clock.h"
+#include "apic.h"
+#include "sched.h"
+#include "smp.h"
+#include "gdt.h"
+#include "spinlock.h"
+#include "fpu.h"
+#include "process.h"
+#include "serial.h"
+#include "log.h"
+#include "perf.h"
+#include "bench.h"
 
 #define VGA_TEXT_BUFFER 		((uint8_t*)	0xB8000)
 #define VGA_ROW_BYTES 			(VGA_WIDTH * 2)
-#define MEMORY_MAP_BASE 		0x00000500
 
 #define VGA_WIDTH  				80
 #define VGA_HEIGHT 				25
 #define MAX_ARGS 				8
 #define MAX_HISTORY 			16
 #define TEXT_ATTR 				0
-#define MEMORY_MAP_ENTRY_SIZE 	24
-#define MEMORY_MAP_ENTRIES		6
 #define SCROLLBACK_LINES 		1000
 
-static delay_t cpu_delay;
+static spinlock_t console_lock = SPINLOCK_INIT;	// shadow, cursor, hold depth
 
 unsigned int ktstrlen(const char* s);
 static int scrollback_head = 0;  
@@ -28,7 +42,7 @@ static int scrollback_size = 0;
 static int scroll_offset = 0;   
 
 static uint8_t text_attr = 0;
-static uint8_t scrollback[SCROLLBACK_LINES] [VGA_ROW_BYTES];
+static uint8_t (*scrollback)[VGA_ROW_BYTES];	// lazily backed vmap area
 uint8_t vga_attr(void) { return text_attr; }
 
 uint16_t cursor_pos = 0;
@@ -76,8 +90,16 @@ void set_bg(uint8_t bg) {
 }
 
 // --- CURSOR MOVEMENT ---
+static uint16_t hw_cursor_pos = 0xFFFF;	// last position sent to the CRTC
+static uint32_t vga_port_writes = 0;
+
+// four port writes, each a VM exit under virtualization; skipped when
+// the cursor has not moved since the last sync
 static void update_hw_cursor(void) {
 	uint16_t pos = cursor_pos;
+	if (pos == hw_cursor_pos) return;
+	hw_cursor_pos = pos;
+	vga_port_writes += 4;
 	outb(0x3D4, 0x0F);
 	outb(0x3D5, (uint8_t)(pos&0xFF));
 	outb(0x3D4, 0x0E);
@@ -106,64 +128,186 @@ void move_cursor_down() {
 	update_hw_cursor();
 }
 
+// --- CONSOLE ---
+// output is rendered into a RAM copy of the screen; rows written since
+// the last flush are copied to VGA memory in wide runs by kflush()
+#define ALL_ROWS				((1u << VGA_HEIGHT) - 1)
+
+static uint16_t shadow[VGA_HEIGHT][VGA_WIDTH];
+static uint32_t dirty_rows = 0;		// bit per shadow row
+static int console_hold_depth = 0;	// >0 while output is batched
+
+// sinks every write fans out to; the screen keeps its contents while off
+static bool sink_vga = true;
+static bool sink_serial = true;
+
+static struct {
+	uint32_t chars;
+	uint32_t flushes;
+	uint32_t rows_flushed;
+	uint32_t rate_base;				// chars at rate_second
+	int rate_second;
+	uint32_t cps;					// chars/sec over the last sample
+	uint32_t peak_cps;
+} console_stats;
+
+static void console_rate(void) {
+	int elapsed = uptime - console_stats.rate_second;
+	if (elapsed <= 0) return;
+	console_stats.cps = (console_stats.chars - console_stats.rate_base) / elapsed;
+	if (console_stats.cps > console_stats.peak_cps)
+		console_stats.peak_cps = console_stats.cps;
+	console_stats.rate_base = console_stats.chars;
+	console_stats.rate_second = uptime;
+}
+
+// copy dirty shadow rows to VGA memory, consecutive rows in one memcpy
+void kflush(void) {
+	if (console_hold_depth || !dirty_rows) return;
+
+	uint32_t rows = dirty_rows;
+	dirty_rows = 0;
+	for (int row = 0; row < VGA_HEIGHT; ) {
+		if (!(rows & (1u << row))) { row++; continue; }
+		int first = row;
+		while (row < VGA_HEIGHT && (rows & (1u << row))) row++;
+		memcpy(VGA_TEXT_BUFFER + first * VGA_ROW_BYTES, shadow[first], (row - first) * VGA_ROW_BYTES);
+		console_stats.rows_flushed += row - first;
+	}
+	console_stats.flushes++;
+	console_rate();
+}
+
+// batch output: nothing reaches VGA memory until the outermost release
+void kconsole_hold(void) {
+	uint32_t flags = spin_lock_irqsave(&console_lock);
+	console_hold_depth++;
+	spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void kconsole_release(void) {
+	uint32_t flags = spin_lock_irqsave(&console_lock);
+	if (console_hold_depth > 0 && --console_hold_depth == 0) {
+		kflush();
+		update_hw_cursor();
+	}
+	spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// show what is in the shadow now, even inside another thread's hold;
+// the shell uses it to echo keys while a command batches its output
+void kconsole_sync(void) {
+	uint32_t flags = spin_lock_irqsave(&console_lock);
+	int depth = console_hold_depth;
+	console_hold_depth = 0;
+	kflush();
+	update_hw_cursor();
+	console_hold_depth = depth;
+	spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// "console vga|serial on|off"
+static void console_sink(const char* sink, const char* state) {
+	bool on = strcmp(state, "on") == 0;
+	if (!on && strcmp(state, "off") != 0) {
+		kprintln("Usage: console vga|serial on|off");
+		return;
+	}
+	if (strcmp(sink, "vga") == 0) sink_vga = on;
+	else if (strcmp(sink, "serial") == 0) sink_serial = on;
+	else kprintln("Usage: console vga|serial on|off");
+}
+
+// switch the serial sink, returns how it was; benchmarks keep the UART out
+bool kconsole_serial(bool on) {
+	bool was = sink_serial;
+	sink_serial = on;
+	return was;
+}
+
+bool kconsole_vga(bool on) {
+	bool was = sink_vga;
+	sink_vga = on;
+	return was;
+}
+
+void print_console_stats(void) {
+	console_rate();
+	kprint("Sinks:             vga "); kprint(sink_vga ? "on" : "off");
+	kprint(", serial "); kprint(!serial_present ? "absent" : sink_serial ? "on" : "off"); kprint("\n");
+	kprint("Chars written:     "); kprint_int(console_stats.chars); kprint("\n");
+	kprint("Flushes:           "); kprint_int(console_stats.flushes); kprint("\n");
+	kprint("Rows copied:       "); kprint_int(console_stats.rows_flushed); kprint("\n");
+	kprint("Chars/sec (last):  "); kprint_int(console_stats.cps); kprint("\n");
+	kprint("Chars/sec (peak):  "); kprint_int(console_stats.peak_cps); kprint("\n");
+
+	// port writes per printed byte, two decimals
+	uint32_t per100 = console_stats.chars ? vga_port_writes * 100 / console_stats.chars : 0;
+	kprint("Port writes:       "); kprint_int(vga_port_writes);
+	kprint(" ("); kprint_int(per100 / 100); kputchar('.');
+	if (per100 % 100 < 10) kputchar('0');
+	kprint_int(per100 % 100); kprint(" per byte)\n");
+	kprint("\n");
+}
+
 // clear entire screen
 void kclear_screen(void) {
-    volatile uint8_t* vga = VGA_TEXT_BUFFER;
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; ++i) {
-        vga[i*2]     = ' ';
-        vga[i*2 + 1] = text_attr;	// use current text attr
-    }
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    memsetw(&shadow[0][0], (text_attr << 8) | ' ', VGA_WIDTH * VGA_HEIGHT);
+    dirty_rows = ALL_ROWS;
+    scroll_offset = 0;
     cursor_pos = 0;
+    kflush();
     update_hw_cursor();
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
+// show the screen scroll_offset lines back, history rows on top of the
+// shadow rows; written straight to VGA memory, the shadow stays as is
 static void kredraw_screen(void) {
-    volatile uint16_t* vga = (uint16_t*)VGA_TEXT_BUFFER;
-
     for (int row = 0; row < VGA_HEIGHT; row++) {
-        int buffer_line = (scrollback_head - scroll_offset - VGA_HEIGHT + row);
-
-        if (buffer_line < 0)
-            buffer_line += SCROLLBACK_LINES;
-
-        buffer_line %= SCROLLBACK_LINES;
-
-        for (int col = 0; col < VGA_WIDTH; col++) {
-            uint8_t ch   = scrollback[buffer_line][col * 2];
-            uint8_t attr = scrollback[buffer_line][col * 2 + 1];
-
-            vga[row * VGA_WIDTH + col] = (attr << 8) | ch;
+        const void* src;
+        if (row < scroll_offset) {
+            int line = (scrollback_head - scroll_offset + 1 + row + SCROLLBACK_LINES) % SCROLLBACK_LINES;
+            src = scrollback[line];
+        } else {
+            src = shadow[row - scroll_offset];
         }
+        memcpy(VGA_TEXT_BUFFER + row * VGA_ROW_BYTES, src, VGA_ROW_BYTES);
     }
 }
 
+// push the top row into the scrollback history, move the rest up
 static void kscroll_screen(void) {
-    scrollback_head = (scrollback_head + 1) % SCROLLBACK_LINES;
-
-    if (scrollback_size < SCROLLBACK_LINES)
-        scrollback_size++;
-
-    for (int i = 0; i < VGA_ROW_BYTES; i += 2) {
-        scrollback[scrollback_head][i]     = ' ';
-        scrollback[scrollback_head][i + 1] = text_attr;
+    if (scrollback) {
+        scrollback_head = (scrollback_head + 1) % SCROLLBACK_LINES;
+        if (scrollback_size < SCROLLBACK_LINES)
+            scrollback_size++;
+        memcpy(scrollback[scrollback_head], shadow[0], VGA_ROW_BYTES);
     }
 
-    scroll_offset = 0; // reset view to bottom
+    memmove(shadow[0], shadow[1], (VGA_HEIGHT - 1) * VGA_ROW_BYTES);
+    memsetw(shadow[VGA_HEIGHT - 1], (text_attr << 8) | ' ', VGA_WIDTH);
+    dirty_rows = ALL_ROWS;
     cursor_pos = (VGA_HEIGHT - 1) * VGA_WIDTH;
-
-    kredraw_screen();
 }
 
 void scroll_up(void) {
-    if (scroll_offset < scrollback_size - VGA_HEIGHT) {
+    if (scrollback && scroll_offset < scrollback_size) {
         scroll_offset++;
         kredraw_screen();
     }
 }
 
-// set character
-void kputchar(char c) {
-    volatile uint8_t* vga = VGA_TEXT_BUFFER;
+// put one character into the shadow buffer, no flush
+static void console_putc(char c) {
+    console_stats.chars++;
+
+    // new output snaps the view back from the history
+    if (scroll_offset) {
+        scroll_offset = 0;
+        dirty_rows = ALL_ROWS;
+    }
 
 	// new line
     if (c == '\n') {
@@ -171,7 +315,6 @@ void kputchar(char c) {
         if (cursor_pos >= VGA_WIDTH * VGA_HEIGHT) {
             kscroll_screen();
         }
-        update_hw_cursor();
         return;
     }
 
@@ -179,76 +322,128 @@ void kputchar(char c) {
     if (c == '\b') {
     	if (cursor_pos > 0) {
     		cursor_pos--;
-    		uint16_t offset = cursor_pos * 2;
-    		vga[offset]=' '; vga[offset+1]=text_attr; // erase char & keep same color
-    	} update_hw_cursor(); return;
+    		shadow[cursor_pos / VGA_WIDTH][cursor_pos % VGA_WIDTH] = (text_attr << 8) | ' ';	// erase char & keep same color
+    		dirty_rows |= 1u << (cursor_pos / VGA_WIDTH);
+    	} return;
     }
 
     // normal character
     if (cursor_pos >= VGA_WIDTH * VGA_HEIGHT) {
         kscroll_screen();
     }
-    
-    uint16_t offset = cursor_pos * 2;
-    vga[offset] = (uint8_t)c;
-    vga[offset + 1] = text_attr;  // use current global attr
+
+    shadow[cursor_pos / VGA_WIDTH][cursor_pos % VGA_WIDTH] = (text_attr << 8) | (uint8_t)c;	// use current global attr
+    dirty_rows |= 1u << (cursor_pos / VGA_WIDTH);
     cursor_pos++;
 
 	if (cursor_pos>=VGA_WIDTH*VGA_HEIGHT) {
 		kscroll_screen();
 	}
-    
-    update_hw_cursor();
+}
+
+// write len bytes in one pass: shadow buffer, one flush, one cursor sync;
+// atomic against other threads and CPUs, so lines from two writers don't mix
+static void kwrite_locked(const char* buf, size_t len) {
+    if (sink_vga) {
+        for (size_t i = 0; i < len; i++) {
+            console_putc(buf[i]);
+        }
+        if (!console_hold_depth) {	// else kconsole_release() syncs
+            kflush();
+            update_hw_cursor();
+        }
+    }
+    if (sink_serial) serial_write(buf, len);	// queued, the UART drains it
+}
+
+void kwrite(const char* buf, size_t len) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    kwrite_locked(buf, len);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// same, in foreground color fg; the log colors records by level
+void kwrite_color(const char* buf, size_t len, uint8_t fg) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    uint8_t attr = text_attr;
+    text_attr = (attr & 0xF0) | (fg & 0x0F);
+    kwrite_locked(buf, len);
+    text_attr = attr;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// set character
+void kputchar(char c) {
+    kwrite(&c, 1);
 }
 
 // just print
 void kprint(const char* s) {
-    while (*s) {
-        kputchar(*s++);
-    }
+    kwrite(s, strlen(s));
 }
 
 // print separate line
 void kprintln(const char* s) {
-    kprint(s);
-    kputchar('\n');
+    kconsole_hold();
+    kwrite(s, strlen(s));
+    kwrite("\n", 1);
+    kconsole_release();
 }
 
 // convert INT TO STR and print
 void kprint_int(int value) {
-	char buf[12]; // enough for -2147483648
-	int i = 0; int neg = 0;
-	if (value==0)
-	{
-		kputchar('0'); return; }
-	if (value<0)
-	{
-		neg=1; value = -value; }
-	while(value > 0)
+	char buf[11]; // enough for -2147483648
+	int i = sizeof(buf);
+	uint32_t mag = value < 0 ? -(uint32_t)value : (uint32_t)value;
+	do
 	{
-		int digit = value%10;
-		buf[i++]='0'+digit;
-		value/=10; 	}
-	if (neg) { buf[i++] = '-'; }
-	while(i--) { kputchar(buf[i]); }
+		buf[--i] = '0' + mag % 10;
+		mag /= 10; 	} while (mag);
+	if (value < 0) { buf[--i] = '-'; }
+	kwrite(&buf[i], sizeof(buf) - i);
 }
 
 // print hex
 void kprint_hex(uint32_t value) {
 	const char *hex = "0123456789ABCDEF";
-	kputchar('0'); kputchar('x');
-	for (int i = 28; i >= 0; i -= 4)
+	char buf[10];
+	buf[0] = '0'; buf[1] = 'x';
+	for (int i = 0; i < 8; i++)
 	{
-		kputchar(hex[(value >> i) & 0xF]);
+		buf[2 + i] = hex[(value >> (28 - i * 4)) & 0xF];
 	}
+	kwrite(buf, sizeof(buf));
 }
 
 // print available commands
 void kprint_help(void) {
 	kprintln("Available commands: ");
+	kprintln("  apic        Local APIC/IOAPIC mode, CPUs from the MADT, timer rate.");
+	kprintln("  bench       Fixed cycle benchmarks of console, heap, shell and IRQ paths.");
 	kprintln("  clear       Clear screen.");
+	kprintln("  console     Output counters; 'console vga|serial on|off' picks sinks.");
+	kprintln("  cpuinfo     CPU vendor, detected features and memcpy variant.");
+	kprintln("  dmesg       Kernel log; 'dmesg -n level' sets what reaches the console.");
+	kprintln("  fmtbench    Cycles per line: kprint helper chain against one kprintf.");
+	kprintln("  fpu         Lazy FPU switching: #NM traps, saves and restores per CPU.");
+	kprintln("  idle        Idle wakeups/sec; 'idle on|off' toggles tickless mode.");
+	kprintln("  intr        Per-vector interrupt counts and handler cycle cost.");
+	kprintln("  irqlat      Timer interrupt latency and EOI cost, PIC or APIC path.");
+	kprintln("  kbdinfo     Keyboard ring counters: queued, overflows, drops.");
+	kprintln("  meminfo     Physical memory usage and allocator counters.");
+	kprintln("  perf cmd    Timer-tick profiler: 'perf start|stop|report', top functions.");
+	kprintln("  procs       User programs, live processes and syscalls by entry path.");
+	kprintln("  run prog    Run a user program in ring 3: echo, uptime, sysbench.");
+	kprintln("  spin [ms]   Busy-loop for ms (default 5000), to watch preemption.");
+	kprintln("  serial      COM1 UART: bytes, FIFO loads, THRE interrupts, RX drops.");
+	kprintln("  slabinfo    Kernel heap size classes, hit rate and fragmentation.");
+	kprintln("  smp         CPUs online, per-CPU run queues, switches and steals.");
+	kprintln("  smpbench    CPU-bound work on 1..N threads; 'smpbench n' caps N.");
+	kprintln("  threads     Kernel threads, priorities, CPU ticks and switches.");
+	kprintln("  timers      Timer wheel: pending, fired, cancelled, cascaded.");
+	kprintln("  vmareas     Virtual memory areas and demand-zero fault counts.");
 	kprintln("  shutdown    Shut down the system now.");
-	kprintln("  uptime      Total time in seconds the system has been on.");
+	kprintln("  uptime      Time since boot, to the microsecond with a TSC.");
 	kprint("\n"); 
 }
 
@@ -259,9 +454,7 @@ void change_window_color(char* color) {
 
 // get length of characters in string
 unsigned int kstrlen(const char* s) {
-	unsigned int len = 0;
-	while (s[len] != '\0') { len++; }
-	return len;
+	return strlen(s);
 }
 
 unsigned int tokenize(const char* input, char* tokens[], unsigned int max_tokens) {
@@ -283,12 +476,62 @@ unsigned int tokenize(const char* input, char* tokens[], unsigned int max_tokens
     return count;	
 }
 
+// decimal string to number, stops at the first non-digit
+static uint32_t parse_uint(const char* s) {
+	uint32_t v = 0;
+	while (*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+	return v;
+}
+
+// unrecoverable error, stop here with interrupts off
+void kpanic(const char* msg) {
+	__asm__ __volatile__("cli");
+	console_lock.v = 0;				// may have died holding it
+	serial_panic();					// synchronous from here on
+	console_hold_depth = 0;
+	klog_panic();					// what the log still owes the screen
+	text_attr = VGA_COLOR_PANIC;
+	kprint("\nKERNEL PANIC: "); kprintln(msg);
+	for (;;) { asm volatile ("hlt"); }
+}
+
 // CPU forever loop
 void shutdown(void) {
 	kprint("\n"); kprintln("System halted. You may close the VM.");
 	for (;;) { asm volatile ("hlt"); }
 }
 
+// a user program in the foreground, argv[0] names it
+static void run_program(unsigned int argc, char** argv) {
+	process_t* p = process_spawn(argv[0], argc, argv);
+	if (!p) {
+		kprintln("Cannot start program");
+		return;
+	}
+	int code = process_wait(p);
+	if (code) { kprint("Exit code "); kprint_int(code); kprint("\n"); }
+}
+
+// "dmesg [level]", "dmesg -n level" or "dmesg -s"
+static void run_dmesg(unsigned int argc, char** argv) {
+	if (argc == 1) {
+		dmesg(LOG_DEBUG);
+		return;
+	}
+	if (strcmp(argv[1], "-s") == 0) {
+		print_loginfo();
+		return;
+	}
+	bool set = strcmp(argv[1], "-n") == 0;
+	int level = argc > (set ? 2u : 1u) ? log_level_parse(argv[set ? 2 : 1]) : -1;
+	if (level < 0) {
+		kprintln("Usage: dmesg [-s] [[-n] err|warn|info|debug]");
+		return;
+	}
+	if (set) klog_console_level(level);
+	else dmesg(level);
+}
+
 void handle_command(const char* cmd) {
 	// kprint("ran "); kprint(cmd); kprint("\n");	// DEBUG
 	// unsigned int length = kstrlen(cmd);			// DEBUG
@@ -302,15 +545,94 @@ void handle_command(const char* cmd) {
 		kprint("Putting CPU to sleep...");
 		start_delay(2000, shutdown);	// 2000 ms = 2 seconds
 	}
+	else if (strcmp(tokens[0], "bench") == 0) {
+		bench_run();
+	}
 	else if (strcmp(tokens[0], "clear") == 0) {
 		kclear_screen();
 	}
 	else if (strcmp(tokens[0], "help") == 0) {
 		kprint_help();
 	}
+	else if (strcmp(tokens[0], "apic") == 0) {
+		print_apicinfo();
+	}
+	else if (strcmp(tokens[0], "console") == 0) {
+		if (n >= 3) console_sink(tokens[1], tokens[2]);
+		else print_console_stats();
+	}
+	else if (strcmp(tokens[0], "cpuinfo") == 0) {
+		print_cpuinfo();
+	}
+	else if (strcmp(tokens[0], "dmesg") == 0) {
+		run_dmesg(n, tokens);
+	}
+	else if (strcmp(tokens[0], "fmtbench") == 0) {
+		fmt_bench();
+	}
+	else if (strcmp(tokens[0], "fpu") == 0) {
+		print_fpuinfo();
+	}
+	else if (strcmp(tokens[0], "idle") == 0) {
+		if (n > 1 && strcmp(tokens[1], "on") == 0) tickless = true;
+		else if (n > 1 && strcmp(tokens[1], "off") == 0) tickless = false;
+		print_idleinfo();
+	}
+	else if (strcmp(tokens[0], "intr") == 0) {
+		print_intrstats();
+	}
+	else if (strcmp(tokens[0], "irqlat") == 0) {
+		print_irqlat();
+	}
+	else if (strcmp(tokens[0], "kbdinfo") == 0) {
+		print_kbdinfo();
+	}
+	else if (strcmp(tokens[0], "meminfo") == 0) {
+		print_meminfo();
+	}
+	else if (strcmp(tokens[0], "perf") == 0) {
+		if (n > 1 && strcmp(tokens[1], "start") == 0) perf_start();
+		else if (n > 1 && strcmp(tokens[1], "stop") == 0) perf_stop();
+		else if (n > 1 && strcmp(tokens[1], "report") == 0) perf_report();
+		else kprintln("Usage: perf start|stop|report");
+	}
+	else if (strcmp(tokens[0], "procs") == 0) {
+		print_processes();
+	}
+	else if (strcmp(tokens[0], "run") == 0 && n > 1) {
+		run_program(n - 1, &tokens[1]);
+	}
+	else if (strcmp(tokens[0], "serial") == 0) {
+		print_serialinfo();
+	}
+	else if (strcmp(tokens[0], "slabinfo") == 0) {
+		print_slabinfo();
+	}
+	else if (strcmp(tokens[0], "smp") == 0) {
+		print_smpinfo();
+	}
+	else if (strcmp(tokens[0], "smpbench") == 0) {
+		smp_bench(n > 1 ? parse_uint(tokens[1]) : cpus_online);
+	}
+	else if (strcmp(tokens[0], "spin") == 0) {
+		uint32_t ms = n > 1 ? parse_uint(tokens[1]) : 5000;
+		uint32_t start = timer_ticks;
+		while (timer_ticks - start < ms) __asm__ __volatile__("pause");
+		kprint("spun "); kprint_int(ms); kprint(" ms, got ");
+		kprint_int(current_thread->ticks); kprintln(" ticks of CPU");
+	}
+	else if (strcmp(tokens[0], "threads") == 0) {
+		print_threads();
+	}
+	else if (strcmp(tokens[0], "timers") == 0) {
+		print_timers();
+	}
+	else if (strcmp(tokens[0], "vmareas") == 0) {
+		print_vmareas();
+	}
 	else if (strcmp(tokens[0], "uptime") == 0) {
-		kprint_int(uptime);
-		kprint("\n"); kprint("\n");
+		print_uptime();
+		kprint("\n");
 	}
 	else if (strcmp(tokens[0], "echo") == 0 && n > 1) {
 		for (unsigned int i=1;i<n;i++) {
@@ -343,56 +665,120 @@ void handle_command(const char* cmd) {
         kprintln("Usage: set fg color <name> | set bg color <name>");
     }
 }
+	else if (process_exists(tokens[0])) {
+		run_program(n, tokens);
+	}
 	else {
 		kprintln("Unknown command");
 	}
 }
 
+// --- SHELL ---
+// the shell thread decodes keys and echoes them; every command line runs
+// in a thread of its own, so a long command never stalls typing
+
+static void command_thread(void* arg) {
+	char* line = arg;
+	kconsole_hold();				// one flush per command
+	handle_command(line);
+	kconsole_release();
+	kfree(line);
+}
+
+static void run_command(const char* line) {
+	while (*line == ' ') line++;
+	if (!*line) return;
+
+	// the thread is named after the command
+	char name[THREAD_NAME_MAX];
+	size_t n = 0;
+	while (line[n] && line[n] != ' ' && n < THREAD_NAME_MAX - 1) { name[n] = line[n]; n++; }
+	name[n] = '\0';
+
+	size_t len = strlen(line) + 1;
+	char* copy = kmalloc(len);		// input_buffer is reused for the next line
+	if (!copy) {
+		kprintln("Out of memory");
+		return;
+	}
+	memcpy(copy, line, len);
+	if (!thread_create(name, command_thread, copy, PRIO_DEFAULT)) {
+		kfree(copy);
+		kprintln("Cannot start a thread for the command");
+	}
+}
+
+static void shell_thread(void* arg) {
+	(void)arg;
+	for (;;) {
+		kbd_wait();
+		kbd_process();				// decode queued keys
+		kconsole_sync();			// echo even while a command holds the console
+		if (line_ready) {
+			run_command(input_buffer);
+			line_ready=false;			// lets kbd_process continue
+		}
+	}
+}
+
 void get_memory_regions(void) {
-	for (uint32_t i = 0; i < MEMORY_MAP_ENTRIES; i++) {
-		uint64_t entry_addr = MEMORY_MAP_BASE + (i * MEMORY_MAP_ENTRY_SIZE);
-		uint64_t base = *(uint64_t*)(entry_addr + 0x00);
-		uint64_t size = *(uint64_t*)(entry_addr + 0x08);
-		uint64_t type = *(uint32_t*)(entry_addr + 0x10);
-
-		kprint("--- REGION "); kprint_int(i+1); kprint(" ---\n");
-		kprint("Region start address: "); kprint_hex(base); kprint("\n");
-		kprint("Region memory size: "); kprint_hex(size); kprint("\n");
-		kprint("Region memory type: ");
-		if (type == 1)
-			kprint("Usable\n");
-		else
-			kprint("Reserved / Bad memory\n");
-		kprint("\n");
+	for (int i = 0; i < memmap_count; i++) {
+		uint64_t base = memmap[i].base;
+		uint64_t size = memmap[i].length;
+		uint32_t type = memmap[i].type;
+
+		kprintf("--- REGION %d ---\n", i + 1);
+		kprintf("Region start address: 0x%016llX\n", base);
+		kprintf("Region memory size: 0x%016llX\n", size);
+		kprintf("Region memory type: %s\n\n", type == E820_USABLE ? "Usable" : "Reserved / Bad memory");
 	}
 }
 
-void kernel_main(void) {
+// mb_magic/mb_info come from a Multiboot loader, both 0 on the BIOS path
+void kernel_main(uint32_t mb_magic, uint32_t mb_info) {
+    boot_info_init(mb_magic, mb_info);	// before anything allocates
+    cpu_init();
+    gdt_init(&cpus[0]);					// this_cpu() works from here
+    string_init();
+    clock_init();
+    serial_init();						// output queues up until irq_init()
+
 	text_attr = VGA_COLOR_WHITE;
     kclear_screen();
 
+    // parse E820 map, set up frame allocator + slab heap
+    memory_init();
+    paging_init();
+    klog_init();
+    fpu_init();							// #NM handler, before any thread exists
+
+    // scrollback only costs the pages that get written
+    scrollback = vmap((SCROLLBACK_LINES * VGA_ROW_BYTES + PAGE_SIZE - 1) / PAGE_SIZE,
+                      VM_WRITE | VM_LAZY, "scrollback");
+
     // set up IDT + PIC + PIT + enable interrupts
     irq_init();
+    serial_irq_init();
 
     // --- startup messages ---
     uint8_t master_mask = inb(0x21);
     uint8_t slave_mask = inb(0xA1);
 
 	text_attr = VGA_COLOR_L_CYAN;
-    kprint("PIC master mask: 0x"); kprint_hex(master_mask);
-    kprint("\n");
-    kprint("PIC slave  mask: 0x"); kprint_hex(slave_mask);  kprint("\n");
+    kprintf("PIC master mask: 0x%02X\n", master_mask);
+    kprintf("PIC slave  mask: 0x%02X\n", slave_mask);
 
     uint32_t eflags;
     asm volatile ("pushf; pop %0" : "=g"(eflags));
-    kprint("EFLAGS: 0x"); kprint_hex(eflags); kprint(" ");
-    kprint((eflags & (1<<9)) ? "IF=1\n" : "IF=0\n");
+    kprintf("EFLAGS: 0x%08X IF=%u\n", (unsigned)eflags, (unsigned)(eflags >> 9) & 1);
 
 	kprint("\n");
     get_memmap_count();
     kprint("\n");
 
+	kconsole_hold();
 	get_memory_regions();
+	kconsole_release();
 
 	text_attr = VGA_COLOR_L_GREEN;
     kprintln("\nrunning panacheOS 1.0");
@@ -400,20 +786,25 @@ void kernel_main(void) {
     kprintln("[[[ in ANEMOIA kernel ]]]\n");
 
     text_attr = VGA_COLOR_WHITE;
-    kprintln("[ OK ] Reached kernel_main()");
-    kprintln("[ OK ] Running in 32-bit protected mode");
-    kprintln("[ .. ] Initializing IDT, timer, and keyboard IRQ...");
-    
-    kprintln("[ OK ] Interrupts enabled (timer & keyboard)");
+    klog(LOG_INFO, "Reached kernel_main()");
+    klog(LOG_INFO, "Running in 32-bit protected mode");
+    if (boot_multiboot) {
+        klogf(LOG_INFO, "Booted by a Multiboot loader, cmdline: %s", boot_cmdline);
+    }
+    klog(LOG_INFO, "Interrupts enabled (timer & keyboard)");
     kprintln("Welcome.");
    	kprintln("\n");
 
-   	while (1) {
-   		asm volatile("hlt");	// sleep until next interrupt
-   		check_delays();
-   		if (line_ready) {
-   			handle_command(input_buffer);
-   			line_ready=false;
-   	   }
-   	}
+   	// from here on kernel_main is the BSP's idle thread
+   	syscall_init();
+   	sched_init(&cpus[0]);
+   	smp_init();
+   	klogf(LOG_INFO, "%u CPU(s) online", (unsigned)cpus_online);
+   	timer_thread_init();
+   	klog_thread_init();				// log output is deferred from here on
+   	if (!thread_create("shell", shell_thread, NULL, PRIO_SHELL))
+   		kpanic("cannot start the shell");
+   	if (boot_option("bench") && !thread_create("bench", bench_thread, NULL, PRIO_DEFAULT))
+   		kpanic("cannot start the benchmarks");
+   	sched_idle();
  }
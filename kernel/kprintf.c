@@ -0,0 +1,266 @@
+// kprintf.c - formatted output
+// - %d %i %u %x %X %s %c %p %%, with '-' and '0' flags, a width, and
+//   the l/ll/z length modifiers; ll takes 64-bit values
+// - a line is formatted into a stack buffer and reaches the console in
+//   a single kwrite(), so it is never interleaved with other writers
+// - decimal digits come two at a time from a table, 64-bit values are
+//   split into 8-digit groups with one udiv64_32 each
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include "kernel.h"
+#include "string.h"
+#include "div64.h"
+#include "cpu.h"
+#include "clock.h"
+
+#define KPRINTF_MAX			256		// longer output is cut
+#define NUM_MAX				24		// 20 decimal digits of 2^64, sign, "0x"
+
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+// digits are written backwards, ending just before end; each returns
+// where the number starts
+static char* fmt_u32(char* end, uint32_t v) {
+	while (v >= 100) {
+		uint32_t q = v / 100;		// a multiply, not a divl
+		const char* pair = &digit_pairs[(v - q * 100) * 2];
+		*--end = pair[1];
+		*--end = pair[0];
+		v = q;
+	}
+	if (v >= 10) {
+		*--end = digit_pairs[v * 2 + 1];
+		*--end = digit_pairs[v * 2];
+	} else {
+		*--end = '0' + v;
+	}
+	return end;
+}
+
+static char* fmt_u64(char* end, uint64_t v) {
+	while (v >> 32) {
+		uint32_t low;
+		v = udiv64_32(v, 100000000, &low);
+		char* group = end - 8;		// zero-padded, more digits follow
+		end = fmt_u32(end, low);
+		while (end > group) *--end = '0';
+	}
+	return fmt_u32(end, (uint32_t)v);
+}
+
+static char* fmt_hex(char* end, uint64_t v, const char* digits) {
+	do {
+		*--end = digits[v & 0xF];
+		v >>= 4;
+	} while (v);
+	return end;
+}
+
+// --- OUTPUT ---
+
+typedef struct {
+	char* buf;
+	size_t size;				// room including the terminating NUL
+	size_t len;					// what the full output would take
+} fmt_out_t;
+
+static inline void out_put(fmt_out_t* out, const char* s, size_t n) {
+	if (out->len < out->size) {
+		size_t room = out->size - 1 - out->len;
+		memcpy(out->buf + out->len, s, n < room ? n : room);
+	}
+	out->len += n;
+}
+
+static inline void out_pad(fmt_out_t* out, char c, int n) {
+	for (; n > 0; n--) {
+		if (out->len + 1 < out->size) out->buf[out->len] = c;
+		out->len++;
+	}
+}
+
+// one field: sign or prefix, padding, digits
+static void out_field(fmt_out_t* out, const char* prefix, const char* s, size_t n,
+					  int width, bool left, bool zero) {
+	size_t plen = strlen(prefix);
+	int pad = width - (int)(plen + n);
+	if (!left && !zero) out_pad(out, ' ', pad);
+	out_put(out, prefix, plen);
+	if (!left && zero) out_pad(out, '0', pad);
+	out_put(out, s, n);
+	if (left) out_pad(out, ' ', pad);
+}
+
+// like vsnprintf: returns the length the whole output needs, writes at
+// most size - 1 bytes of it and always terminates
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+	fmt_out_t out = { buf, size, 0 };
+	char num[NUM_MAX];
+	char* end = num + NUM_MAX;
+
+	while (*fmt) {
+		const char* run = fmt;
+		while (*fmt && *fmt != '%') fmt++;
+		if (fmt > run) out_put(&out, run, fmt - run);
+		if (!*fmt) break;
+		fmt++;
+
+		bool left = false, zero = false;
+		for (;; fmt++) {
+			if (*fmt == '-') left = true;
+			else if (*fmt == '0') zero = true;
+			else break;
+		}
+		int width = 0;
+		while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+		int longs = 0;
+		while (*fmt == 'l' || *fmt == 'z') {
+			if (*fmt == 'l') longs++;	// l and z are 32 bits here
+			fmt++;
+		}
+
+		const char* prefix = "";
+		char* s;
+		uint64_t v;
+		switch (*fmt) {
+		case 'd':
+		case 'i': {
+			int64_t sv = longs >= 2 ? va_arg(ap, int64_t) : va_arg(ap, int32_t);
+			if (sv < 0) prefix = "-";
+			v = sv < 0 ? -(uint64_t)sv : (uint64_t)sv;
+			s = v >> 32 ? fmt_u64(end, v) : fmt_u32(end, (uint32_t)v);
+			break;
+		}
+		case 'u':
+			v = longs >= 2 ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t);
+			s = v >> 32 ? fmt_u64(end, v) : fmt_u32(end, (uint32_t)v);
+			break;
+		case 'x':
+		case 'X':
+			v = longs >= 2 ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t);
+			s = fmt_hex(end, v, *fmt == 'X' ? hex_upper : hex_lower);
+			break;
+		case 'p': {						// always all eight digits
+			uint32_t p = (uint32_t)va_arg(ap, void*);
+			prefix = "0x";
+			s = end - 8;
+			for (char* d = end; d > s; p >>= 4) *--d = hex_lower[p & 0xF];
+			break;
+		}
+		case 'c':
+			num[0] = (char)va_arg(ap, int);
+			out_field(&out, "", num, 1, width, left, false);
+			fmt++;
+			continue;
+		case 's': {
+			const char* str = va_arg(ap, const char*);
+			if (!str) str = "(null)";
+			out_field(&out, "", str, strlen(str), width, left, false);
+			fmt++;
+			continue;
+		}
+		case '%':
+			out_put(&out, "%", 1);
+			fmt++;
+			continue;
+		default:						// unknown: print it as it stands
+			out_put(&out, "%", 1);
+			if (!*fmt) continue;
+			out_put(&out, fmt, 1);
+			fmt++;
+			continue;
+		}
+		out_field(&out, prefix, s, end - s, width, left, zero);
+		fmt++;
+	}
+
+	if (size) buf[out.len < size ? out.len : size - 1] = '\0';
+	return (int)out.len;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = kvsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+int kprintf(const char* fmt, ...) {
+	char buf[KPRINTF_MAX];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	kwrite(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+	return n;
+}
+
+// --- BENCHMARK ---
+// the same E820-style line printed through a chain of kprint helpers and
+// through one kprintf. The console is held and the serial sink paused, so
+// both numbers are formatting plus rendering into the shadow buffer.
+
+#define BENCH_LINES			32
+#define BENCH_ROUNDS		4
+#define BENCH_FORMATS		1000
+
+static uint32_t bench_chain(uint32_t i) {
+	uint64_t start = rdtsc();
+	kprint("Region "); kprint_int(i); kprint(": base "); kprint_hex(0x00100000 * i);
+	kprint(" size "); kprint_hex(0x07EE0000); kprint(" type "); kprint_int(1); kprint("\n");
+	return (uint32_t)(rdtsc() - start);
+}
+
+static uint32_t bench_kprintf(uint32_t i) {
+	uint64_t start = rdtsc();
+	kprintf("Region %u: base 0x%08X size 0x%08X type %d\n", (unsigned)i,
+			(unsigned)(0x00100000 * i), 0x07EE0000u, 1);
+	return (uint32_t)(rdtsc() - start);
+}
+
+void fmt_bench(void) {
+	if (!tsc_khz) {
+		kprintln("fmtbench needs a calibrated TSC");
+		return;
+	}
+
+	// best round of each, interleaved so both see the same cache state
+	uint32_t best_chain = UINT32_MAX, best_kprintf = UINT32_MAX;
+	bool serial = kconsole_serial(false);
+	kconsole_hold();
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		uint32_t chain = 0, fmt = 0;
+		for (uint32_t i = 0; i < BENCH_LINES; i++) chain += bench_chain(i);
+		for (uint32_t i = 0; i < BENCH_LINES; i++) fmt += bench_kprintf(i);
+		if (chain < best_chain) best_chain = chain;
+		if (fmt < best_kprintf) best_kprintf = fmt;
+	}
+	kconsole_release();
+	kconsole_serial(serial);
+
+	// formatting alone, nothing printed; 64-bit fields on top
+	char line[KPRINTF_MAX];
+	uint64_t start = rdtsc();
+	for (uint32_t i = 0; i < BENCH_FORMATS; i++)
+		ksnprintf(line, sizeof(line), "Region %u: base 0x%016llX size %llu type %d\n",
+				  (unsigned)i, 0x100000000ull * i, 0x7EE00000ull * i, 1);
+	uint32_t snp = (uint32_t)udiv64_32(rdtsc() - start, BENCH_FORMATS, NULL);
+
+	uint32_t chain = best_chain / BENCH_LINES, fmt = best_kprintf / BENCH_LINES;
+	kprintf("\n%-19s%u cycles/line (%u calls)\n", "kprint chain:", (unsigned)chain, 9u);
+	kprintf("%-19s%u cycles/line (1 call)\n", "kprintf:", (unsigned)fmt);
+	kprintf("%-19s%u cycles/line, 64-bit fields\n", "ksnprintf only:", (unsigned)snp);
+	if (fmt) {
+		uint32_t x100 = chain * 100 / fmt;
+		kprintf("%-19s%u.%02ux\n\n", "Speedup:", (unsigned)(x100 / 100), (unsigned)(x100 % 100));
+	}
+}
@@ -0,0 +1,26 @@
+// ksyms.c - address to function name, for the profiler and crash output
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ksyms.h"
+
+// the function addr falls in: the last symbol at or below it, -1 when
+// it is outside the kernel's code
+int ksym_index(uint32_t addr) {
+	if (!ksyms_count || addr < ksyms[0].addr || addr >= (uint32_t)__text_end) return -1;
+	uint32_t lo = 0, hi = ksyms_count;
+	while (hi - lo > 1) {
+		uint32_t mid = (lo + hi) / 2;
+		if (ksyms[mid].addr <= addr) lo = mid;
+		else hi = mid;
+	}
+	return (int)lo;
+}
+
+// NULL if unknown, otherwise the name and addr's offset into it
+const char* ksym_name(uint32_t addr, uint32_t* offset) {
+	int i = ksym_index(addr);
+	if (i < 0) return NULL;
+	if (offset) *offset = addr - ksyms[i].addr;
+	return ksyms[i].name;
+}
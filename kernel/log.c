@@ -0,0 +1,282 @@
+// log.c - kernel log ring
+// - klog() stamps a record with the time, level and CPU and copies it
+//   into a ring of fixed-size slots; writers claim a slot with one atomic
+//   add and never take a lock, so interrupt handlers on any CPU can log
+// - the console sees records later, when the klogd thread drains the
+//   ring; until that thread exists, and after a panic, klog() drains it
+//   itself before returning
+// - the ring keeps the newest LOG_RECORDS records for dmesg, whether or
+//   not they scrolled off the screen; records the console could not keep
+//   up with are counted as lost, dmesg still has them
+// - not from code holding sched_lock: waking klogd takes it
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include "log.h"
+#include "kernel.h"
+#include "string.h"
+#include "memory.h"
+#include "paging.h"
+#include "clock.h"
+#include "div64.h"
+#include "sched.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define LOG_RECORDS			256		// power of two
+#define LOG_PAGES			((LOG_RECORDS * sizeof(log_record_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+#define READ_OK				0
+#define READ_PENDING		1		// claimed, its writer is not done yet
+#define READ_GONE			2		// overwritten by a newer record
+
+// one slot, 128 bytes; stamp is the record's sequence number + 1 once
+// the text is in place, 0 while a writer fills it
+typedef struct {
+	volatile uint32_t stamp;
+	uint8_t level;
+	uint8_t len;
+	uint8_t cpu;
+	uint8_t reserved;
+	uint64_t time_us;
+	char text[LOG_TEXT_MAX];
+} log_record_t;
+
+static const char* level_names[LOG_LEVELS] = { "err", "warn", "info", "debug" };
+static const uint8_t level_colors[LOG_LEVELS] = {
+	VGA_COLOR_L_RED, VGA_COLOR_YELLOW, VGA_COLOR_WHITE, VGA_COLOR_D_GREY,
+};
+
+static log_record_t* log_ring = NULL;
+static volatile uint32_t log_next = 0;		// sequence number of the next record
+static uint32_t log_flushed = 0;			// first record the console has not seen
+static int console_level = LOG_INFO;
+
+static spinlock_t flush_lock = SPINLOCK_INIT;	// one drain at a time
+static bool log_sync = true;				// no klogd: writers drain the ring
+static volatile bool klogd_kicked = false;
+static wait_queue_t klogd_wq;
+
+static struct {
+	uint32_t records[LOG_LEVELS];
+	uint32_t truncated;
+	uint32_t dropped;			// before klog_init()
+	uint32_t lost;				// overwritten before the console saw them
+	uint32_t wakeups;			// klogd drain passes
+} log_stats;
+
+int log_level_parse(const char* name) {
+	for (int i = 0; i < LOG_LEVELS; i++) {
+		if (strcmp(name, level_names[i]) == 0) return i;
+	}
+	if (name[0] >= '0' && name[0] < '0' + LOG_LEVELS && !name[1]) return name[0] - '0';
+	return -1;
+}
+
+// after paging_init(); the slots are backed up front, a lazy page would
+// fault inside whatever interrupt handler logs first
+void klog_init(void) {
+	log_ring = vmap(LOG_PAGES, VM_WRITE, "klog");
+	if (!log_ring) kpanic("cannot map the kernel log");
+	memset(log_ring, 0, LOG_PAGES * PAGE_SIZE);
+}
+
+// --- WRITERS ---
+
+static void log_kick(void) {
+	if (log_sync) {
+		klog_flush();
+		return;
+	}
+	if (!__atomic_exchange_n(&klogd_kicked, true, __ATOMIC_ACQ_REL))
+		wake_up(&klogd_wq);
+}
+
+// any context, any CPU; one line, a trailing newline is dropped
+void klog_write(int level, const char* buf, size_t len) {
+	if (level < 0) level = LOG_ERR;
+	if (level >= LOG_LEVELS) level = LOG_DEBUG;
+	while (len && buf[len - 1] == '\n') len--;
+	if (len > LOG_TEXT_MAX) {
+		len = LOG_TEXT_MAX;
+		__atomic_fetch_add(&log_stats.truncated, 1, __ATOMIC_RELAXED);
+	}
+	if (!log_ring) {
+		log_stats.dropped++;
+		return;
+	}
+	uint64_t now = ktime_us();
+
+	// interrupts off from claim to commit, so a slot is never held by a
+	// preempted writer while the ring laps it
+	uint32_t flags = irq_save();
+	uint32_t seq = __atomic_fetch_add(&log_next, 1, __ATOMIC_RELAXED);
+	log_record_t* r = &log_ring[seq & (LOG_RECORDS - 1)];
+	__atomic_store_n(&r->stamp, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);	// readers see 0 before the new text
+	r->level = (uint8_t)level;
+	r->len = (uint8_t)len;
+	r->cpu = (uint8_t)this_cpu()->index;
+	r->time_us = now;
+	memcpy(r->text, buf, len);
+	__atomic_store_n(&r->stamp, seq + 1, __ATOMIC_RELEASE);
+	irq_restore(flags);
+
+	__atomic_fetch_add(&log_stats.records[level], 1, __ATOMIC_RELAXED);
+	log_kick();
+}
+
+void klog(int level, const char* msg) {
+	klog_write(level, msg, strlen(msg));
+}
+
+// formatted on the caller's stack, then copied like any other record
+void klogf(int level, const char* fmt, ...) {
+	char text[LOG_TEXT_MAX + 1];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = kvsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	klog_write(level, text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text));	// cut is counted
+}
+
+// --- READERS ---
+
+// copy record seq out of its slot; the stamp is checked again after the
+// copy, a writer may have lapped the ring in between
+static int log_read(uint32_t seq, log_record_t* out) {
+	log_record_t* r = &log_ring[seq & (LOG_RECORDS - 1)];
+	uint32_t stamp = __atomic_load_n(&r->stamp, __ATOMIC_ACQUIRE);
+	if (stamp != seq + 1)
+		return (stamp && (int32_t)(stamp - (seq + 1)) > 0) ? READ_GONE : READ_PENDING;
+	out->level = r->level;
+	out->len = r->len;
+	out->cpu = r->cpu;
+	out->time_us = r->time_us;
+	memcpy(out->text, r->text, out->len);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->stamp, __ATOMIC_RELAXED) == seq + 1 ? READ_OK : READ_GONE;
+}
+
+// "[    5.012345] text", one kwrite per record
+static void log_print(const log_record_t* rec) {
+	char line[LOG_TEXT_MAX + 24];	// "[", 10 digits, ".", 6, "] ", text, "\n"
+	uint32_t us;
+	uint32_t sec = (uint32_t)udiv64_32(rec->time_us, 1000000, &us);
+	size_t n = 0;
+
+	line[n++] = '[';
+	char digits[10];
+	int d = 0;
+	do { digits[d++] = '0' + sec % 10; sec /= 10; } while (sec);
+	for (int pad = d; pad < 5; pad++) line[n++] = ' ';
+	while (d) line[n++] = digits[--d];
+	line[n++] = '.';
+	for (int i = 5; i >= 0; i--) { line[n + i] = '0' + us % 10; us /= 10; }
+	n += 6;
+	line[n++] = ']';
+	line[n++] = ' ';
+
+	memcpy(&line[n], rec->text, rec->len);
+	n += rec->len;
+	line[n++] = '\n';
+	kwrite_color(line, n, level_colors[rec->level]);
+}
+
+// hand new records to the console; a drain already running elsewhere
+// picks up whatever it finds when its loop comes around
+void klog_flush(void) {
+	if (!log_ring) return;
+	for (;;) {
+		if (!spin_trylock(&flush_lock)) return;
+		bool stalled = false;
+		uint32_t next;
+		while (log_flushed != (next = __atomic_load_n(&log_next, __ATOMIC_ACQUIRE))) {
+			if (next - log_flushed > LOG_RECORDS) {
+				log_stats.lost += next - LOG_RECORDS - log_flushed;
+				log_flushed = next - LOG_RECORDS;
+			}
+			log_record_t rec;
+			int st = log_read(log_flushed, &rec);
+			if (st == READ_PENDING) {	// its writer kicks again on commit
+				stalled = true;
+				break;
+			}
+			if (st == READ_GONE) log_stats.lost++;
+			else if (rec.level <= console_level) log_print(&rec);
+			log_flushed++;
+		}
+		spin_unlock(&flush_lock);
+
+		// a writer that found the lock taken after our last look
+		if (stalled || log_flushed == __atomic_load_n(&log_next, __ATOMIC_ACQUIRE)) return;
+	}
+}
+
+// --- KLOGD ---
+
+static void klogd_thread(void* arg) {
+	(void)arg;
+	for (;;) {
+		uint32_t flags = wq_lock();
+		while (!klogd_kicked) wq_wait(&klogd_wq, 0);
+		wq_unlock(flags);
+		__atomic_store_n(&klogd_kicked, false, __ATOMIC_RELEASE);
+		log_stats.wakeups++;
+		klog_flush();
+	}
+}
+
+// after sched_init(); from here on writers only copy and kick
+void klog_thread_init(void) {
+	if (!thread_create("klogd", klogd_thread, NULL, PRIO_LOG))
+		kpanic("cannot start klogd");
+	log_sync = false;
+	klog_flush();
+}
+
+// from kpanic(), interrupts off for good: print what is pending, and
+// every record after it right away
+void klog_panic(void) {
+	flush_lock.v = 0;				// may have died holding it
+	log_sync = true;
+	klog_flush();
+}
+
+// --- DMESG ---
+
+void klog_console_level(int level) {
+	console_level = level;
+}
+
+// replay every record still in the ring, at level or more severe
+void dmesg(int level) {
+	if (!log_ring) return;
+	uint32_t next = __atomic_load_n(&log_next, __ATOMIC_ACQUIRE);
+	uint32_t seq = next > LOG_RECORDS ? next - LOG_RECORDS : 0;
+	for (; seq != next; seq++) {
+		log_record_t rec;
+		if (log_read(seq, &rec) == READ_OK && rec.level <= level) log_print(&rec);
+	}
+}
+
+void print_loginfo(void) {
+	uint32_t next = log_next;
+	kprint("Records:           "); kprint_int(next);
+	kprint(" ("); kprint_int(next < LOG_RECORDS ? next : LOG_RECORDS);
+	kprint(" of "); kprint_int(LOG_RECORDS); kprint(" kept)\n");
+	kprint("By level:          ");
+	for (int i = 0; i < LOG_LEVELS; i++) {
+		kprint(level_names[i]); kputchar(' '); kprint_int(log_stats.records[i]);
+		kprint(i < LOG_LEVELS - 1 ? ", " : "\n");
+	}
+	kprint("Console level:     "); kprintln(level_names[console_level]);
+	kprint("Not yet flushed:   "); kprint_int(next - log_flushed); kprint("\n");
+	kprint("Lost to console:   "); kprint_int(log_stats.lost); kprint("\n");
+	kprint("Truncated:         "); kprint_int(log_stats.truncated); kprint("\n");
+	kprint("Dropped (early):   "); kprint_int(log_stats.dropped); kprint("\n");
+	kprint("klogd wakeups:     "); kprint_int(log_stats.wakeups); kprint("\n");
+	kprint("\n");
+}
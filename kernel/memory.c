@@ -1,40 +1,647 @@
 // memory.c
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "memory.h"
 #include "kernel.h"
+#include "paging.h"
+#include "cpu.h"
+#include "string.h"
+#include "boot.h"
+#include "spinlock.h"
 
-#define ALIGN 8
-#define NULL 0
-#define MEMMAP_BUFFER ((e820_entry_t*)0x00000500)
+#define BOOT_STACK_TOP		0x00090000
+#define BOOT_STACK_SIZE		0x00010000
+#define LOW_MEM_RESERVED	0x00001000	// IVT, BDA, E820 buffer
+#define EBDA_START			0x0009F000	// EBDA, VGA memory, option ROMs, BIOS
+#define HIGH_MEM_START		0x00100000
 
-static uint8_t* heap_ptr;
-static uint8_t* heap_end;
+// frames are tracked up to 4 GiB (no PAE)
+#define PMM_MAX_FRAMES		(1u << 20)
+#define PMM_L0_WORDS		(PMM_MAX_FRAMES / 32)
+#define PMM_L1_WORDS		(PMM_L0_WORDS / 32)
+#define PMM_L2_WORDS		(PMM_L1_WORDS / 32)
+#define PMM_CACHE_SIZE		64
 
-volatile uint16_t* const MEMMAP_COUNT = (uint16_t*)0x000004F0;
+extern uint8_t __kernel_start[];	// physical, from link.ld
+extern uint8_t __kernel_end[];
 
-void heap_init(void* start, uint32_t size) {
-	heap_ptr = start;
-	heap_end = start + size;
-}	// EXAMPLE CALL: heap_init((void*)0x100000, 0x10000); heap=1MB,size=64KB
 
+e820_entry_t memmap[E820_MAX];
+int memmap_count = 0;
+
+// --- E820 SANITIZING ---
+
+typedef struct {
+	uint64_t addr;
+	uint8_t entry;
+	uint8_t is_end;
+} e820_point_t;
+
+// turn the raw BIOS map into sorted, non-overlapping regions; where
+// regions overlap the most restrictive (highest) type wins
+static void e820_sanitize(const e820_entry_t* raw, int count) {
+	e820_point_t points[E820_MAX * 2];
+	bool active[E820_MAX];
+	uint32_t types[E820_MAX];
+	int n = 0;
+
+	if (count > E820_MAX) count = E820_MAX;
+
+	for (int i = 0; i < count; i++) {
+		active[i] = false;
+		types[i] = raw[i].type;
+		if (types[i] < E820_USABLE || types[i] > E820_BAD)
+			types[i] = E820_RESERVED;	// unknown types are never usable
+		if (raw[i].length == 0) continue;
+
+		points[n].addr = raw[i].base;
+		points[n].entry = i; points[n++].is_end = 0;
+		points[n].addr = raw[i].base + raw[i].length;
+		points[n].entry = i; points[n++].is_end = 1;
+	}
+
+	// insertion sort, at most 64 points
+	for (int i = 1; i < n; i++) {
+		e820_point_t p = points[i];
+		int j = i - 1;
+		while (j >= 0 && points[j].addr > p.addr) {
+			points[j + 1] = points[j];
+			j--;
+		}
+		points[j + 1] = p;
+	}
+
+	// sweep boundaries, emitting a region whenever the covering type changes
+	uint32_t last_type = 0;
+	memmap_count = 0;
+	for (int p = 0; p < n; ) {
+		uint64_t addr = points[p].addr;
+		while (p < n && points[p].addr == addr) {
+			active[points[p].entry] = !points[p].is_end;
+			p++;
+		}
+
+		uint32_t type = 0;
+		for (int i = 0; i < count; i++) {
+			if (active[i] && types[i] > type) type = types[i];
+		}
+		if (type == last_type) continue;
+
+		if (last_type != 0)
+			memmap[memmap_count - 1].length = addr - memmap[memmap_count - 1].base;
+
+		last_type = 0;
+		if (type != 0 && memmap_count < E820_MAX) {
+			memmap[memmap_count].base = addr;
+			memmap[memmap_count].length = 0;
+			memmap[memmap_count].type = type;
+			memmap[memmap_count].acpi = 0;
+			memmap_count++;
+			last_type = type;
+		}
+	}
+}
+
+// --- PHYSICAL FRAME ALLOCATOR ---
+// one bit per frame (1 = free) plus three summary levels, so finding a
+// free frame is four bit scans no matter how much RAM there is:
+//   l1[w >> 5]  bit (w & 31)        : l0[w] has a free frame
+//   l2[w >> 10] bit ((w >> 5) & 31) : l1[w >> 5] is non-zero
+//   l3          bit (w >> 10)       : l2[w >> 10] is non-zero
+
+static uint32_t* pmm_l0;
+static uint32_t pmm_l1[PMM_L1_WORDS];
+static uint32_t pmm_l2[PMM_L2_WORDS];
+static uint32_t pmm_l3;
+static uint32_t pmm_frames;		// frames covered by the bitmap
+
+// recently freed frames, handed out again before touching the bitmap
+static uint32_t pmm_cache[PMM_CACHE_SIZE];
+static int pmm_cache_len = 0;
+
+static meminfo_t pmm_info;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+static void pmm_set_free(uint32_t frame) {
+	uint32_t w = frame >> 5;
+	if (pmm_l0[w] == 0) {
+		if (pmm_l1[w >> 5] == 0) {
+			if (pmm_l2[w >> 10] == 0)
+				pmm_l3 |= 1u << (w >> 10);
+			pmm_l2[w >> 10] |= 1u << ((w >> 5) & 31);
+		}
+		pmm_l1[w >> 5] |= 1u << (w & 31);
+	}
+	pmm_l0[w] |= 1u << (frame & 31);
+}
+
+static void pmm_set_used(uint32_t frame) {
+	uint32_t w = frame >> 5;
+	pmm_l0[w] &= ~(1u << (frame & 31));
+	if (pmm_l0[w]) return;
+	pmm_l1[w >> 5] &= ~(1u << (w & 31));
+	if (pmm_l1[w >> 5]) return;
+	pmm_l2[w >> 10] &= ~(1u << ((w >> 5) & 31));
+	if (pmm_l2[w >> 10]) return;
+	pmm_l3 &= ~(1u << (w >> 10));
+}
+
+static bool pmm_is_free(uint32_t frame) {
+	return (pmm_l0[frame >> 5] >> (frame & 31)) & 1;
+}
+
+// mark every frame overlapping [start, end) as used
+static void pmm_reserve_range(uint64_t start, uint64_t end) {
+	uint64_t first = start >> PAGE_SHIFT;
+	uint64_t last = (end + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (last > pmm_frames) last = pmm_frames;
+
+	for (uint64_t f = first; f < last; f++) {
+		if (pmm_is_free((uint32_t)f)) {
+			pmm_set_used((uint32_t)f);
+			pmm_info.free_frames--;
+			pmm_info.reserved_frames++;
+		}
+	}
+}
+
+// cached frames are still marked used in the bitmap, so a second free of
+// one only shows up here
+static bool pmm_in_cache(uint32_t frame) {
+	for (int i = 0; i < pmm_cache_len; i++) {
+		if (pmm_cache[i] == frame) return true;
+	}
+	return false;
+}
+
+static void pmm_drain_cache(void) {
+	while (pmm_cache_len > 0)
+		pmm_set_free(pmm_cache[--pmm_cache_len]);
+}
+
+static void pmm_init(void) {
+	uint64_t top = 0;
+
+	for (int i = 0; i < memmap_count; i++) {
+		if (memmap[i].type != E820_USABLE) continue;
+		uint64_t end = memmap[i].base + memmap[i].length;
+		if (end > top) top = end;
+	}
+	if (top > (uint64_t)PMM_MAX_FRAMES << PAGE_SHIFT)
+		top = (uint64_t)PMM_MAX_FRAMES << PAGE_SHIFT;
+	pmm_frames = (uint32_t)(top >> PAGE_SHIFT);
+
+	// place the bitmap in the first usable high-memory region big enough
+	uint32_t words = (pmm_frames + 31) / 32;
+	uint32_t bytes = words * sizeof(uint32_t);
+	for (int i = 0; i < memmap_count && !pmm_l0; i++) {
+		if (memmap[i].type != E820_USABLE) continue;
+		uint64_t base = (memmap[i].base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+		uint64_t end = memmap[i].base + memmap[i].length;
+		if (base < HIGH_MEM_START) base = HIGH_MEM_START;
+		if (base + bytes <= end && base + bytes <= top)
+			pmm_l0 = PHYS_TO_VIRT((uint32_t)base);
+	}
+	if (!pmm_l0) {
+		pmm_frames = 0;
+		return;
+	}
+
+	memset(pmm_l0, 0, bytes);
+
+	for (int i = 0; i < memmap_count; i++) {
+		if (memmap[i].type != E820_USABLE) continue;
+		uint64_t first = (memmap[i].base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		uint64_t last = (memmap[i].base + memmap[i].length) >> PAGE_SHIFT;
+		if (last > pmm_frames) last = pmm_frames;
+
+		for (uint64_t f = first; f < last; f++) {
+			pmm_set_free((uint32_t)f);
+			pmm_info.total_frames++;
+			pmm_info.free_frames++;
+		}
+	}
+
+	// carve out everything that is already in use
+	pmm_reserve_range(0, LOW_MEM_RESERVED);
+	pmm_reserve_range((uint32_t)__kernel_start, (uint32_t)__kernel_end);
+	pmm_reserve_range(BOOT_STACK_TOP - BOOT_STACK_SIZE, BOOT_STACK_TOP);
+	pmm_reserve_range(EBDA_START, HIGH_MEM_START);
+	pmm_reserve_range(VIRT_TO_PHYS(pmm_l0), VIRT_TO_PHYS(pmm_l0) + bytes);
+}
+
+// the page fault handler allocates too, so the public entry points hold
+// pmm_lock with interrupts off
+uint32_t pmm_alloc_frame(void) {
+	uint32_t flags = spin_lock_irqsave(&pmm_lock);
+	uint32_t frame;
+	pmm_info.alloc_calls++;
+
+	if (pmm_cache_len > 0) {
+		pmm_info.cache_hits++;
+		pmm_info.free_frames--;
+		frame = pmm_cache[--pmm_cache_len];
+		spin_unlock_irqrestore(&pmm_lock, flags);
+		return frame << PAGE_SHIFT;
+	}
+
+	if (pmm_l3 == 0) {
+		pmm_info.failed_allocs++;
+		spin_unlock_irqrestore(&pmm_lock, flags);
+		return 0;
+	}
+
+	uint32_t i2 = __builtin_ctz(pmm_l3);
+	uint32_t i1 = (i2 << 5) | __builtin_ctz(pmm_l2[i2]);
+	uint32_t w  = (i1 << 5) | __builtin_ctz(pmm_l1[i1]);
+	frame = (w << 5) | __builtin_ctz(pmm_l0[w]);
+
+	pmm_set_used(frame);
+	pmm_info.free_frames--;
+	spin_unlock_irqrestore(&pmm_lock, flags);
+	return frame << PAGE_SHIFT;
+}
+
+void pmm_free_frame(uint32_t addr) {
+	uint32_t frame = addr >> PAGE_SHIFT;
+	if (frame == 0 || frame >= pmm_frames) return;
+
+	uint32_t flags = spin_lock_irqsave(&pmm_lock);
+	if (pmm_is_free(frame) || pmm_in_cache(frame)) {
+		spin_unlock_irqrestore(&pmm_lock, flags);
+		return;
+	}
+	pmm_info.free_calls++;
+	pmm_info.free_frames++;
+
+	if (pmm_cache_len < PMM_CACHE_SIZE)
+		pmm_cache[pmm_cache_len++] = frame;
+	else
+		pmm_set_free(frame);
+	spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// first-fit scan for physically contiguous frames starting on a multiple
+// of align frames, skips full words
+uint32_t pmm_alloc_frames_aligned(uint32_t count, uint32_t align) {
+	if (count == 0 || align == 0) return 0;
+	if (count == 1 && align == 1) return pmm_alloc_frame();
+
+	uint32_t flags = spin_lock_irqsave(&pmm_lock);
+	for (int pass = 0; pass < 2; pass++) {
+		uint32_t run = 0, start = 0;
+
+		for (uint32_t f = 0; f < pmm_frames; ) {
+			if ((f & 31) == 0 && pmm_l0[f >> 5] == 0) {
+				run = 0; f += 32;
+				continue;
+			}
+			if (pmm_is_free(f) && (run > 0 || f % align == 0)) {
+				if (run++ == 0) start = f;
+				if (run == count) {
+					for (uint32_t i = start; i < start + count; i++)
+						pmm_set_used(i);
+					pmm_info.alloc_calls++;
+					pmm_info.free_frames -= count;
+					spin_unlock_irqrestore(&pmm_lock, flags);
+					return start << PAGE_SHIFT;
+				}
+			} else {
+				run = 0;
+			}
+			f++;
+		}
+
+		// cached frames may be splitting a run, give them back and retry
+		if (pmm_cache_len == 0) break;
+		pmm_drain_cache();
+	}
+
+	pmm_info.failed_allocs++;
+	spin_unlock_irqrestore(&pmm_lock, flags);
+	return 0;
+}
+
+uint32_t pmm_alloc_frames(uint32_t count) {
+	return pmm_alloc_frames_aligned(count, 1);
+}
+
+// one frame below 1 MiB, for code that must run in real mode (the AP
+// startup trampoline); straight from the bitmap, cached frames count as used
+uint32_t pmm_alloc_low_frame(void) {
+	uint32_t flags = spin_lock_irqsave(&pmm_lock);
+	for (uint32_t f = 1; f < (HIGH_MEM_START >> PAGE_SHIFT) && f < pmm_frames; f++) {
+		if (!pmm_is_free(f)) continue;
+		pmm_set_used(f);
+		pmm_info.alloc_calls++;
+		pmm_info.free_frames--;
+		spin_unlock_irqrestore(&pmm_lock, flags);
+		return f << PAGE_SHIFT;
+	}
+	pmm_info.failed_allocs++;
+	spin_unlock_irqrestore(&pmm_lock, flags);
+	return 0;
+}
+
+void pmm_free_frames(uint32_t addr, uint32_t count) {
+	uint32_t frame = addr >> PAGE_SHIFT;
+	uint32_t flags = spin_lock_irqsave(&pmm_lock);
+
+	for (uint32_t f = frame; f < frame + count && f < pmm_frames; f++) {
+		if (f == 0 || pmm_is_free(f) || pmm_in_cache(f)) continue;
+		pmm_set_free(f);
+		pmm_info.free_frames++;
+	}
+	pmm_info.free_calls++;
+	spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_get_meminfo(meminfo_t* info) {
+	*info = pmm_info;
+}
+
+// --- KERNEL HEAP ---
+// power-of-two size classes from 8 to 2048 bytes. every slab is a naturally
+// aligned run of frames with a small header at the front; objects carry no
+// header, free objects are chained through their first word. kfree finds
+// the slab from the per-frame owner table, larger requests get whole pages
+
+#define KMEM_MIN_SHIFT		3			// 8 bytes
+#define KMEM_MAX_SHIFT		11			// 2048 bytes
+#define KMEM_CLASSES		(KMEM_MAX_SHIFT - KMEM_MIN_SHIFT + 1)
+
+// per-frame owner tags
+#define KMEM_PAGE_NONE		0x00
+#define KMEM_PAGE_SLAB		0x40		// | size class
+#define KMEM_PAGE_LARGE		0x80		// first frame of a page allocation
+#define KMEM_PAGE_TAIL		0xC0		// following frames
+
+typedef struct slab {
+	struct slab* next;		// partial list
+	struct slab* prev;
+	void* free;				// first free object
+	uint16_t inuse;
+	uint16_t total;
+} slab_t;
+
+// objects start right after the header, so a power-of-two size class
+// >= 16 stays 16-byte aligned only while the header keeps that alignment;
+// fpu.c relies on it for fxsave
+_Static_assert(sizeof(slab_t) % 16 == 0, "slab_t must keep kmalloc objects 16-byte aligned");
+
+typedef struct {
+	uint32_t size;
+	uint32_t frames;		// frames per slab
+	uint32_t objs;			// objects per slab
+	slab_t* partial;		// slabs with at least one free object
+	slab_t* empty;			// one cached empty slab to avoid thrashing
+	uint32_t slabs;
+	uint32_t inuse;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t hits;			// served from an existing slab
+	uint64_t requested;		// bytes asked for, for internal fragmentation
+} kmem_cache_t;
+
+static spinlock_t kmem_lock = SPINLOCK_INIT;	// caches and owner tags
+static kmem_cache_t kmem_caches[KMEM_CLASSES];
+static uint8_t* kmem_pages;		// owner tag per physical frame
+static uint32_t kmem_large_allocs = 0;
+static uint32_t kmem_large_frames = 0;
+
+static void kmem_init(void) {
+	uint32_t table_frames = (pmm_frames + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint32_t table = pmm_alloc_frames(table_frames);
+	if (!table) return;
+
+	kmem_pages = PHYS_TO_VIRT(table);
+	memset(kmem_pages, KMEM_PAGE_NONE, pmm_frames);
+
+	for (int c = 0; c < KMEM_CLASSES; c++) {
+		kmem_cache_t* cache = &kmem_caches[c];
+		cache->size = 1u << (c + KMEM_MIN_SHIFT);
+		// at least ~16 objects per slab so the header costs little
+		cache->frames = (cache->size * 16 + PAGE_SIZE - 1) / PAGE_SIZE;
+		cache->objs = (cache->frames * PAGE_SIZE - sizeof(slab_t)) / cache->size;
+	}
+}
+
+static void slab_unlink(slab_t** list, slab_t* slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else *list = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+static void slab_push(slab_t** list, slab_t* slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) (*list)->prev = slab;
+	*list = slab;
+}
+
+static slab_t* slab_create(int cls) {
+	kmem_cache_t* cache = &kmem_caches[cls];
+	uint32_t phys = pmm_alloc_frames_aligned(cache->frames, cache->frames);
+	if (!phys) return NULL;
+	if (phys + cache->frames * PAGE_SIZE > DIRECT_MAP_SIZE) {
+		pmm_free_frames(phys, cache->frames);	// heap must be direct mapped
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < cache->frames; i++)
+		kmem_pages[(phys >> PAGE_SHIFT) + i] = KMEM_PAGE_SLAB | cls;
+
+	slab_t* slab = PHYS_TO_VIRT(phys);
+	uint8_t* obj = (uint8_t*)(slab + 1);
+	slab->next = slab->prev = NULL;
+	slab->inuse = 0;
+	slab->total = cache->objs;
+	slab->free = obj;
+
+	// thread the free list through the objects
+	for (uint32_t i = 0; i < cache->objs - 1; i++) {
+		*(void**)obj = obj + cache->size;
+		obj += cache->size;
+	}
+	*(void**)obj = NULL;
+
+	cache->slabs++;
+	return slab;
+}
+
+static void slab_destroy(int cls, slab_t* slab) {
+	kmem_cache_t* cache = &kmem_caches[cls];
+	uint32_t phys = VIRT_TO_PHYS(slab);
+
+	for (uint32_t i = 0; i < cache->frames; i++)
+		kmem_pages[(phys >> PAGE_SHIFT) + i] = KMEM_PAGE_NONE;
+	pmm_free_frames(phys, cache->frames);
+	cache->slabs--;
+}
+
+static void* kmalloc_large(uint32_t size) {
+	uint32_t frames = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint32_t phys = pmm_alloc_frames(frames);
+	if (!phys) return NULL;
+	if (phys + frames * PAGE_SIZE > DIRECT_MAP_SIZE) {
+		pmm_free_frames(phys, frames);
+		return NULL;
+	}
+
+	kmem_pages[phys >> PAGE_SHIFT] = KMEM_PAGE_LARGE;
+	for (uint32_t i = 1; i < frames; i++)
+		kmem_pages[(phys >> PAGE_SHIFT) + i] = KMEM_PAGE_TAIL;
+
+	kmem_large_allocs++;
+	kmem_large_frames += frames;
+	return PHYS_TO_VIRT(phys);
+}
+
+static void* kmem_alloc(uint32_t size) {
+	int cls = 0;
+	while ((1u << (cls + KMEM_MIN_SHIFT)) < size) cls++;
+	kmem_cache_t* cache = &kmem_caches[cls];
+
+	slab_t* slab = cache->partial;
+	if (slab) {
+		cache->hits++;
+	} else if (cache->empty) {
+		slab = cache->empty; cache->empty = NULL;
+		slab_push(&cache->partial, slab);
+		cache->hits++;
+	} else {
+		slab = slab_create(cls);
+		if (!slab) return NULL;
+		slab_push(&cache->partial, slab);
+	}
+
+	void* obj = slab->free;
+	slab->free = *(void**)obj;
+	slab->inuse++;
+	if (!slab->free) slab_unlink(&cache->partial, slab);	// now full
+
+	cache->inuse++;
+	cache->allocs++;
+	cache->requested += size;
+	return obj;
+}
+
+static void kmem_free(void* ptr, uint32_t frame) {
+	uint8_t tag = kmem_pages[frame];
+
+	if (tag == KMEM_PAGE_LARGE) {
+		uint32_t frames = 1;
+		while (frame + frames < pmm_frames && kmem_pages[frame + frames] == KMEM_PAGE_TAIL)
+			kmem_pages[frame + frames++] = KMEM_PAGE_NONE;
+		kmem_pages[frame] = KMEM_PAGE_NONE;
+		pmm_free_frames(frame << PAGE_SHIFT, frames);
+		kmem_large_allocs--;
+		kmem_large_frames -= frames;
+		return;
+	}
+	if ((tag & 0xC0) != KMEM_PAGE_SLAB) return;	// not from kmalloc
+
+	int cls = tag & 0x3F;
+	kmem_cache_t* cache = &kmem_caches[cls];
+	slab_t* slab = (slab_t*)((uint32_t)ptr & ~(cache->frames * PAGE_SIZE - 1));
+
+	if (!slab->free) slab_push(&cache->partial, slab);	// was full
+	*(void**)ptr = slab->free;
+	slab->free = ptr;
+	slab->inuse--;
+	cache->inuse--;
+	cache->frees++;
+
+	if (slab->inuse == 0) {
+		slab_unlink(&cache->partial, slab);
+		if (cache->empty) slab_destroy(cls, cache->empty);
+		cache->empty = slab;
+	}
+}
+
+// threads on any CPU allocate, everything below runs under kmem_lock
 void* kmalloc(uint32_t size) {
-	size = (size + ALIGN - 1) & ~(ALIGN - 1); // prevent returning unaligned ptr
-	
-	if (heap_ptr + size > heap_end) return NULL;
-	void* ptr = heap_ptr; 
-	heap_ptr += size; return ptr;
+	if (size == 0 || !kmem_pages) return NULL;
+
+	uint32_t flags = spin_lock_irqsave(&kmem_lock);
+	void* obj = size > (1u << KMEM_MAX_SHIFT) ? kmalloc_large(size) : kmem_alloc(size);
+	spin_unlock_irqrestore(&kmem_lock, flags);
+	return obj;
+}
+
+void kfree(void* ptr) {
+	if (!ptr || !kmem_pages) return;
+
+	if ((uint32_t)ptr < KERNEL_VBASE) return;
+	uint32_t frame = VIRT_TO_PHYS(ptr) >> PAGE_SHIFT;
+	if (frame >= pmm_frames) return;
+
+	uint32_t flags = spin_lock_irqsave(&kmem_lock);
+	kmem_free(ptr, frame);
+	spin_unlock_irqrestore(&kmem_lock, flags);
 }
 
-void* heap_mark(void) {
-	return heap_ptr;	// check where heap is right now
+void memory_init(void) {
+	e820_sanitize(boot_memmap, boot_memmap_count);
+	pmm_init();
+
+	kmem_init();
 }
 
-void heap_reset(void* mark) {
-	heap_ptr = mark;	// rewind heap ptr, reset allocs
+void get_memmap_count(void) {
+	kprint(boot_multiboot ? "Multiboot" : "E820");
+	kprint(" reports "); kprint_hex(boot_memmap_count); kprint(" physical memory regions.");
 }
 
-void* get_memmap_count(void) {
-	uint16_t mm_count = *MEMMAP_COUNT;
-	kprint("E820 reports "); kprint_hex(mm_count); kprint(" physical memory regions.");
+void print_meminfo(void) {
+	meminfo_t info;
+	pmm_get_meminfo(&info);
+
+	kprint("Total:     "); kprint_int(info.total_frames * (PAGE_SIZE / 1024)); kprintln(" KiB");
+	kprint("Free:      "); kprint_int(info.free_frames * (PAGE_SIZE / 1024)); kprintln(" KiB");
+	kprint("Used:      ");
+	kprint_int((info.total_frames - info.free_frames) * (PAGE_SIZE / 1024)); kprintln(" KiB");
+	kprint("Reserved:  "); kprint_int(info.reserved_frames * (PAGE_SIZE / 1024)); kprintln(" KiB");
+	kprint("Allocs:    "); kprint_int(info.alloc_calls);
+	kprint(" (cache hits "); kprint_int(info.cache_hits); kprintln(")");
+	kprint("Frees:     "); kprint_int(info.free_calls); kprint("\n");
+	kprint("Failures:  "); kprint_int(info.failed_allocs); kprint("\n");
+	kprint("\n");
+}
+
+void print_slabinfo(void) {
+	kprintln("size  slabs  inuse/total  allocs  hit%  waste%");
+	for (int c = 0; c < KMEM_CLASSES; c++) {
+		kmem_cache_t* cache = &kmem_caches[c];
+		uint32_t total = cache->slabs * cache->objs;
+		uint32_t hit = cache->allocs ? (cache->hits * 100) / cache->allocs : 0;
+		// internal fragmentation: bytes rounded up to the class size,
+		// scaled down so the percentage needs only a 32-bit divide
+		uint64_t rounded = (uint64_t)cache->allocs * cache->size;
+		uint64_t requested = cache->requested;
+		while (rounded >> 24) { rounded >>= 1; requested >>= 1; }
+		uint32_t waste = rounded ? (uint32_t)((rounded - requested) * 100) / (uint32_t)rounded : 0;
+
+		kprint_int(cache->size); kprint("  ");
+		kprint_int(cache->slabs); kprint("  ");
+		kprint_int(cache->inuse); kprint("/"); kprint_int(total); kprint("  ");
+		kprint_int(cache->allocs); kprint("  ");
+		kprint_int(hit); kprint("  ");
+		kprint_int(waste); kprint("\n");
+	}
+	kprint("large: "); kprint_int(kmem_large_allocs);
+	kprint(" allocations, "); kprint_int(kmem_large_frames); kprintln(" pages");
+
+	// external fragmentation: free slots held by partially used slabs
+	uint32_t held = 0, slack = 0;
+	for (int c = 0; c < KMEM_CLASSES; c++) {
+		kmem_cache_t* cache = &kmem_caches[c];
+		held += cache->slabs * cache->frames * PAGE_SIZE;
+		slack += (cache->slabs * cache->objs - cache->inuse) * cache->size;
+	}
+	kprint("slab memory: "); kprint_int(held / 1024); kprint(" KiB, ");
+	kprint_int(held ? (slack * 100) / held : 0); kprintln("% free slots");
+	kprint("\n");
 }
@@ -0,0 +1,427 @@
+// paging.c - kernel page directory, direct map and vmap area
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "paging.h"
+#include "memory.h"
+#include "cpu.h"
+#include "string.h"
+#include "kernel.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "process.h"
+
+#define PDE_INDEX(va)		((uint32_t)(va) >> 22)
+#define VMAP_PAGES			((VMAP_END - VMAP_START) / PAGE_SIZE)
+#define VMAP_TABLES			((VMAP_END - VMAP_START) / LARGE_PAGE_SIZE)
+
+// page fault error code bits
+#define PF_PRESENT			0x01	// protection violation, not a missing page
+#define PF_WRITE			0x02
+#define PF_USER				0x04
+
+#define VM_UNMAPPING		0x80000000	// vunmap() is waiting for other CPUs' TLBs
+#define VMAREA_SNAPSHOT		64
+
+typedef struct vm_area {
+	struct vm_area* next;	// sorted by start address
+	uint32_t start;
+	uint32_t pages;
+	uint32_t flags;
+	uint32_t faults;		// pages populated on demand
+	const char* name;
+} vm_area_t;
+
+static uint32_t kernel_pd[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t low_pt[1024] __attribute__((aligned(PAGE_SIZE)));
+uint32_t kernel_cr3;
+
+// the vmap page tables are physically contiguous, so all of their entries
+// form one array indexed by (va - VMAP_START) / PAGE_SIZE
+static uint32_t* vmap_pt;
+static vm_area_t* vm_areas;
+static spinlock_t vmap_lock = SPINLOCK_INIT;	// vm_areas and vmap_pt
+
+void paging_init(void) {
+	uint32_t global = (cpu_features & CPU_FEAT_PGE) ? PTE_GLOBAL : 0;
+
+	memset(kernel_pd, 0, sizeof(kernel_pd));
+
+	// low 4 MiB identity mapped with 4 KiB pages so NULL dereferences fault
+	low_pt[0] = 0;
+	for (uint32_t i = 1; i < 1024; i++)
+		low_pt[i] = (i << 12) | PTE_PRESENT | PTE_WRITE;
+	kernel_pd[0] = VIRT_TO_PHYS(low_pt) | PTE_PRESENT | PTE_WRITE;
+
+	// direct map every 4 MiB page that holds RAM
+	uint64_t top = 0;
+	for (int i = 0; i < memmap_count; i++) {
+		uint64_t end = memmap[i].base + memmap[i].length;
+		if (memmap[i].type == E820_USABLE && end > top) top = end;
+	}
+	if (top > DIRECT_MAP_SIZE) top = DIRECT_MAP_SIZE;
+
+	for (uint32_t pa = 0; pa < top; pa += LARGE_PAGE_SIZE)
+		kernel_pd[PDE_INDEX(KERNEL_VBASE + pa)] =
+			pa | PTE_PRESENT | PTE_WRITE | PTE_LARGE | global;
+
+	// page tables for the whole vmap area up front, so the kernel half of
+	// the page directory never changes after boot
+	uint32_t pt = pmm_alloc_frames(VMAP_TABLES);
+	if (pt) {
+		vmap_pt = PHYS_TO_VIRT(pt);
+		memset(vmap_pt, 0, VMAP_PAGES * sizeof(uint32_t));
+		for (uint32_t i = 0; i < VMAP_TABLES; i++)
+			kernel_pd[PDE_INDEX(VMAP_START) + i] = (pt + i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE;
+	}
+
+	write_cr4(read_cr4() | CR4_PSE | (global ? CR4_PGE : 0));
+	kernel_cr3 = VIRT_TO_PHYS(kernel_pd);
+	write_cr3(kernel_cr3);
+
+	// demand-zero vmap pages, live once irq_init() loads the IDT
+	irq_register(14, page_fault_handler, NULL);
+}
+
+// --- VMAP ---
+
+static uint32_t* vmap_pte(uint32_t va) {
+	return &vmap_pt[(va - VMAP_START) / PAGE_SIZE];
+}
+
+// drop the present bit but keep the frame in the PTE, it can only be
+// freed once no CPU holds a stale translation for it
+static void vmap_clear_pages(uint32_t start, uint32_t pages) {
+	for (uint32_t i = 0; i < pages; i++) {
+		uint32_t va = start + i * PAGE_SIZE;
+		uint32_t* pte = vmap_pte(va);
+		if (*pte & PTE_PRESENT) {
+			*pte &= ~PTE_PRESENT;
+			invlpg(va);
+		}
+	}
+}
+
+// free_frames is false for VM_IO areas, their frames are device memory
+static void vmap_release_pages(uint32_t start, uint32_t pages, bool free_frames) {
+	for (uint32_t i = 0; i < pages; i++) {
+		uint32_t* pte = vmap_pte(start + i * PAGE_SIZE);
+		if (free_frames && (*pte & PTE_FRAME)) pmm_free_frame(*pte & PTE_FRAME);
+		*pte = 0;
+	}
+}
+
+// map a zeroed frame at va, writable for zeroing before the real protection
+static bool vmap_populate(uint32_t va, uint32_t pte_flags) {
+	uint32_t frame = pmm_alloc_frame();
+	if (!frame) return false;
+
+	*vmap_pte(va) = frame | PTE_PRESENT | PTE_WRITE;
+	invlpg(va);
+	memset((void*)va, 0, PAGE_SIZE);
+	*vmap_pte(va) = frame | pte_flags;
+	invlpg(va);
+	return true;
+}
+
+// first fit between existing areas, leaving a guard page on both sides;
+// returns the start address and where to link the new area, 0 if full
+static uint32_t vmap_find(uint32_t pages, vm_area_t*** link_out) {
+	uint32_t size = pages * PAGE_SIZE;
+	uint32_t start = VMAP_START + PAGE_SIZE;
+	vm_area_t** link = &vm_areas;
+	while (*link) {
+		if (start + size + PAGE_SIZE <= (*link)->start) break;
+		start = (*link)->start + (*link)->pages * PAGE_SIZE + PAGE_SIZE;
+		link = &(*link)->next;
+	}
+	if (start + size + PAGE_SIZE > VMAP_END) return 0;
+	*link_out = link;
+	return start;
+}
+
+static void vmap_publish(vm_area_t* area, vm_area_t** link, uint32_t start,
+						 uint32_t pages, uint32_t flags, const char* name) {
+	area->start = start;
+	area->pages = pages;
+	area->flags = flags;
+	area->faults = 0;
+	area->name = name;
+	area->next = *link;
+	*link = area;	// publish last, the fault handler walks this list
+}
+
+// reserve pages of virtual space in the vmap area and back them with
+// zeroed frames, now or on first touch with VM_LAZY; an unmapped guard
+// page sits on both sides of every area
+void* vmap(uint32_t pages, uint32_t flags, const char* name) {
+	if (pages == 0 || pages > VMAP_PAGES - 2 || !vmap_pt) return NULL;
+
+	vm_area_t* area = kmalloc(sizeof(vm_area_t));
+	if (!area) return NULL;
+
+	uint32_t irq = spin_lock_irqsave(&vmap_lock);
+	vm_area_t** link;
+	uint32_t start = vmap_find(pages, &link);
+	if (!start) {
+		spin_unlock_irqrestore(&vmap_lock, irq);
+		kfree(area);
+		return NULL;
+	}
+
+	// never published, so no other CPU has seen these pages
+	uint32_t pte_flags = PTE_PRESENT | ((flags & VM_WRITE) ? PTE_WRITE : 0);
+	for (uint32_t i = 0; i < pages && !(flags & VM_LAZY); i++) {
+		if (!vmap_populate(start + i * PAGE_SIZE, pte_flags)) {
+			vmap_clear_pages(start, i);
+			vmap_release_pages(start, i, true);
+			spin_unlock_irqrestore(&vmap_lock, irq);
+			kfree(area);
+			return NULL;
+		}
+	}
+
+	vmap_publish(area, link, start, pages, flags, name);
+	spin_unlock_irqrestore(&vmap_lock, irq);
+	return (void*)start;
+}
+
+// map device memory (MMIO, firmware tables) uncached into the vmap area;
+// phys need not be page aligned, the offset is kept in the returned pointer
+void* ioremap(uint32_t phys, uint32_t size, const char* name) {
+	uint32_t offset = phys & (PAGE_SIZE - 1);
+	uint32_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (pages == 0 || pages > VMAP_PAGES - 2 || !vmap_pt) return NULL;
+
+	vm_area_t* area = kmalloc(sizeof(vm_area_t));
+	if (!area) return NULL;
+
+	uint32_t flags = spin_lock_irqsave(&vmap_lock);
+	vm_area_t** link;
+	uint32_t start = vmap_find(pages, &link);
+	if (!start) {
+		spin_unlock_irqrestore(&vmap_lock, flags);
+		kfree(area);
+		return NULL;
+	}
+
+	uint32_t base = phys - offset;
+	for (uint32_t i = 0; i < pages; i++) {
+		*vmap_pte(start + i * PAGE_SIZE) =
+			(base + i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE | PTE_PCD | PTE_PWT;
+		invlpg(start + i * PAGE_SIZE);
+	}
+
+	vmap_publish(area, link, start, pages, VM_WRITE | VM_IO, name);
+	spin_unlock_irqrestore(&vmap_lock, flags);
+	return (void*)(start + offset);
+}
+
+// also takes ioremap() pointers, which may carry a page offset; the area
+// stays linked until every CPU has flushed it, so neither its frames nor
+// its addresses are reused under a stale TLB entry. Interrupts must be
+// enabled, tlb_shootdown() waits for the other CPUs.
+void vunmap(void* addr) {
+	uint32_t start = (uint32_t)addr & PTE_FRAME;
+	uint32_t flags = spin_lock_irqsave(&vmap_lock);
+	vm_area_t* area = vm_areas;
+	while (area && area->start != start)
+		area = area->next;
+	if (!area || (area->flags & VM_UNMAPPING)) {
+		spin_unlock_irqrestore(&vmap_lock, flags);
+		return;
+	}
+	area->flags |= VM_UNMAPPING;
+	vmap_clear_pages(area->start, area->pages);
+	spin_unlock_irqrestore(&vmap_lock, flags);
+
+	tlb_shootdown();
+
+	flags = spin_lock_irqsave(&vmap_lock);
+	vm_area_t** link = &vm_areas;
+	while (*link != area)
+		link = &(*link)->next;
+	*link = area->next;
+	vmap_release_pages(area->start, area->pages, !(area->flags & VM_IO));
+	spin_unlock_irqrestore(&vmap_lock, flags);
+	kfree(area);
+}
+
+// --- PAGE DIRECTORIES ---
+// a process's directory shares the kernel half and the low identity map
+// (the console writes VGA memory through it) with kernel_pd, which never
+// change after boot; everything in between is its own. Its page tables
+// and frames are reached through the direct map, so they can be filled
+// in before any CPU loads the directory
+
+#define USER_PDE_FIRST		1
+#define USER_PDE_END		PDE_INDEX(KERNEL_VBASE)
+
+// a zeroed frame inside the direct map
+static uint32_t pgdir_frame(void) {
+	uint32_t frame = pmm_alloc_frame();
+	if (!frame) return 0;
+	if (frame >= DIRECT_MAP_SIZE) {
+		pmm_free_frame(frame);
+		return 0;
+	}
+	memset(PHYS_TO_VIRT(frame), 0, PAGE_SIZE);
+	return frame;
+}
+
+uint32_t pgdir_create(void) {
+	uint32_t pd = pgdir_frame();
+	if (!pd) return 0;
+	uint32_t* dir = PHYS_TO_VIRT(pd);
+	dir[0] = kernel_pd[0];
+	memcpy(&dir[USER_PDE_END], &kernel_pd[USER_PDE_END], (1024 - USER_PDE_END) * sizeof(uint32_t));
+	return pd;
+}
+
+static uint32_t* pgdir_pte(uint32_t pd, uint32_t va, bool create) {
+	uint32_t* pde = &((uint32_t*)PHYS_TO_VIRT(pd))[PDE_INDEX(va)];
+	if (!(*pde & PTE_PRESENT)) {
+		if (!create) return NULL;
+		uint32_t pt = pgdir_frame();
+		if (!pt) return NULL;
+		*pde = pt | PTE_PRESENT | PTE_WRITE | PTE_USER;
+	}
+	return &((uint32_t*)PHYS_TO_VIRT(*pde & PTE_FRAME))[(va >> PAGE_SHIFT) & 1023];
+}
+
+// back the user page at va with a zeroed frame, or widen the protection
+// of the one already there to include flags; returns the frame, 0 when
+// out of memory
+uint32_t pgdir_alloc(uint32_t pd, uint32_t va, uint32_t flags) {
+	if (va < LARGE_PAGE_SIZE || va >= KERNEL_VBASE) return 0;
+	uint32_t* pte = pgdir_pte(pd, va, true);
+	if (!pte) return 0;
+	if (!(*pte & PTE_PRESENT)) {
+		uint32_t frame = pgdir_frame();
+		if (!frame) return 0;
+		*pte = frame | PTE_PRESENT | PTE_USER;
+	}
+	*pte |= flags;
+	return *pte & PTE_FRAME;
+}
+
+// map a frame the directory does not own, pgdir_destroy() leaves it alone
+bool pgdir_map(uint32_t pd, uint32_t va, uint32_t frame, uint32_t flags) {
+	if (va < LARGE_PAGE_SIZE || va >= KERNEL_VBASE) return false;
+	uint32_t* pte = pgdir_pte(pd, va, true);
+	if (!pte) return false;
+	*pte = frame | flags | PTE_PRESENT | PTE_USER | PTE_SHARED;
+	return true;
+}
+
+// the PTE for va, 0 if there is none
+uint32_t pgdir_lookup(uint32_t pd, uint32_t va) {
+	if (va < LARGE_PAGE_SIZE || va >= KERNEL_VBASE) return 0;
+	uint32_t* pte = pgdir_pte(pd, va, false);
+	return pte ? *pte : 0;
+}
+
+// free the user half and the directory; no CPU may have it loaded, and
+// none holds TLB entries for it since user mappings are never global
+void pgdir_destroy(uint32_t pd) {
+	uint32_t* dir = PHYS_TO_VIRT(pd);
+	for (uint32_t i = USER_PDE_FIRST; i < USER_PDE_END; i++) {
+		if (!(dir[i] & PTE_PRESENT)) continue;
+		uint32_t* table = PHYS_TO_VIRT(dir[i] & PTE_FRAME);
+		for (uint32_t j = 0; j < 1024; j++) {
+			if ((table[j] & PTE_PRESENT) && !(table[j] & PTE_SHARED))
+				pmm_free_frame(table[j] & PTE_FRAME);
+		}
+		pmm_free_frame(dir[i] & PTE_FRAME);
+	}
+	pmm_free_frame(pd);
+}
+
+// --- DEMAND ZERO ---
+
+static vm_area_t* vm_area_find(uint32_t va) {
+	for (vm_area_t* area = vm_areas; area && area->start <= va; area = area->next) {
+		if (va < area->start + area->pages * PAGE_SIZE) return area;
+	}
+	return NULL;
+}
+
+// vector 14, registered in paging_init(); faulting address in CR2
+void page_fault_handler(irq_frame_t* frame, void* ctx) {
+	uint32_t err = frame->err;
+	uint32_t addr = read_cr2();
+	(void)ctx;
+
+	if (!(err & PF_PRESENT) && addr >= VMAP_START && addr < VMAP_END) {
+		bool handled = false;
+		spin_lock(&vmap_lock);		// interrupt gate, already off
+		vm_area_t* area = vm_area_find(addr);
+		if (area && (area->flags & (VM_LAZY | VM_UNMAPPING)) == VM_LAZY &&
+			(!(err & PF_WRITE) || (area->flags & VM_WRITE))) {
+			uint32_t pte_flags = PTE_PRESENT | ((area->flags & VM_WRITE) ? PTE_WRITE : 0);
+			if (*vmap_pte(addr) & PTE_PRESENT) {
+				handled = true;		// another CPU got there first
+			} else if (vmap_populate(addr & PTE_FRAME, pte_flags)) {
+				area->faults++;
+				handled = true;
+			}
+		}
+		spin_unlock(&vmap_lock);
+		if (handled) return;
+	}
+
+	// user space is populated up front, any fault there is the process's
+	if (err & PF_USER) {
+		process_fault(frame, "page fault");
+		return;
+	}
+
+	kprint("\nPage fault at "); kprint_hex(addr);
+	kprint(" error "); kprint_hex(err);
+	kprint((err & PF_PRESENT) ? " (protection" : " (not present");
+	kprint((err & PF_WRITE) ? ", write)" : ", read)");
+	kprint(" EIP "); kprint_hex(frame->eip);
+	kpanic("unhandled page fault");
+}
+
+// copied out under the lock and printed after, the console may fault
+// in its lazily backed scrollback
+void print_vmareas(void) {
+	struct {
+		uint32_t start, pages, present, faults;
+		const char* name;
+	} rows[VMAREA_SNAPSHOT];
+	uint32_t count = 0, more = 0, reserved = 0, resident = 0;
+
+	uint32_t flags = spin_lock_irqsave(&vmap_lock);
+	for (vm_area_t* area = vm_areas; area; area = area->next) {
+		uint32_t present = (area->flags & VM_LAZY) ? area->faults : area->pages;
+		reserved += area->pages;
+		resident += present;
+		if (count == VMAREA_SNAPSHOT) {
+			more++;
+			continue;
+		}
+		rows[count].start = area->start;
+		rows[count].pages = area->pages;
+		rows[count].present = present;
+		rows[count].faults = area->faults;
+		rows[count++].name = area->name;
+	}
+	spin_unlock_irqrestore(&vmap_lock, flags);
+
+	kprintln("start       pages  resident  faults  name");
+	for (uint32_t i = 0; i < count; i++) {
+		kprint_hex(rows[i].start); kprint("  ");
+		kprint_int(rows[i].pages); kprint("  ");
+		kprint_int(rows[i].present); kprint("  ");
+		kprint_int(rows[i].faults); kprint("  ");
+		kprintln(rows[i].name ? rows[i].name : "-");
+	}
+	if (more) { kprint("... "); kprint_int(more); kprintln(" more"); }
+	kprint("reserved "); kprint_int(reserved * (PAGE_SIZE / 1024));
+	kprint(" KiB, resident "); kprint_int(resident * (PAGE_SIZE / 1024));
+	kprint(" KiB, saved "); kprint_int((reserved - resident) * (PAGE_SIZE / 1024));
+	kprintln(" KiB");
+	kprint("\n");
+}
@@ -0,0 +1,153 @@
+// perf.c - sampling profiler
+// - while running, every timer tick on every CPU adds one to the bucket
+//   of the EIP it interrupted; buckets cover the kernel's .text in
+//   16-byte steps, ring 3 and anything outside .text only count in total
+// - the report folds buckets into functions with the table the build
+//   generates from kEntry.elf, and names each function's hottest bucket
+// - a tickless idle CPU takes no ticks, so idle time is undercounted;
+//   'idle off' before 'perf start' gives every CPU a steady rate
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "perf.h"
+#include "ksyms.h"
+#include "kernel.h"
+#include "memory.h"
+#include "paging.h"
+#include "string.h"
+#include "clock.h"
+#include "div64.h"
+#include "smp.h"
+
+volatile bool perf_running = false;
+
+static uint32_t* buckets = NULL;	// vmap'd on the first start, never freed
+static uint32_t nbuckets = 0;
+
+static struct {
+	uint32_t samples;
+	uint32_t user;				// ring 3
+	uint32_t other;				// kernel, outside .text
+	uint64_t start_us;
+	uint64_t stop_us;
+} perf_stats;
+
+// interrupt context, any CPU; the buckets are backed up front, a lazy
+// page would fault in here
+void perf_record(irq_frame_t* frame) {
+	__atomic_fetch_add(&perf_stats.samples, 1, __ATOMIC_RELAXED);
+	if (frame->cs & 3) {
+		__atomic_fetch_add(&perf_stats.user, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	uint32_t b = (frame->eip - (uint32_t)__text_start) >> PERF_SHIFT;
+	if (b < nbuckets) __atomic_fetch_add(&buckets[b], 1, __ATOMIC_RELAXED);
+	else __atomic_fetch_add(&perf_stats.other, 1, __ATOMIC_RELAXED);
+}
+
+void perf_start(void) {
+	if (perf_running) {
+		kprintln("perf is already running");
+		return;
+	}
+	if (!buckets) {
+		uint32_t n = (((uint32_t)__text_end - (uint32_t)__text_start) >> PERF_SHIFT) + 1;
+		buckets = vmap((n * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE, VM_WRITE, "perf");
+		if (!buckets) {
+			kprintln("Out of memory");
+			return;
+		}
+		nbuckets = n;
+	}
+	memset(buckets, 0, nbuckets * sizeof(uint32_t));
+	memset(&perf_stats, 0, sizeof(perf_stats));
+	perf_stats.start_us = ktime_us();
+	__atomic_store_n(&perf_running, true, __ATOMIC_RELEASE);
+	kprintf("Sampling %u KiB of kernel code in %u-byte buckets\n",
+			(unsigned)((uint32_t)__text_end - (uint32_t)__text_start) >> 10, 1u << PERF_SHIFT);
+}
+
+void perf_stop(void) {
+	if (!perf_running) {
+		kprintln("perf is not running");
+		return;
+	}
+	__atomic_store_n(&perf_running, false, __ATOMIC_RELEASE);
+	perf_stats.stop_us = ktime_us();
+	kprintf("Stopped after %u samples\n", (unsigned)perf_stats.samples);
+}
+
+// --- REPORT ---
+
+// samples as a percentage of total, one decimal
+static void print_share(uint32_t n, uint32_t total) {
+	uint32_t per1000 = total ? (uint32_t)udiv64_32((uint64_t)n * 1000, total, NULL) : 0;
+	kprintf("%3u.%u%%", (unsigned)(per1000 / 10), (unsigned)(per1000 % 10));
+}
+
+// hottest bucket of function i, as an offset into it
+static uint32_t hot_offset(int i) {
+	uint32_t text = (uint32_t)__text_start;
+	uint32_t start = ksyms[i].addr > text ? ksyms[i].addr : text;
+	uint32_t end = (uint32_t)i + 1 < ksyms_count ? ksyms[i + 1].addr : (uint32_t)__text_end;
+	uint32_t best = 0, best_count = 0;
+	for (uint32_t b = (start - text) >> PERF_SHIFT; b <= (end - 1 - text) >> PERF_SHIFT && b < nbuckets; b++) {
+		if (buckets[b] > best_count) {
+			best_count = buckets[b];
+			best = (b << PERF_SHIFT) + text;
+		}
+	}
+	return best > start ? best - start : 0;
+}
+
+// while running this is a snapshot, sampling goes on
+void perf_report(void) {
+	if (!buckets || !perf_stats.samples) {
+		kprintln("No samples, 'perf start' first");
+		return;
+	}
+	if (!ksyms_count) {
+		kprintln("This kernel was linked without a symbol table");
+		return;
+	}
+	uint32_t* counts = kmalloc(ksyms_count * sizeof(uint32_t));
+	if (!counts) {
+		kprintln("Out of memory");
+		return;
+	}
+	memset(counts, 0, ksyms_count * sizeof(uint32_t));
+
+	// fold buckets into functions; a bucket shared by two short functions
+	// goes to the one it starts in
+	uint32_t unnamed = perf_stats.other;
+	for (uint32_t b = 0; b < nbuckets; b++) {
+		if (!buckets[b]) continue;
+		int i = ksym_index((uint32_t)__text_start + (b << PERF_SHIFT));
+		if (i >= 0) counts[i] += buckets[b];
+		else unnamed += buckets[b];
+	}
+
+	uint64_t end = perf_running ? ktime_us() : perf_stats.stop_us;
+	uint32_t ms = (uint32_t)udiv64_32(end - perf_stats.start_us, 1000, NULL);
+	uint32_t total = perf_stats.samples;
+	kprintf("%-19s%u over %u.%03u s on %u CPU(s)%s\n", "Samples:", (unsigned)total,
+			(unsigned)(ms / 1000), (unsigned)(ms % 1000), (unsigned)cpus_online, perf_running ? ", still running" : "");
+	kprintf("%-19s%u ring 3, %u outside named code\n\n", "Not in a function:",
+			(unsigned)perf_stats.user, (unsigned)unnamed);
+	kprintln("samples  share  function+hottest");
+
+	for (int row = 0; row < PERF_TOP; row++) {
+		int top = -1;
+		for (uint32_t i = 0; i < ksyms_count; i++) {
+			if (counts[i] && (top < 0 || counts[i] > counts[top])) top = (int)i;
+		}
+		if (top < 0) break;
+		kprintf("%7u  ", (unsigned)counts[top]);
+		print_share(counts[top], total);
+		kprintf("  %s+0x%x\n", ksyms[top].name, (unsigned)hot_offset(top));
+		counts[top] = 0;
+	}
+	kprint("\n");
+	kfree(counts);
+}
@@ -0,0 +1,316 @@
+// process.c - user processes loaded from ELF images
+// - the images are linked into the kernel (user/programs.asm); spawning
+//   one builds a page directory with its PT_LOAD segments, a stack with
+//   argc/argv and the vsyscall page, then starts a kernel thread that
+//   drops to ring 3 at the ELF entry point
+// - a process is a single thread; schedule() calls process_switch() to
+//   load its page directory and point the TSS at its kernel stack
+// - faults in ring 3 kill the process instead of the kernel: the handler
+//   marks it and it exits on its way back out of the interrupt
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "process.h"
+#include "paging.h"
+#include "memory.h"
+#include "kernel.h"
+#include "string.h"
+#include "cpu.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define ELF_MAGIC			0x464C457F	// "\x7FELF"
+#define ELFCLASS32			1
+#define ET_EXEC				2
+#define EM_386				3
+#define PT_LOAD				1
+#define PF_W				2
+
+// segments stay below the stack and its guard page
+#define USER_IMAGE_END		(USER_STACK_TOP - (USER_STACK_PAGES + 1) * PAGE_SIZE)
+
+typedef struct {
+	uint32_t magic;
+	uint8_t cls, data, version, pad[9];
+	uint16_t type, machine;
+	uint32_t version2, entry, phoff, shoff, flags;
+	uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+} elf32_ehdr_t;
+
+typedef struct {
+	uint32_t type, offset, vaddr, paddr, filesz, memsz, flags, align;
+} elf32_phdr_t;
+
+// user/programs.asm, ends with a NULL name
+typedef struct {
+	const char* name;
+	const uint8_t* start;
+	const uint8_t* end;
+} user_program_t;
+
+extern const user_program_t user_programs[];
+extern void enter_user(uint32_t eip, uint32_t esp) __attribute__((noreturn));	// sysentry.asm
+
+static spinlock_t proc_lock = SPINLOCK_INIT;	// procs and proc_stats
+static process_t* procs = NULL;
+static uint32_t next_pid = 1;
+static wait_queue_t exit_wq;
+
+static struct {
+	uint32_t spawned;
+	uint32_t exited;
+	uint32_t killed;
+	uint32_t sysenter_calls;	// of exited processes
+	uint32_t int80_calls;
+} proc_stats;
+
+static const user_program_t* program_find(const char* name) {
+	for (const user_program_t* prog = user_programs; prog->name; prog++) {
+		if (strcmp(prog->name, name) == 0) return prog;
+	}
+	return NULL;
+}
+
+bool process_exists(const char* name) {
+	return program_find(name) != NULL;
+}
+
+// --- LOADING ---
+
+static bool load_segment(uint32_t pd, const uint8_t* image, uint32_t size, const elf32_phdr_t* ph) {
+	if (ph->memsz == 0) return true;
+	uint32_t start = ph->vaddr;
+	uint32_t end = start + ph->memsz;
+	uint32_t file_end = start + ph->filesz;
+	if (ph->filesz > ph->memsz || ph->offset > size || ph->filesz > size - ph->offset)
+		return false;
+	if (start < USER_BASE || end < start || end > USER_IMAGE_END) return false;
+
+	// a page two segments share gets the union of their protections
+	uint32_t flags = (ph->flags & PF_W) ? PTE_WRITE : 0;
+	for (uint32_t va = start & PTE_FRAME; va < end; va += PAGE_SIZE) {
+		uint32_t frame = pgdir_alloc(pd, va, flags);
+		if (!frame) return false;
+		uint32_t lo = va > start ? va : start;
+		uint32_t hi = va + PAGE_SIZE < file_end ? va + PAGE_SIZE : file_end;
+		if (lo < hi)
+			memcpy((uint8_t*)PHYS_TO_VIRT(frame) + (lo - va), image + ph->offset + (lo - start), hi - lo);
+	}
+	return true;
+}
+
+static bool load_elf(process_t* p, const user_program_t* prog) {
+	uint32_t size = prog->end - prog->start;
+	const elf32_ehdr_t* eh = (const elf32_ehdr_t*)prog->start;
+	if (size < sizeof(elf32_ehdr_t) || eh->magic != ELF_MAGIC || eh->cls != ELFCLASS32 ||
+		eh->type != ET_EXEC || eh->machine != EM_386 || eh->phentsize != sizeof(elf32_phdr_t))
+		return false;
+	if (eh->phoff > size || (uint32_t)eh->phnum * sizeof(elf32_phdr_t) > size - eh->phoff)
+		return false;
+
+	const elf32_phdr_t* ph = (const elf32_phdr_t*)(prog->start + eh->phoff);
+	for (uint32_t i = 0; i < eh->phnum; i++) {
+		if (ph[i].type == PT_LOAD && !load_segment(p->cr3, prog->start, size, &ph[i]))
+			return false;
+	}
+	p->entry = eh->entry;
+	return true;
+}
+
+// stack pages, and on the top one the argument strings, then argv[] and
+// argc; crt0's _start calls main with them in place, so argc sits at a
+// 16-byte boundary as the ABI wants at a call
+static bool setup_stack(process_t* p, int argc, char** argv) {
+	for (uint32_t i = 1; i <= USER_STACK_PAGES; i++) {
+		if (!pgdir_alloc(p->cr3, USER_STACK_TOP - i * PAGE_SIZE, PTE_WRITE)) return false;
+	}
+	uint32_t page = USER_STACK_TOP - PAGE_SIZE;
+	uint8_t* kpage = PHYS_TO_VIRT(pgdir_lookup(p->cr3, page) & PTE_FRAME);
+
+	if (argc > PROC_ARGS_MAX) argc = PROC_ARGS_MAX;
+	uint32_t uargv[PROC_ARGS_MAX + 1];
+	uint32_t sp = USER_STACK_TOP;
+	for (int i = argc - 1; i >= 0; i--) {
+		size_t len = strlen(argv[i]) + 1;
+		if (len + (PROC_ARGS_MAX + 6) * sizeof(uint32_t) > sp - page)
+			return false;		// no room left for argv[] and argc
+		sp -= len;
+		memcpy(kpage + (sp - page), argv[i], len);
+		uargv[i] = sp;
+	}
+	uargv[argc] = 0;
+
+	uint32_t words = 2 + argc + 1;
+	sp = (sp - words * sizeof(uint32_t)) & ~15u;
+	uint32_t* top = (uint32_t*)(kpage + (sp - page));
+	top[0] = argc;
+	top[1] = sp + 2 * sizeof(uint32_t);
+	memcpy(&top[2], uargv, (argc + 1) * sizeof(uint32_t));
+	p->user_esp = sp;
+	return true;
+}
+
+// --- LIFECYCLE ---
+
+// first code of the process thread
+static void process_start(void* arg) {
+	process_t* p = arg;
+	uint32_t flags = irq_save();
+	current_thread->proc = p;
+	process_switch(this_cpu(), current_thread);
+	irq_restore(flags);
+	enter_user(p->entry, p->user_esp);
+}
+
+// load the program and start it; NULL if there is no such program or no
+// memory for it
+process_t* process_spawn(const char* name, int argc, char** argv) {
+	const user_program_t* prog = program_find(name);
+	if (!prog) return NULL;
+
+	process_t* p = kmalloc(sizeof(process_t));
+	if (!p) return NULL;
+	memset(p, 0, sizeof(process_t));
+	size_t len = strlen(name);
+	if (len >= THREAD_NAME_MAX) len = THREAD_NAME_MAX - 1;
+	memcpy(p->name, name, len);
+
+	p->cr3 = pgdir_create();
+	if (!p->cr3) {
+		kfree(p);
+		return NULL;
+	}
+	if (!load_elf(p, prog) || !setup_stack(p, argc, argv) ||
+		!pgdir_map(p->cr3, USER_VSYSCALL, vsyscall_frame, 0)) {
+		pgdir_destroy(p->cr3);
+		kfree(p);
+		return NULL;
+	}
+
+	uint32_t flags = spin_lock_irqsave(&proc_lock);
+	p->pid = next_pid++;
+	p->next = procs;
+	procs = p;
+	proc_stats.spawned++;
+	spin_unlock_irqrestore(&proc_lock, flags);
+
+	if (!thread_create(p->name, process_start, p, PRIO_DEFAULT)) {
+		p->exited = true;			// never ran, process_wait() cleans up
+		p->exit_code = PROC_KILLED;
+		pgdir_destroy(p->cr3);
+	}
+	return p;
+}
+
+// block until p exits, free it and return its exit code
+int process_wait(process_t* p) {
+	uint32_t flags = wq_lock();
+	while (!p->exited) wq_wait(&exit_wq, 0);
+	wq_unlock(flags);
+
+	flags = spin_lock_irqsave(&proc_lock);
+	for (process_t** link = &procs; *link; link = &(*link)->next) {
+		if (*link == p) {
+			*link = p->next;
+			break;
+		}
+	}
+	proc_stats.exited++;
+	if (p->killed) proc_stats.killed++;
+	proc_stats.sysenter_calls += p->sysenter_calls;
+	proc_stats.int80_calls += p->int80_calls;
+	spin_unlock_irqrestore(&proc_lock, flags);
+
+	int code = p->exit_code;
+	kfree(p);
+	return code;
+}
+
+// the thread carries on as a kernel thread just long enough to drop the
+// address space and report the exit
+void process_exit(int code) {
+	thread_t* t = current_thread;
+	process_t* p = t->proc;
+
+	uint32_t flags = irq_save();
+	t->proc = NULL;
+	process_switch(this_cpu(), t);	// back on kernel_cr3
+	irq_restore(flags);
+	pgdir_destroy(p->cr3);
+
+	// the waiter may free p as soon as it sees exited
+	flags = wq_lock();
+	p->exit_code = code;
+	p->exited = true;
+	wq_unlock(flags);
+	wake_up(&exit_wq);
+	thread_exit();
+}
+
+// an exception in ring 3, from its handler
+void process_fault(irq_frame_t* frame, const char* what) {
+	process_t* p = current_thread->proc;
+	kprint("\n"); kprint(p->name); kprint(": "); kprint(what);
+	kprint(" at EIP "); kprint_hex(frame->eip); kprintln(", killed");
+	p->killed = true;
+}
+
+// last thing before an interrupt returns to ring 3
+void process_check_killed(void) {
+	process_t* p = current_thread->proc;
+	if (p && p->killed) process_exit(PROC_KILLED);
+}
+
+// from schedule(), interrupts off: next's page directory, and for a
+// process the kernel stack ring 3 enters on; kernel threads run on
+// kernel_cr3 so a dead process's directory is never left loaded
+void process_switch(cpu_t* cpu, thread_t* next) {
+	uint32_t cr3 = kernel_cr3;
+	if (next->proc) {
+		cr3 = next->proc->cr3;
+		cpu->tss.esp0 = (uint32_t)next->stack + THREAD_STACK_PAGES * PAGE_SIZE;
+	}
+	if (cpu->cr3 != cr3) {
+		write_cr3(cr3);
+		cpu->cr3 = cr3;
+	}
+}
+
+// [addr, addr + len) is mapped for ring 3, writable if write; the kernel
+// then reads or writes it directly, nothing else can unmap it meanwhile
+bool process_access_ok(process_t* p, uint32_t addr, uint32_t len, bool write) {
+	if (len == 0) return true;
+	if (addr + len < addr || addr + len > KERNEL_VBASE) return false;
+	for (uint32_t va = addr & PTE_FRAME; va < addr + len; va += PAGE_SIZE) {
+		uint32_t pte = pgdir_lookup(p->cr3, va);
+		if (!(pte & PTE_PRESENT) || !(pte & PTE_USER)) return false;
+		if (write && !(pte & PTE_WRITE)) return false;
+	}
+	return true;
+}
+
+void print_processes(void) {
+	kprint("Programs:         ");
+	for (const user_program_t* prog = user_programs; prog->name; prog++) {
+		kprint(" "); kprint(prog->name);
+	}
+	kprint("\n");
+	kprint("Syscall entry:     "); kprintln(syscall_fast() ? "sysenter" : "int 0x80");
+
+	kprintln("pid  sysenter  int 0x80  name");
+	uint32_t flags = spin_lock_irqsave(&proc_lock);
+	for (process_t* p = procs; p; p = p->next) {
+		kprint_int(p->pid); kprint("  ");
+		kprint_int(p->sysenter_calls); kprint("  ");
+		kprint_int(p->int80_calls); kprint("  ");
+		kprintln(p->name);
+	}
+	spin_unlock_irqrestore(&proc_lock, flags);
+
+	kprint("Spawned / exited:  "); kprint_int(proc_stats.spawned);
+	kprint(" / "); kprint_int(proc_stats.exited); kprint("\n");
+	kprint("Killed:            "); kprint_int(proc_stats.killed); kprint("\n");
+	kprint("Syscalls:          "); kprint_int(proc_stats.sysenter_calls);
+	kprint(" sysenter, "); kprint_int(proc_stats.int80_calls); kprintln(" int 0x80");
+	kprint("\n");
+}
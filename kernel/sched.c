@@ -0,0 +1,530 @@
+// sched.c - preemptive kernel threads
+// - every CPU has its own run queue: one FIFO per priority plus a bitmap
+//   of non-empty ones, so picking the next thread is a bit scan no matter
+//   how many are runnable
+// - a CPU with nothing of its own takes the best unbound thread from the
+//   busiest other queue (work stealing); woken threads go back to the CPU
+//   they last ran on, which keeps them near their cache and spreads load
+//   without a central queue
+// - the timer tick charges the running thread; when its slice is used up
+//   and an equal or higher priority thread is ready, the switch happens
+//   on the way out of the interrupt (sched_preempt from isr_dispatch)
+// - a wakeup of a higher priority thread preempts at once, on another
+//   CPU through a resched IPI
+// - sched_lock covers thread states, wait queues, sleepers and the thread
+//   lists; each run queue has its own lock, always taken after sched_lock
+// - every CPU's startup flow becomes its idle thread: it is never
+//   preempted, it reaps dead threads and calls schedule() itself after
+//   cpu_idle()
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sched.h"
+#include "smp.h"
+#include "irq.h"
+#include "kernel.h"
+#include "memory.h"
+#include "paging.h"
+#include "string.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "fpu.h"
+#include "process.h"
+
+extern void switch_to(uint32_t* save_esp, uint32_t new_esp);	// isr.asm
+
+static spinlock_t sched_lock = SPINLOCK_INIT;
+static thread_t* sleepers = NULL;
+static thread_t* zombies = NULL;
+static thread_t* all_threads = NULL;
+static uint32_t next_id = 0;
+
+static struct {
+	uint32_t wakeups;
+	uint32_t created;
+	uint32_t reaped;
+} sched_stats;
+
+static const char* state_names[] = { "ready", "running", "blocked", "dead" };
+
+// --- RUN QUEUES (interrupts off, rq->lock held) ---
+
+static void rq_push(run_queue_t* rq, thread_t* t) {
+	uint8_t p = t->prio;
+	t->state = THREAD_READY;
+	t->next = NULL;
+	if (rq->prio[p].tail) rq->prio[p].tail->next = t;
+	else rq->prio[p].head = t;
+	rq->prio[p].tail = t;
+	rq->ready_map |= 1u << p;
+	rq->nr_ready++;
+	if (t->bound >= 0) rq->nr_bound++;
+}
+
+static void rq_remove(run_queue_t* rq, thread_t* t, thread_t* prev) {
+	uint8_t p = t->prio;
+	if (prev) prev->next = t->next;
+	else rq->prio[p].head = t->next;
+	if (rq->prio[p].tail == t) rq->prio[p].tail = prev;
+	if (!rq->prio[p].head) rq->ready_map &= ~(1u << p);
+	rq->nr_ready--;
+	if (t->bound >= 0) rq->nr_bound--;
+}
+
+static thread_t* rq_pop(run_queue_t* rq) {
+	if (!rq->ready_map) return NULL;
+	thread_t* t = rq->prio[__builtin_ctz(rq->ready_map)].head;
+	rq_remove(rq, t, NULL);
+	return t;
+}
+
+// highest priority thread self may take: not bound elsewhere and not
+// still on its old CPU's stack (waiting for that could deadlock two
+// CPUs stealing from each other)
+static thread_t* rq_take(run_queue_t* rq, cpu_t* self) {
+	for (uint32_t map = rq->ready_map; map; map &= map - 1) {
+		thread_t* prev = NULL;
+		for (thread_t* t = rq->prio[__builtin_ctz(map)].head; t; prev = t, t = t->next) {
+			if (t->bound >= 0 && (uint32_t)t->bound != self->index) continue;
+			if (t->on_cpu) continue;
+			rq_remove(rq, t, prev);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static inline bool rq_stealable(run_queue_t* rq) {
+	return rq->nr_ready > rq->nr_bound;
+}
+
+// only called when our own queue is empty; busy queues are only tried,
+// never waited for
+static thread_t* rq_steal(cpu_t* self) {
+	cpu_t* victim = NULL;
+	uint32_t most = 0;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		cpu_t* c = &cpus[i];
+		if (c == self || !c->online || !rq_stealable(&c->rq)) continue;
+		if (c->rq.nr_ready > most) {
+			most = c->rq.nr_ready;
+			victim = c;
+		}
+	}
+	if (!victim || !spin_trylock(&victim->rq.lock)) return NULL;
+	thread_t* t = rq_take(&victim->rq, self);
+	spin_unlock(&victim->rq.lock);
+	if (t) self->steals++;
+	return t;
+}
+
+// interrupts off
+static void cpu_kick(cpu_t* cpu, thread_t* t) {
+	cpu_t* self = this_cpu();
+	if (t->prio < cpu->current->prio) {
+		cpu->need_resched = true;
+		if (cpu != self) smp_send_resched(cpu);
+		return;
+	}
+	// its CPU is busy with something as important, an idle one may steal it
+	if (t->bound >= 0) return;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		cpu_t* c = &cpus[i];
+		if (c != cpu && c != self && c->online && c->current == &c->idle) {
+			smp_send_resched(c);
+			return;
+		}
+	}
+}
+
+// make t runnable on the CPU it belongs to, interrupts off
+static void sched_enqueue(thread_t* t) {
+	cpu_t* cpu = &cpus[t->bound >= 0 ? (uint32_t)t->bound : t->cpu];
+	spin_lock(&cpu->rq.lock);
+	rq_push(&cpu->rq, t);
+	spin_unlock(&cpu->rq.lock);
+	cpu_kick(cpu, t);
+}
+
+// --- SLEEPERS AND WAIT QUEUES (sched_lock held) ---
+
+static void sleep_insert(thread_t* t, uint32_t ticks) {
+	t->wake_tick = timer_ticks + ticks;
+	thread_t** link = &sleepers;
+	while (*link && (int32_t)((*link)->wake_tick - t->wake_tick) <= 0)
+		link = &(*link)->sleep_next;
+	t->sleep_next = *link;
+	*link = t;
+	// the BSP may be in a long one-shot sleep sized for the old first
+	// sleeper, have it look again
+	cpu_t* bsp = &cpus[0];
+	if (link == &sleepers && this_cpu() != bsp && bsp->current == &bsp->idle)
+		smp_send_resched(bsp);
+}
+
+static void sleep_unlink(thread_t* t) {
+	for (thread_t** link = &sleepers; *link; link = &(*link)->sleep_next) {
+		if (*link == t) {
+			*link = t->sleep_next;
+			return;
+		}
+	}
+}
+
+static void wq_unlink(thread_t* t) {
+	for (thread_t** link = &t->wq->head; *link; link = &(*link)->next) {
+		if (*link == t) {
+			*link = t->next;
+			break;
+		}
+	}
+	t->wq = NULL;
+}
+
+// blocked -> ready, off whatever it was waiting on
+static void thread_wake(thread_t* t) {
+	if (t->state != THREAD_BLOCKED) return;
+	if (t->wq) wq_unlink(t);
+	sleep_unlink(t);
+	sched_stats.wakeups++;
+	sched_enqueue(t);
+}
+
+// --- SWITCHING ---
+
+// first thing on the new stack: the old thread may now run elsewhere
+static void switch_finish(void) {
+	cpu_t* cpu = this_cpu();
+	__atomic_store_n(&cpu->switch_from->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+void schedule(void) {
+	uint32_t flags = irq_save();
+	cpu_t* cpu = this_cpu();
+	thread_t* prev = cpu->current;
+	cpu->need_resched = false;
+
+	// a running thread goes back on a queue; one that blocked or was
+	// woken again before getting here is not ours to queue
+	bool requeue = prev->state == THREAD_RUNNING && prev != &cpu->idle;
+	if (requeue && prev->bound >= 0 && (uint32_t)prev->bound != cpu->index) {
+		sched_enqueue(prev);	// thread_bind() moving it
+		requeue = false;
+	}
+
+	spin_lock(&cpu->rq.lock);
+	if (requeue) rq_push(&cpu->rq, prev);
+	thread_t* next = rq_pop(&cpu->rq);
+	spin_unlock(&cpu->rq.lock);
+	if (!next && cpu_count > 1) next = rq_steal(cpu);
+	if (!next) next = &cpu->idle;
+
+	next->state = THREAD_RUNNING;
+	if (!next->slice) next->slice = SCHED_SLICE;
+
+	if (next != prev) {
+		// queued here by thread_bind() while still switching out elsewhere
+		while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+			cpu_relax();
+		next->on_cpu = true;
+		next->cpu = cpu->index;
+		next->switches++;
+		cpu->switches++;
+		cpu->current = next;
+		cpu->switch_from = prev;
+		fpu_switch(cpu, prev);
+		process_switch(cpu, next);
+		switch_to(&prev->esp, next->esp);
+		switch_finish();
+	}
+	irq_restore(flags);
+}
+
+// on the way out of an interrupt, interrupts off
+void sched_preempt(void) {
+	cpu_t* cpu = this_cpu();
+	if (!cpu->need_resched || cpu->current == &cpu->idle || cpu->preempt_count) return;
+	cpu->preemptions++;
+	schedule();
+}
+
+// keep the current thread on this CPU, e.g. around a wait for other CPUs
+void preempt_disable(void) {
+	uint32_t flags = irq_save();
+	this_cpu()->preempt_count++;
+	irq_restore(flags);
+}
+
+void preempt_enable(void) {
+	uint32_t flags = irq_save();
+	cpu_t* cpu = this_cpu();
+	if (!--cpu->preempt_count && cpu->need_resched) sched_preempt();
+	irq_restore(flags);
+}
+
+// this CPU's tick covered ticks, interrupts off; the BSP also keeps
+// timer_ticks and so wakes the sleepers
+void sched_tick(uint32_t ticks) {
+	cpu_t* cpu = this_cpu();
+	if (!cpu->current) return;
+
+	if (cpu->index == 0 && sleepers) {
+		spin_lock(&sched_lock);
+		while (sleepers && (int32_t)(timer_ticks - sleepers->wake_tick) >= 0) {
+			sleepers->timed_out = true;
+			thread_wake(sleepers);
+		}
+		spin_unlock(&sched_lock);
+	}
+
+	thread_t* t = cpu->current;
+	if (t == &cpu->idle) return;
+	t->ticks += ticks;
+	if (t->slice > ticks) {
+		t->slice -= ticks;
+		return;
+	}
+	t->slice = 0;
+	if (cpu->rq.ready_map & ((2u << t->prio) - 1)) cpu->need_resched = true;	// same or higher
+}
+
+// something for this CPU to run, its own or stolen
+bool sched_runnable(void) {
+	cpu_t* self = this_cpu();
+	if (self->rq.nr_ready) return true;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		if (&cpus[i] != self && rq_stealable(&cpus[i].rq)) return true;
+	}
+	return false;
+}
+
+// ticks until the first timed sleeper is due, at most max; 0 while any
+// other CPU is busy, its threads may start timers we don't know about
+uint32_t sched_idle_ticks(uint32_t max) {
+	if (sched_runnable()) return 0;
+	for (uint32_t i = 1; i < cpu_count; i++) {
+		if (cpus[i].online && cpus[i].current != &cpus[i].idle) return 0;
+	}
+	thread_t* first = sleepers;
+	if (!first) return max;
+	int32_t ticks = (int32_t)(first->wake_tick - timer_ticks);
+	if (ticks <= 0) return 0;
+	return (uint32_t)ticks < max ? (uint32_t)ticks : max;
+}
+
+// --- THREADS ---
+
+// first code a new thread runs, reached from switch_to's ret
+static void thread_start(void) {
+	switch_finish();
+	__asm__ __volatile__("sti");
+	thread_t* t = current_thread;
+	t->fn(t->arg);
+	thread_exit();
+}
+
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg, uint8_t prio) {
+	thread_t* t = kmalloc(sizeof(thread_t));
+	if (!t) return NULL;
+	memset(t, 0, sizeof(thread_t));
+
+	size_t len = strlen(name);
+	if (len >= THREAD_NAME_MAX) len = THREAD_NAME_MAX - 1;
+	memcpy(t->name, name, len);
+
+	t->stack = vmap(THREAD_STACK_PAGES, VM_WRITE, t->name);
+	if (!t->stack) {
+		kfree(t);
+		return NULL;
+	}
+
+	// frame for switch_to: edi esi ebx ebp, then return into thread_start
+	uint32_t* sp = (uint32_t*)((uint8_t*)t->stack + THREAD_STACK_PAGES * PAGE_SIZE);
+	*--sp = 0;						// thread_start never returns
+	*--sp = (uint32_t)thread_start;
+	for (int i = 0; i < 4; i++) *--sp = 0;
+	t->esp = (uint32_t)sp;
+	t->prio = prio < SCHED_PRIOS - 1 ? prio : SCHED_PRIOS - 2;
+	t->bound = -1;
+	t->fpu_cpu = FPU_NO_CPU;
+	t->fn = fn;
+	t->arg = arg;
+
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	t->id = next_id++;
+	t->all_next = all_threads;
+	all_threads = t;
+	sched_stats.created++;
+	t->cpu = this_cpu()->index;
+	sched_enqueue(t);
+	spin_unlock(&sched_lock);
+	sched_preempt();
+	irq_restore(flags);
+	return t;
+}
+
+// the stack is freed by an idle thread once we are off it
+void thread_exit(void) {
+	irq_save();
+	thread_t* t = current_thread;
+	spin_lock(&sched_lock);
+	t->state = THREAD_DEAD;
+	t->next = zombies;
+	zombies = t;
+	spin_unlock(&sched_lock);
+	schedule();
+	for (;;) {}		// not reached
+}
+
+void thread_yield(void) {
+	schedule();
+}
+
+void thread_sleep(uint32_t ms) {
+	uint32_t flags = wq_lock();
+	wq_wait(NULL, ms ? ms : 1);
+	wq_unlock(flags);
+}
+
+// run only on cpu from now on, -1 lets the thread go anywhere again
+void thread_bind(int cpu) {
+	if (cpu >= (int)cpu_count || (cpu >= 0 && !cpus[cpu].online)) return;
+	uint32_t flags = irq_save();
+	current_thread->bound = (int8_t)cpu;
+	if (cpu >= 0 && (uint32_t)cpu != this_cpu()->index) schedule();
+	irq_restore(flags);
+}
+
+// --- WAIT QUEUES ---
+
+uint32_t wq_lock(void) {
+	return spin_lock_irqsave(&sched_lock);
+}
+
+void wq_unlock(uint32_t flags) {
+	spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+bool wq_wait(wait_queue_t* wq, uint32_t timeout) {
+	thread_t* t = current_thread;
+	t->state = THREAD_BLOCKED;
+	t->timed_out = false;
+	if (wq) {
+		thread_t** link = &wq->head;
+		while (*link) link = &(*link)->next;
+		t->next = NULL;
+		*link = t;
+		t->wq = wq;
+	}
+	if (timeout) sleep_insert(t, timeout);
+	// a wakeup from here on finds us BLOCKED and queues us, schedule()
+	// then either picks us again or leaves the stack for the other CPU
+	spin_unlock(&sched_lock);
+	schedule();
+	spin_lock(&sched_lock);
+	return !t->timed_out;
+}
+
+// wake every thread on wq; safe from interrupt handlers
+void wake_up(wait_queue_t* wq) {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	while (wq->head) thread_wake(wq->head);
+	spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// --- IDLE ---
+
+static void sched_reap(void) {
+	thread_t* list = NULL;
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	for (thread_t** zl = &zombies; *zl; ) {
+		thread_t* z = *zl;
+		if (z->on_cpu) {		// still leaving its stack
+			zl = &z->next;
+			continue;
+		}
+		*zl = z->next;
+		for (thread_t** link = &all_threads; *link; link = &(*link)->all_next) {
+			if (*link == z) {
+				*link = z->all_next;
+				break;
+			}
+		}
+		z->next = list;
+		list = z;
+	}
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	while (list) {
+		thread_t* t = list;
+		list = t->next;
+		for (uint32_t i = 0; i < cpu_count; i++) {
+			thread_t* last = t;		// it may still be named as a CPU's FPU owner
+			__atomic_compare_exchange_n(&cpus[i].fpu_last, &last, NULL, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+		vunmap(t->stack);
+		kfree(t->fpu);
+		kfree(t);
+		__atomic_fetch_add(&sched_stats.reaped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// the calling flow (kernel_main, or an AP's ap_main) becomes cpu's idle
+// thread; gdt_init(cpu) has run
+void sched_init(cpu_t* cpu) {
+	thread_t* t = &cpu->idle;
+	memcpy(t->name, "idle", 5);
+	t->prio = SCHED_PRIOS - 1;
+	t->state = THREAD_RUNNING;
+	t->on_cpu = true;
+	t->cpu = cpu->index;
+	t->bound = (int8_t)cpu->index;
+	t->fpu_cpu = FPU_NO_CPU;
+	fpu_cpu_init();
+
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	t->id = next_id++;
+	t->all_next = all_threads;
+	all_threads = t;
+	spin_unlock_irqrestore(&sched_lock, flags);
+	cpu->current = t;
+}
+
+void sched_idle(void) {
+	for (;;) {
+		if (zombies) sched_reap();
+		if (sched_runnable()) schedule();
+		else cpu_idle();			// sleep until an interrupt
+	}
+}
+
+void print_threads(void) {
+	kprintln("id  cpu  prio  state    ticks  switches  name");
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	for (thread_t* t = all_threads; t; t = t->all_next) {
+		kprint_int(t->id); kprint("  ");
+		kprint_int(t->cpu); kprint("  ");
+		kprint_int(t->prio); kprint("  ");
+		kprint(state_names[t->state]); kprint("  ");
+		kprint_int(t->ticks); kprint("  ");
+		kprint_int(t->switches); kprint("  ");
+		kprintln(t->name);
+	}
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	uint32_t switches = 0, preemptions = 0, steals = 0;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		switches += cpus[i].switches;
+		preemptions += cpus[i].preemptions;
+		steals += cpus[i].steals;
+	}
+	kprint("Switches:          "); kprint_int(switches); kprint("\n");
+	kprint("Preemptions:       "); kprint_int(preemptions); kprint("\n");
+	kprint("Steals:            "); kprint_int(steals); kprint("\n");
+	kprint("Wakeups:           "); kprint_int(sched_stats.wakeups); kprint("\n");
+	kprint("Created / reaped:  "); kprint_int(sched_stats.created);
+	kprint(" / "); kprint_int(sched_stats.reaped); kprint("\n");
+	kprint("\n");
+}
@@ -0,0 +1,294 @@
+// serial.c - interrupt-driven 16550 UART on COM1
+// - output goes into a ring; whenever the transmitter is empty a whole
+//   FIFO's worth (16 bytes) is written at once, from the writer if the
+//   line is idle, otherwise from the THRE interrupt. Writers never poll
+//   the line status per byte, only when the ring is full
+// - input is queued by the IRQ handler for the shell thread, one
+//   producer and one consumer like the keyboard ring
+// - until serial_irq_init() output just accumulates, and drains polled
+//   once the ring fills; kpanic() switches to polled output for good
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "serial.h"
+#include "ports.h"
+#include "idt.h"
+#include "irq.h"
+#include "kernel.h"
+#include "spinlock.h"
+
+// registers, offsets from COM1_PORT
+#define UART_DATA			0		// RBR/THR, divisor low with DLAB
+#define UART_IER			1		// divisor high with DLAB
+#define UART_IIR			2		// read
+#define UART_FCR			2		// write
+#define UART_LCR			3
+#define UART_MCR			4
+#define UART_LSR			5
+#define UART_MSR			6
+#define UART_SCR			7
+
+#define IER_RDA				0x01	// received data available
+#define IER_THRE			0x02	// transmitter holding register empty
+#define IER_RLS				0x04	// receiver line status
+#define FCR_ENABLE			0x01
+#define FCR_CLEAR_RX		0x02
+#define FCR_CLEAR_TX		0x04
+#define FCR_TRIGGER_14		0xC0	// RX interrupt at 14 bytes, or on timeout
+#define LCR_8N1				0x03
+#define LCR_DLAB			0x80
+#define MCR_DTR				0x01
+#define MCR_RTS				0x02
+#define MCR_OUT2			0x08	// gates the IRQ line on PCs
+#define MCR_LOOP			0x10
+#define LSR_DR				0x01
+#define LSR_OE				0x02
+#define LSR_THRE			0x20
+#define LSR_TEMT			0x40	// shift register empty too
+#define IIR_NONE			0x01
+#define IIR_ID				0x0E
+#define IIR_FIFO			0xC0	// both set on a 16550A with working FIFOs
+
+#define UART_FIFO			16
+#define TX_RING_SIZE		4096	// power of two
+#define RX_RING_SIZE		256
+
+bool serial_present = false;
+static bool serial_fifo = false;
+static bool serial_irq = false;		// THRE/RDA interrupts delivered
+static bool serial_polled = false;	// after a panic
+static uint8_t ier = 0;
+
+static spinlock_t serial_lock = SPINLOCK_INIT;	// tx ring and IER
+static uint8_t tx_ring[TX_RING_SIZE];
+static uint32_t tx_head = 0;
+static uint32_t tx_tail = 0;
+
+static volatile uint8_t rx_ring[RX_RING_SIZE];
+static volatile uint32_t rx_head = 0;	// written by the IRQ handler only
+static volatile uint32_t rx_tail = 0;	// written by serial_getc only
+
+static struct {
+	uint32_t tx_bytes;
+	uint32_t batches;			// FIFO loads
+	uint32_t tx_irqs;
+	uint32_t full_waits;		// writer polled because the ring was full
+	uint32_t rx_bytes;
+	uint32_t rx_dropped;		// ring full
+	uint32_t rx_overruns;		// lost in the UART itself
+} serial_stats;
+
+static inline uint8_t uart_in(uint8_t reg) {
+	return inb(COM1_PORT + reg);
+}
+
+static inline void uart_out(uint8_t reg, uint8_t value) {
+	outb(COM1_PORT + reg, value);
+}
+
+static void set_ier(uint8_t value) {
+	if (value == ier) return;
+	ier = value;
+	uart_out(UART_IER, value);
+}
+
+// --- TRANSMIT (serial_lock held) ---
+
+// the transmitter is empty: load up to a FIFO's worth, and have the
+// THRE interrupt call back while there is more
+static void tx_fill(void) {
+	uint32_t n = 0;
+	uint32_t max = serial_fifo ? UART_FIFO : 1;
+	while (n < max && tx_tail != tx_head) {
+		uart_out(UART_DATA, tx_ring[tx_tail & (TX_RING_SIZE - 1)]);
+		tx_tail++;
+		n++;
+	}
+	if (n) {
+		serial_stats.tx_bytes += n;
+		serial_stats.batches++;
+	}
+	if (serial_irq) set_ier(tx_tail != tx_head ? (ier | IER_THRE) : (ier & ~IER_THRE));
+}
+
+// ring full or no interrupts: wait out the line, one FIFO load at a time
+static void tx_drain_polled(void) {
+	while (!(uart_in(UART_LSR) & LSR_THRE))
+		cpu_relax();
+	tx_fill();
+}
+
+static void tx_put(char c) {
+	if (tx_head - tx_tail >= TX_RING_SIZE) {
+		serial_stats.full_waits++;
+		tx_drain_polled();
+	}
+	tx_ring[tx_head & (TX_RING_SIZE - 1)] = c;
+	tx_head++;
+}
+
+// terminals want CR LF, and a backspace that also erases
+void serial_write(const char* buf, size_t len) {
+	if (!serial_present) return;
+	uint32_t flags = spin_lock_irqsave(&serial_lock);
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c == '\n') tx_put('\r');
+		tx_put(c);
+		if (c == '\b') { tx_put(' '); tx_put('\b'); }
+	}
+	// one status read per call; a busy line is left to the interrupt
+	if (!(ier & IER_THRE) && (uart_in(UART_LSR) & LSR_THRE)) tx_fill();
+	else if (serial_irq) set_ier(ier | IER_THRE);
+	if (serial_polled) {
+		while (tx_tail != tx_head) tx_drain_polled();
+	}
+	spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// --- RECEIVE ---
+
+static void rx_drain(void) {
+	uint8_t lsr;
+	while ((lsr = uart_in(UART_LSR)) & LSR_DR) {
+		if (lsr & LSR_OE) serial_stats.rx_overruns++;
+		uint8_t c = uart_in(UART_DATA);
+		uint32_t head = rx_head;
+		if (head - rx_tail >= RX_RING_SIZE) {
+			serial_stats.rx_dropped++;
+			continue;
+		}
+		rx_ring[head & (RX_RING_SIZE - 1)] = c;
+		__asm__ __volatile__("" : : : "memory");	// slot before head
+		rx_head = head + 1;
+		serial_stats.rx_bytes++;
+	}
+}
+
+bool serial_rx_ready(void) {
+	return rx_head != rx_tail;
+}
+
+// next received byte, -1 if there is none
+int serial_getc(void) {
+	uint32_t tail = rx_tail;
+	if (tail == rx_head) return -1;
+	__asm__ __volatile__("" : : : "memory");	// head before slot
+	uint8_t c = rx_ring[tail & (RX_RING_SIZE - 1)];
+	rx_tail = tail + 1;
+	return c;
+}
+
+// --- SETUP ---
+
+// IRQ 4; one interrupt may stand for several causes, IIR lists them in
+// priority order until none is left
+static void serial_handler(irq_frame_t* frame, void* ctx) {
+	(void)frame; (void)ctx;
+	bool received = false;
+	uint8_t iir;
+	while (!((iir = uart_in(UART_IIR)) & IIR_NONE)) {
+		switch (iir & IIR_ID) {
+		case 0x06:						// line status
+			if (uart_in(UART_LSR) & LSR_OE) serial_stats.rx_overruns++;
+			break;
+		case 0x04:						// data available
+		case 0x0C:						// FIFO timeout
+			rx_drain();
+			received = true;
+			break;
+		case 0x02:						// THR empty
+			spin_lock(&serial_lock);
+			serial_stats.tx_irqs++;
+			tx_fill();
+			spin_unlock(&serial_lock);
+			break;
+		default:						// modem status
+			uart_in(UART_MSR);
+			break;
+		}
+	}
+	if (received) input_wake();
+	irq_eoi(COM1_IRQ);
+}
+
+// 115200 8N1 with FIFOs, interrupts still off; a loopback test tells a
+// real UART from an empty port
+void serial_init(void) {
+	uart_out(UART_IER, 0);
+	uart_out(UART_LCR, LCR_DLAB);
+	uart_out(UART_DATA, 115200 / SERIAL_BAUD);	// divisor, low byte
+	uart_out(UART_IER, 0);						// and high
+	uart_out(UART_LCR, LCR_8N1);
+	uart_out(UART_FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_TRIGGER_14);
+
+	uart_out(UART_MCR, MCR_LOOP | MCR_RTS | MCR_OUT2);
+	uart_out(UART_DATA, 0xAE);
+	if (uart_in(UART_DATA) != 0xAE) return;
+
+	uart_out(UART_MCR, MCR_DTR | MCR_RTS | MCR_OUT2);
+	serial_fifo = (uart_in(UART_IIR) & IIR_FIFO) == IIR_FIFO;
+	serial_present = true;
+}
+
+// after irq_init(); queued output starts moving
+void serial_irq_init(void) {
+	if (!serial_present) return;
+	irq_register(IRQ_VECTOR_BASE + COM1_IRQ, serial_handler, NULL);
+	uint32_t flags = spin_lock_irqsave(&serial_lock);
+	serial_irq = true;
+	set_ier(IER_RDA | IER_RLS);
+	rx_drain();
+	if (uart_in(UART_LSR) & LSR_THRE) tx_fill();
+	else set_ier(ier | IER_THRE);
+	spin_unlock_irqrestore(&serial_lock, flags);
+	irq_enable(COM1_IRQ);
+}
+
+// wait until everything queued has left the UART, before the machine
+// goes away under it
+void serial_flush(void) {
+	if (!serial_present) return;
+	uint32_t flags = spin_lock_irqsave(&serial_lock);
+	while (tx_tail != tx_head) tx_drain_polled();
+	while (!(uart_in(UART_LSR) & LSR_TEMT))
+		cpu_relax();
+	spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// from kpanic(), interrupts off for good: flush what is queued and
+// write everything after it synchronously
+void serial_panic(void) {
+	serial_lock.v = 0;
+	serial_polled = true;
+	serial_irq = false;
+	if (!serial_present) return;
+	set_ier(0);
+	while (tx_tail != tx_head) tx_drain_polled();
+}
+
+void print_serialinfo(void) {
+	if (!serial_present) {
+		kprintln("No UART at COM1");
+		kprint("\n");
+		return;
+	}
+	kprint("UART:              COM1 "); kprint(serial_fifo ? "16550A, FIFO on" : "8250/16450, no FIFO");
+	kprint(", "); kprint_int(SERIAL_BAUD); kprintln(" baud");
+	kprint("Bytes sent:        "); kprint_int(serial_stats.tx_bytes); kprint("\n");
+	kprint("FIFO loads:        "); kprint_int(serial_stats.batches);
+	if (serial_stats.batches) {
+		uint32_t per10 = serial_stats.tx_bytes * 10 / serial_stats.batches;
+		kprint(" ("); kprint_int(per10 / 10); kputchar('.'); kprint_int(per10 % 10); kprint(" bytes each)");
+	}
+	kprint("\n");
+	kprint("THRE interrupts:   "); kprint_int(serial_stats.tx_irqs); kprint("\n");
+	kprint("Ring full waits:   "); kprint_int(serial_stats.full_waits); kprint("\n");
+	kprint("Queued now:        "); kprint_int(tx_head - tx_tail);
+	kprint(" / "); kprint_int(TX_RING_SIZE); kprint("\n");
+	kprint("Bytes received:    "); kprint_int(serial_stats.rx_bytes); kprint("\n");
+	kprint("RX dropped:        "); kprint_int(serial_stats.rx_dropped);
+	kprint(" ring, "); kprint_int(serial_stats.rx_overruns); kprintln(" UART overruns");
+	kprint("\n");
+}
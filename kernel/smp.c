@@ -0,0 +1,296 @@
+// smp.c - application processor startup and cross-CPU calls
+// - processors come from the MADT (apic_cpu_ids); each one is started
+//   with INIT and two STARTUP IPIs pointing at a copy of ap_boot.asm's
+//   trampoline in a free page below 1 MiB
+// - the trampoline switches to protected mode and paging with the BSP's
+//   CR0/CR3/CR4 and jumps to ap_main() on a vmap'd stack; from there the
+//   AP loads its own GDT/TSS, shares the IDT and becomes its idle thread
+// - IPI_RESCHED makes a CPU look at the run queues, IPI_TLB flushes its
+//   TLB for vunmap()
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "smp.h"
+#include "apic.h"
+#include "boot.h"
+#include "clock.h"
+#include "cpu.h"
+#include "div64.h"
+#include "gdt.h"
+#include "idt.h"
+#include "irq.h"
+#include "kernel.h"
+#include "log.h"
+#include "memory.h"
+#include "paging.h"
+#include "process.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define AP_START_TRIES		10		// ~10 ms each
+#define SIPI_DELAY_COUNT	(PIT_HZ / 5000)	// ~200 us of PIT input clocks
+#define BENCH_ITERS			(1u << 25)		// xorshift rounds, split over the threads
+
+// ap_boot.asm; the parameter block sits inside the copied page
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_params[];
+
+typedef struct {
+	uint32_t cr3;
+	uint32_t cr4;
+	uint32_t cr0;
+	uint32_t stack;		// top of the AP's boot stack
+	uint32_t entry;		// ap_main
+	uint32_t cpu;		// its cpu_t, ap_main's argument
+} __attribute__((packed)) ap_params_t;
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+volatile uint32_t cpus_online = 1;
+
+static spinlock_t tlb_lock = SPINLOCK_INIT;	// one shootdown at a time
+static volatile uint32_t tlb_pending;
+
+// --- IPIs ---
+
+void smp_send_resched(cpu_t* cpu) {
+	if (cpu->online && cpus_online > 1) lapic_send_ipi(cpu->apic_id, ICR_FIXED | IPI_RESCHED);
+}
+
+// the sender set need_resched or wants an idle CPU to steal, either way
+// isr_dispatch's sched_preempt() or the idle loop does the rest
+static void ipi_resched(irq_frame_t* frame, void* ctx) {
+	(void)frame; (void)ctx;
+	this_cpu()->ipis++;
+	lapic_eoi();
+}
+
+// vmap PTEs are never global, a CR3 reload drops them
+static void ipi_tlb(irq_frame_t* frame, void* ctx) {
+	(void)frame; (void)ctx;
+	write_cr3(read_cr3());
+	__atomic_fetch_sub(&tlb_pending, 1, __ATOMIC_RELEASE);
+	lapic_eoi();
+}
+
+// flush every other CPU's TLB and wait until all have; the caller has
+// already changed the PTEs and flushed its own. Needs interrupts on: a
+// CPU waiting here must still answer another CPU's shootdown.
+// The IPIs go to the online CPUs one by one and tlb_pending counts
+// exactly those; an AP still on its way up runs no threads yet, and a
+// broadcast would have it ack a count that never included it.
+void tlb_shootdown(void) {
+	if (cpus_online <= 1) return;
+
+	preempt_disable();
+	spin_lock(&tlb_lock);
+	cpu_t* self = this_cpu();
+	uint32_t targets = 0, count = 0;		// bits are cpus[] indexes
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		if (&cpus[i] == self || !__atomic_load_n(&cpus[i].online, __ATOMIC_ACQUIRE)) continue;
+		targets |= 1u << i;
+		count++;
+	}
+	__atomic_store_n(&tlb_pending, count, __ATOMIC_RELEASE);
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		if (targets & (1u << i)) lapic_send_ipi(cpus[i].apic_id, ICR_FIXED | IPI_TLB);
+	}
+	while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	spin_unlock(&tlb_lock);
+	preempt_enable();
+}
+
+// --- AP STARTUP ---
+
+static void pit_delay(uint16_t count) {
+	pit2_start(count);
+	pit2_wait();
+}
+
+// first C code on an AP, on the stack smp_init() gave it
+static void ap_main(cpu_t* cpu) {
+	gdt_init(cpu);
+	syscall_cpu_init(cpu);
+	irq_ap_init();
+	sched_init(cpu);				// FPU state too, see fpu_cpu_init()
+	__atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+	__asm__ __volatile__("sti");
+	sched_idle();
+}
+
+static bool ap_start(cpu_t* cpu, uint32_t page, ap_params_t* params) {
+	void* stack = vmap(THREAD_STACK_PAGES, VM_WRITE, "ap stack");
+	if (!stack) return false;
+	params->stack = (uint32_t)stack + THREAD_STACK_PAGES * PAGE_SIZE;
+	params->cpu = (uint32_t)cpu;
+
+	lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_ASSERT);
+	pit_delay(CAL_PIT_COUNT);
+	for (int sipi = 0; sipi < 2 && !cpu->online; sipi++) {
+		lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (page >> PAGE_SHIFT));
+		pit_delay(SIPI_DELAY_COUNT);
+	}
+	for (int i = 0; i < AP_START_TRIES && !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE); i++)
+		pit_delay(CAL_PIT_COUNT);
+
+	// a late AP would still use the stack and its cpu_t, leave both
+	return cpu->online;
+}
+
+// the BSP's cpu_t went live in gdt_init() and sched_init(); start the
+// rest, unless "nosmp" on the kernel command line keeps the APs parked
+void smp_init(void) {
+	cpu_t* bsp = &cpus[0];
+	bsp->apic_id = apic_active ? lapic_id() : 0;
+	bsp->online = true;
+	if (!apic_active || apic_cpu_count < 2 || boot_option("nosmp")) return;
+
+	uint32_t page = pmm_alloc_low_frame();
+	if (!page) {
+		klog(LOG_WARN, "smp: no low page for the AP trampoline");
+		return;
+	}
+	irq_register(IPI_RESCHED, ipi_resched, NULL);
+	irq_register(IPI_TLB, ipi_tlb, NULL);
+
+	uint8_t* code = PHYS_TO_VIRT(page);
+	memcpy(code, ap_trampoline, ap_trampoline_end - ap_trampoline);
+	ap_params_t* params = (ap_params_t*)(code + (ap_params - ap_trampoline));
+	params->cr3 = read_cr3();
+	params->cr4 = read_cr4();
+	params->cr0 = read_cr0();
+	params->entry = (uint32_t)ap_main;
+
+	for (int i = 0; i < apic_cpu_count && cpu_count < MAX_CPUS; i++) {
+		if (apic_cpu_ids[i] == bsp->apic_id) continue;
+
+		cpu_t* cpu = &cpus[cpu_count];
+		cpu->index = cpu_count;
+		cpu->apic_id = apic_cpu_ids[i];
+		cpu_count++;				// the slot is taken even if the AP stays silent
+		if (ap_start(cpu, page, params)) {
+			cpus_online++;
+		} else {
+			klogf(LOG_WARN, "smp: CPU with APIC id %u did not start", (unsigned)cpu->apic_id);
+		}
+	}
+	// the trampoline page stays allocated, a late AP may still run it
+}
+
+// --- INFO ---
+
+void print_smpinfo(void) {
+	kprint("CPUs online:       "); kprint_int(cpus_online);
+	kprint(" of "); kprint_int(apic_active ? apic_cpu_count : 1); kprint("\n");
+	kprintln("cpu  apic  ready  switches  preempt  steals  ipis  running");
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		cpu_t* c = &cpus[i];
+		kprint_int(i); kprint("  ");
+		kprint_int(c->apic_id); kprint("  ");
+		if (!c->online) {
+			kprintln("offline");
+			continue;
+		}
+		kprint_int(c->rq.nr_ready); kprint("  ");
+		kprint_int(c->switches); kprint("  ");
+		kprint_int(c->preemptions); kprint("  ");
+		kprint_int(c->steals); kprint("  ");
+		kprint_int(c->ipis); kprint("  ");
+		kprintln(c->current->name);
+	}
+	kprint("\n");
+}
+
+// --- BENCHMARK ---
+// the same fixed amount of register-only work split over 1..N threads;
+// with one thread per CPU the time should drop close to 1/N
+
+typedef struct {
+	uint32_t iters;
+	uint32_t x;			// seed in, result out
+} bench_job_t;
+
+static volatile uint32_t bench_left;
+static wait_queue_t bench_wq;
+static volatile bool bench_busy = false;
+
+static void bench_worker(void* arg) {
+	bench_job_t* job = arg;
+	uint32_t x = job->x;
+	for (uint32_t i = 0; i < job->iters; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	job->x = x;
+	if (__atomic_sub_fetch(&bench_left, 1, __ATOMIC_ACQ_REL) == 0) wake_up(&bench_wq);
+}
+
+// microseconds for BENCH_ITERS rounds on threads workers, 0 on failure
+static uint32_t smp_bench_once(bench_job_t* jobs, uint32_t threads) {
+	bench_left = threads;
+	for (uint32_t i = 0; i < threads; i++) {
+		jobs[i].iters = BENCH_ITERS / threads + (i == 0 ? BENCH_ITERS % threads : 0);
+		jobs[i].x = 2463534242u + i;
+	}
+
+	uint64_t start = ktime_us();
+	for (uint32_t i = 0; i < threads; i++) {
+		if (!thread_create("bench", bench_worker, &jobs[i], PRIO_DEFAULT)) {
+			// the ones already started still finish, wait for them
+			__atomic_sub_fetch(&bench_left, threads - i, __ATOMIC_ACQ_REL);
+			threads = 0;
+			break;
+		}
+	}
+	uint32_t flags = wq_lock();
+	while (bench_left) wq_wait(&bench_wq, 0);
+	wq_unlock(flags);
+	uint32_t us = (uint32_t)(ktime_us() - start);
+	return threads ? (us ? us : 1) : 0;
+}
+
+void smp_bench(uint32_t max_threads) {
+	if (max_threads == 0) max_threads = 1;
+	if (max_threads > MAX_CPUS) max_threads = MAX_CPUS;
+	if (__atomic_exchange_n(&bench_busy, true, __ATOMIC_ACQUIRE)) {
+		kprintln("smpbench is already running");
+		return;
+	}
+
+	bench_job_t* jobs = kmalloc(max_threads * sizeof(bench_job_t));
+	if (!jobs) {
+		kprintln("Out of memory");
+		__atomic_store_n(&bench_busy, false, __ATOMIC_RELEASE);
+		return;
+	}
+
+	kprint("CPUs online:       "); kprint_int(cpus_online); kprint("\n");
+	kprintln("threads  ms  speedup");
+	kconsole_sync();
+	uint32_t base = 0;
+	for (uint32_t n = 1; n <= max_threads; n++) {
+		uint32_t us = smp_bench_once(jobs, n);
+		if (!us) {
+			kprintln("Cannot start the worker threads");
+			break;
+		}
+		if (n == 1) base = us;
+		uint32_t speedup = (uint32_t)udiv64_32((uint64_t)base * 100, us, NULL);	// hundredths
+
+		kprint_int(n); kprint("  ");
+		kprint_int(us / 1000); kprint("  ");
+		kprint_int(speedup / 100); kputchar('.');
+		if (speedup % 100 < 10) kputchar('0');
+		kprint_int(speedup % 100); kprint("\n");
+		kconsole_sync();
+	}
+	kprint("\n");
+
+	kfree(jobs);
+	__atomic_store_n(&bench_busy, false, __ATOMIC_RELEASE);
+}
@@ -1,8 +1,204 @@
 // string.c
 
+#include <stdint.h>
 #include "string.h"
+#include "cpu.h"
+#include "fpu.h"
 
-int strcmp(char* a, char* b)
+#define SSE_MIN			256		// below this rep movsd wins over the setup
+
+// unaligned, aliasing-safe dword access for the word-at-a-time loops
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_any;
+
+// --- REP MOVSD / STOSD ---
+
+static void* memcpy_rep(void* dst, const void* src, size_t n) {
+    void* d = dst;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__("rep movsl\n\t"
+                         "mov %3, %%ecx\n\t"
+                         "rep movsb"
+                         : "+D"(d), "+S"(src), "+c"(dwords)
+                         : "r"(n & 3)
+                         : "memory");
+    return dst;
+}
+
+static void* memset_rep(void* dst, int value, size_t n) {
+    void* d = dst;
+    size_t dwords = n >> 2;
+    uint32_t v = (uint8_t)value * 0x01010101u;
+    __asm__ __volatile__("rep stosl\n\t"
+                         "mov %3, %%ecx\n\t"
+                         "rep stosb"
+                         : "+D"(d), "+c"(dwords)
+                         : "a"(v), "r"(n & 3)
+                         : "memory");
+    return dst;
+}
+
+// --- ERMS (fast rep movsb / stosb) ---
+
+static void* memcpy_erms(void* dst, const void* src, size_t n) {
+    void* d = dst;
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dst;
+}
+
+static void* memset_erms(void* dst, int value, size_t n) {
+    void* d = dst;
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(n) : "a"(value) : "memory");
+    return dst;
+}
+
+// --- SSE2 ---
+// the XMM registers are part of the calling thread's lazily switched FPU
+// state (fpu.c); interrupt handlers take the rep path instead. The
+// destination is 16-byte aligned first
+
+static void* memcpy_sse2(void* dst, const void* src, size_t n) {
+    if (n < SSE_MIN || !fpu_usable()) return memcpy_rep(dst, src, n);
+
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t head = -(uint32_t)d & 15;
+    memcpy_rep(d, s, head);
+    d += head; s += head; n -= head;
+
+    if (n >= 64) {
+        size_t left = n & ~(size_t)63;
+        n -= left;
+        __asm__ __volatile__("1:\n\t"
+                             "movdqu   (%1), %%xmm0\n\t"
+                             "movdqu 16(%1), %%xmm1\n\t"
+                             "movdqu 32(%1), %%xmm2\n\t"
+                             "movdqu 48(%1), %%xmm3\n\t"
+                             "movdqa %%xmm0,   (%0)\n\t"
+                             "movdqa %%xmm1, 16(%0)\n\t"
+                             "movdqa %%xmm2, 32(%0)\n\t"
+                             "movdqa %%xmm3, 48(%0)\n\t"
+                             "add $64, %1\n\t"
+                             "add $64, %0\n\t"
+                             "sub $64, %2\n\t"
+                             "jnz 1b"
+                             : "+r"(d), "+r"(s), "+r"(left)
+                             : : "memory", "cc");
+    }
+    memcpy_rep(d, s, n);
+    return dst;
+}
+
+static void* memset_sse2(void* dst, int value, size_t n) {
+    if (n < SSE_MIN || !fpu_usable()) return memset_rep(dst, value, n);
+
+    uint8_t* d = dst;
+    size_t head = -(uint32_t)d & 15;
+    memset_rep(d, value, head);
+    d += head; n -= head;
+
+    uint32_t v = (uint8_t)value * 0x01010101u;
+    if (n >= 64) {
+        size_t left = n & ~(size_t)63;
+        n -= left;
+        __asm__ __volatile__("movd %2, %%xmm0\n\t"
+                             "pshufd $0, %%xmm0, %%xmm0\n\t"
+                             "1:\n\t"
+                             "movdqa %%xmm0,   (%0)\n\t"
+                             "movdqa %%xmm0, 16(%0)\n\t"
+                             "movdqa %%xmm0, 32(%0)\n\t"
+                             "movdqa %%xmm0, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "sub $64, %1\n\t"
+                             "jnz 1b"
+                             : "+r"(d), "+r"(left)
+                             : "r"(v)
+                             : "memory", "cc");
+    }
+    memset_rep(d, value, n);
+    return dst;
+}
+
+// --- DISPATCH ---
+
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_rep;
+static void* (*memset_impl)(void*, int, size_t) = memset_rep;
+static const char* variant = "rep movsd";
+
+// ERMS beats hand-written SSE loops on the CPUs that have it
+void string_init(void) {
+    if (cpu_features & CPU_FEAT_ERMS) {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+        variant = "rep movsb (erms)";
+    } else if (cpu_features & CPU_FEAT_SSE2) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+        variant = "sse2";
+    }
+}
+
+const char* string_variant(void) {
+    return variant;
+}
+
+// every variant copies forwards, which memmove relies on
+void* memcpy(void* dst, const void* src, size_t n) {
+    return memcpy_impl(dst, src, n);
+}
+
+void* memset(void* dst, int value, size_t n) {
+    return memset_impl(dst, value, n);
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    if (d <= s || d >= s + n)
+        return memcpy_impl(dst, src, n);
+
+    // overlapping with dst above src: copy backwards, odd bytes at the top first
+    d += n - 1; s += n - 1;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__("std\n\t"
+                         "rep movsb\n\t"
+                         "sub $3, %%esi\n\t"
+                         "sub $3, %%edi\n\t"
+                         "mov %3, %%ecx\n\t"
+                         "rep movsl\n\t"
+                         "cld"
+                         : "+D"(d), "+S"(s), "=c"(n)
+                         : "a"(dwords), "2"(n & 3)
+                         : "memory");
+    return dst;
+}
+
+// fill count 16-bit cells, e.g. VGA character + attribute pairs
+void* memsetw(uint16_t* dst, uint16_t value, size_t count) {
+    void* d = dst;
+    size_t dwords = count >> 1;
+    __asm__ __volatile__("rep stosl\n\t"
+                         "mov %3, %%ecx\n\t"
+                         "rep stosw"
+                         : "+D"(d), "+c"(dwords)
+                         : "a"(value * 0x00010001u), "r"(count & 1)
+                         : "memory");
+    return dst;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* p = a;
+    const uint8_t* q = b;
+    while (n >= 4 && *(const u32_any*)p == *(const u32_any*)q) {
+        p += 4; q += 4; n -= 4;
+    }
+    while (n--) {
+        if (*p != *q) return *p - *q;
+        p++; q++;
+    }
+    return 0;
+}
+
+int strcmp(const char* a, const char* b)
 {
     while (*a && (*a == *b)) {
         a++;
@@ -10,3 +206,27 @@ int strcmp(char* a, char* b)
     }
     return (unsigned char)*a - (unsigned char)*b;
 }
+
+int strncmp(const char* a, const char* b, size_t n) {
+    for (; n; n--, a++, b++) {
+        if (*a != *b || !*a)
+            return (unsigned char)*a - (unsigned char)*b;
+    }
+    return 0;
+}
+
+// a dword at a time once aligned; an aligned load never crosses a page
+size_t strlen(const char* s) {
+    const char* p = s;
+    while ((uint32_t)p & 3) {
+        if (!*p) return p - s;
+        p++;
+    }
+    for (;;) {
+        uint32_t w = *(const u32_any*)p;
+        if ((w - 0x01010101u) & ~w & 0x80808080u) break;
+        p += 4;
+    }
+    while (*p) p++;
+    return p - s;
+}
@@ -0,0 +1,132 @@
+// syscall.c - system calls from ring 3
+// - int 0x80 works on every CPU; SYSENTER/SYSEXIT skip the interrupt
+//   gate, the privilege checks of iret and most of the stack traffic, so
+//   they are used wherever CPUID reports them
+// - which one a process uses is decided here once: the vsyscall page
+//   mapped into every process names the preferred entry (syscall.h)
+// - handlers run in the process thread with interrupts on, and may
+//   sleep; arguments are checked against the process's page tables
+//   before the kernel touches user memory
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "process.h"
+#include "paging.h"
+#include "memory.h"
+#include "kernel.h"
+#include "string.h"
+#include "cpu.h"
+#include "clock.h"
+#include "div64.h"
+#include "gdt.h"
+#include "smp.h"
+
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+#define EFLAGS_TF			0x100
+
+#define WRITE_CHUNK			256		// bytes per kwrite, it runs with interrupts off
+
+extern void syscall_int80(void);	// sysentry.asm
+extern void sysenter_entry(void);
+extern const uint8_t vsyscall_page[];
+extern const uint8_t vsyscall_page_end[];
+
+// the copy every process maps read-only at USER_VSYSCALL
+static uint8_t vsyscall_copy[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+uint32_t vsyscall_frame;
+static bool sysenter_ok = false;
+
+bool syscall_fast(void) {
+	return sysenter_ok;
+}
+
+// #DB: single-stepping in ring 3 kills the process like any other fault;
+// the kernel sets no breakpoints or TF of its own, so a kernel-mode one
+// is a stray TF, dropped instead of panicking (the SYSENTER case is
+// taken care of in isr.asm before it gets here)
+static void debug_trap(irq_frame_t* frame, void* ctx) {
+	(void)ctx;
+	if (frame->cs & 3) process_fault(frame, "#DB debug");
+	else frame->eflags &= ~EFLAGS_TF;
+}
+
+// after irq_init(), which builds the IDT, and before the APs start
+void syscall_init(void) {
+	sysenter_ok = (cpu_features & CPU_FEAT_SEP) != 0;
+	idt_set_user_gate(SYSCALL_VECTOR, syscall_int80);
+	irq_register(1, debug_trap, NULL);
+
+	memset(vsyscall_copy, 0xCC, PAGE_SIZE);		// int3 outside the stubs
+	memcpy(vsyscall_copy, vsyscall_page, vsyscall_page_end - vsyscall_page);
+	*(uint32_t*)&vsyscall_copy[VSYS_ENTRY - USER_VSYSCALL] = sysenter_ok ? VSYS_SYSENTER : VSYS_INT80;
+	vsyscall_frame = VIRT_TO_PHYS(vsyscall_copy);
+
+	syscall_cpu_init(&cpus[0]);
+}
+
+// every CPU; SYSENTER takes its stack from this CPU's tss.esp0, which
+// process_switch() keeps pointing at the running process's kernel stack;
+// the MSR points one step further out, at sysenter_esp0, so a #DB on the
+// first instruction of sysenter_entry lands on sysenter_stack below it
+void syscall_cpu_init(cpu_t* cpu) {
+	if (!sysenter_ok) return;
+	cpu->sysenter_esp0 = (uint32_t)&cpu->tss.esp0;
+	wrmsr(MSR_SYSENTER_CS, GDT_KCODE);
+	wrmsr(MSR_SYSENTER_ESP, (uint32_t)&cpu->sysenter_esp0);
+	wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+// --- CALLS ---
+
+static int32_t sys_write(process_t* p, uint32_t buf, uint32_t len) {
+	if (!process_access_ok(p, buf, len, false)) return -1;
+	for (uint32_t done = 0; done < len; done += WRITE_CHUNK) {
+		uint32_t n = len - done < WRITE_CHUNK ? len - done : WRITE_CHUNK;
+		kwrite((const char*)(buf + done), n);
+	}
+	return (int32_t)len;
+}
+
+static int32_t sys_uptime(process_t* p, uint32_t out) {
+	if (!process_access_ok(p, out, sizeof(sys_uptime_t), true)) return -1;
+	sys_uptime_t* up = (sys_uptime_t*)out;
+	up->sec = (uint32_t)udiv64_32(ktime_us(), 1000000, &up->usec);
+	return 0;
+}
+
+// from syscall_int80 and sysenter_entry, interrupts on; the number and
+// arguments come in the frame's eax, ebx, esi and edi
+void syscall_dispatch(irq_frame_t* frame) {
+	process_t* p = current_thread->proc;
+	if (frame->vector == SYSENTER_FRAME) p->sysenter_calls++;
+	else p->int80_calls++;
+
+	int32_t ret;
+	switch (frame->eax) {
+	case SYS_EXIT:
+		process_exit((int)frame->ebx);
+	case SYS_WRITE:
+		ret = sys_write(p, frame->ebx, frame->esi);
+		break;
+	case SYS_UPTIME:
+		ret = sys_uptime(p, frame->ebx);
+		break;
+	case SYS_GETPID:
+		ret = (int32_t)p->pid;
+		break;
+	case SYS_YIELD:
+		thread_yield();
+		ret = 0;
+		break;
+	case SYS_SLEEP:
+		thread_sleep(frame->ebx);
+		ret = 0;
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+	frame->eax = (uint32_t)ret;
+}
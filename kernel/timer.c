@@ -0,0 +1,290 @@
+// timer.c - hierarchical timer wheel
+// - 4 levels of 64 slots; level n holds timers due within 64^(n+1) ticks,
+//   bucketed by bits 6n..6n+5 of the expiry tick
+// - insert and cancel are O(1) list operations, expiry only looks at the
+//   slot for the current tick; when the level-0 index wraps, the matching
+//   slot one level up is cascaded down
+// - timers further out than the top level park in its last reachable slot
+//   and are re-filed when it cascades
+// - callbacks run from timer_run() in the timer thread, never in irq0;
+//   it sleeps until the next expiry and timer_add() wakes it early
+// - timer_lock covers the wheel and is dropped around callbacks; it is
+//   taken before sched_lock (timer_add wakes the thread with it held)
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "timer.h"
+#include "irq.h"
+#include "kernel.h"
+#include "memory.h"
+#include "cpu.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "smp.h"
+
+#define WHEEL_BITS			6
+#define WHEEL_SIZE			(1u << WHEEL_BITS)
+#define WHEEL_MASK			(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+#define WHEEL_SPAN			(1u << (WHEEL_BITS * WHEEL_LEVELS))	// ticks covered
+#define TIMER_SLEEP_MAX		1000	// ticks the timer thread scans ahead
+
+static ktimer_t* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t wheel_now = 0;		// next tick to process
+static ktimer_t* timer_running;		// its callback is in progress
+static wait_queue_t timer_wq;		// the timer thread, between expiries
+static wait_queue_t timer_done_wq;	// timer_cancel() waiting out a callback
+static thread_t* timer_task;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+static struct {
+	uint32_t pending;
+	uint32_t peak;
+	uint32_t added;
+	uint32_t fired;
+	uint32_t cancelled;
+	uint32_t cascaded;
+} timer_stats;
+
+static void wheel_link(ktimer_t** slot, ktimer_t* t) {
+	t->next = *slot;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void wheel_unlink(ktimer_t* t) {
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+// file t in the slot for its expiry relative to wheel_now
+static void wheel_insert(ktimer_t* t) {
+	uint32_t delta = t->expires - wheel_now;
+	uint32_t expires = t->expires;
+
+	if ((int32_t)delta < 0) {
+		expires = wheel_now;		// already due, runs on the next pass
+		delta = 0;
+	} else if (delta >= WHEEL_SPAN) {
+		expires = wheel_now + WHEEL_SPAN - 1;	// re-filed on cascade
+		delta = WHEEL_SPAN - 1;
+	}
+
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1))))
+		level++;
+	wheel_link(&wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+// move every timer in one upper-level slot down to where it now belongs
+static void wheel_cascade(int level, uint32_t index) {
+	ktimer_t* t = wheel[level][index];
+	wheel[level][index] = NULL;
+	while (t) {
+		ktimer_t* next = t->next;
+		wheel_insert(t);
+		timer_stats.cascaded++;
+		t = next;
+	}
+}
+
+void timer_init(ktimer_t* t, timer_fn_t fn, void* ctx) {
+	t->next = NULL;
+	t->pprev = NULL;
+	t->fn = fn;
+	t->ctx = ctx;
+	t->period = 0;
+	t->flags = 0;
+}
+
+// arm t to fire in ms ticks, then every period ticks if period != 0;
+// re-arming a pending timer moves it
+void timer_add(ktimer_t* t, uint32_t ms, uint32_t period) {
+	uint32_t flags = spin_lock_irqsave(&timer_lock);
+	if (t->flags & TIMER_PENDING) {
+		wheel_unlink(t);
+		timer_stats.pending--;
+	}
+
+	// keep the wheel caught up so the slot math starts from now
+	if (!timer_stats.pending) wheel_now = timer_ticks;
+
+	t->expires = timer_ticks + (ms ? ms : 1);
+	t->period = period;
+	t->flags = (t->flags & ~TIMER_PERIODIC) | TIMER_PENDING | (period ? TIMER_PERIODIC : 0);
+	wheel_insert(t);
+
+	timer_stats.added++;
+	if (++timer_stats.pending > timer_stats.peak) timer_stats.peak = timer_stats.pending;
+	wake_up(&timer_wq);		// may be due before the thread's next wakeup
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// returns false if t was not pending (already fired or never armed);
+// sleeps while t's callback runs in the timer thread, so call it from
+// a thread, not from an interrupt handler
+bool timer_cancel(ktimer_t* t) {
+	uint32_t flags = spin_lock_irqsave(&timer_lock);
+	bool was_pending = t->flags & TIMER_PENDING;
+	if (was_pending) {
+		wheel_unlink(t);
+		t->flags &= ~TIMER_PENDING;
+		timer_stats.pending--;
+		timer_stats.cancelled++;
+	}
+	// an autofree timer cancelled from its own callback is freed by
+	// timer_run() once the callback returns
+	bool free_it = was_pending && (t->flags & TIMER_AUTOFREE) && t != timer_running;
+	spin_unlock_irqrestore(&timer_lock, flags);
+
+	// a callback preempted in the timer thread or running on another CPU
+	// may still use t or its ctx, wait it out so the caller can free them
+	// on return; t is only compared from here on, timer_run() may free an
+	// autofree one
+	flags = wq_lock();
+	while (t == timer_running && current_thread != timer_task)
+		wq_wait(&timer_done_wq, 0);
+	wq_unlock(flags);
+
+	if (free_it) kfree(t);
+	return was_pending;
+}
+
+// heap-allocated timer, freed after a one-shot fires or when cancelled
+ktimer_t* timer_start(uint32_t ms, uint32_t period, timer_fn_t fn, void* ctx) {
+	ktimer_t* t = kmalloc(sizeof(ktimer_t));
+	if (!t) return NULL;
+	timer_init(t, fn, ctx);
+	t->flags = TIMER_AUTOFREE;
+	timer_add(t, ms, period);
+	return t;
+}
+
+// process every tick up to timer_ticks and run what expired
+void timer_run(void) {
+	uint32_t now = timer_ticks;
+	uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+	while (timer_stats.pending && (int32_t)(now - wheel_now) >= 0) {
+		uint32_t index = wheel_now & WHEEL_MASK;
+
+		// level-0 index wrapped: pull the next slot of each level down
+		for (int level = 1; level < WHEEL_LEVELS && index == 0; level++) {
+			index = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+			wheel_cascade(level, index);
+		}
+
+		ktimer_t** slot = &wheel[0][wheel_now & WHEEL_MASK];
+		while (*slot) {
+			ktimer_t* t = *slot;
+			wheel_unlink(t);
+			t->flags &= ~TIMER_PENDING;
+			timer_stats.pending--;
+			timer_stats.fired++;
+			if (t->flags & TIMER_PERIODIC) {
+				// next expiry from the scheduled one, so periods do not drift
+				t->expires += t->period;
+				t->flags |= TIMER_PENDING;
+				wheel_insert(t);
+				timer_stats.pending++;
+			}
+			// a caller-owned timer may be freed by its own callback, so
+			// take everything needed from it now
+			timer_fn_t fn = t->fn;
+			void* ctx = t->ctx;
+			bool autofree = t->flags & TIMER_AUTOFREE;
+			timer_running = t;
+			spin_unlock_irqrestore(&timer_lock, flags);
+
+			fn(ctx);
+
+			// decided after the callback: it may have cancelled or
+			// re-armed its own timer
+			flags = spin_lock_irqsave(&timer_lock);
+			timer_running = NULL;
+			autofree = autofree && !(t->flags & TIMER_PENDING);
+			wake_up(&timer_done_wq);
+			if (autofree) {
+				spin_unlock_irqrestore(&timer_lock, flags);
+				kfree(t);
+				flags = spin_lock_irqsave(&timer_lock);
+			}
+		}
+
+		wheel_now++;
+	}
+	if (!timer_stats.pending) wheel_now = now + 1;
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// does processing tick t have to cascade a non-empty upper slot?
+static bool wheel_cascades_at(uint32_t t) {
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		uint32_t index = (t >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		if (wheel[level][index]) return true;
+		if (index) break;
+	}
+	return false;
+}
+
+// ticks from now until timer_run() has work, at most max; used by the
+// timer thread to size its sleep under wq_lock(), 0 means something is
+// due now; a timer_add() racing with the scan wakes the thread anyway
+uint32_t timer_idle_ticks(uint32_t max) {
+	if (!timer_stats.pending) return max;
+
+	uint32_t now = timer_ticks;
+	if ((int32_t)(now - wheel_now) >= 0) return 0;	// unprocessed ticks
+
+	for (uint32_t t = wheel_now; t - now <= max; t++) {
+		if (wheel[0][t & WHEEL_MASK]) return t - now;
+		if (!(t & WHEEL_MASK) && wheel_cascades_at(t)) return t - now;
+	}
+	return max;
+}
+
+static void timer_thread(void* arg) {
+	(void)arg;
+	for (;;) {
+		timer_run();
+
+		uint32_t flags = wq_lock();
+		if (!timer_stats.pending) wq_wait(&timer_wq, 0);
+		else {
+			uint32_t ticks = timer_idle_ticks(TIMER_SLEEP_MAX);
+			if (ticks) wq_wait(&timer_wq, ticks);
+		}
+		wq_unlock(flags);
+	}
+}
+
+void timer_thread_init(void) {
+	timer_task = thread_create("timer", timer_thread, NULL, PRIO_TIMER);
+	if (!timer_task)
+		kpanic("cannot start the timer thread");
+}
+
+void print_timers(void) {
+	kprint("Pending:           "); kprint_int(timer_stats.pending); kprint("\n");
+	kprint("Peak pending:      "); kprint_int(timer_stats.peak); kprint("\n");
+	kprint("Added:             "); kprint_int(timer_stats.added); kprint("\n");
+	kprint("Fired:             "); kprint_int(timer_stats.fired); kprint("\n");
+	kprint("Cancelled:         "); kprint_int(timer_stats.cancelled); kprint("\n");
+	kprint("Cascaded:          "); kprint_int(timer_stats.cascaded); kprint("\n");
+	kprint("\n");
+}
+
+// --- LEGACY DELAY API ---
+
+static void delay_trampoline(void* ctx) {
+	((delay_callback_t)ctx)();
+}
+
+// one-shot callback after ms; only fails when the heap is exhausted
+bool start_delay(uint32_t ms, delay_callback_t cb) {
+	return timer_start(ms, 0, delay_trampoline, (void*)cb) != NULL;
+}
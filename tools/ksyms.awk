@@ -0,0 +1,25 @@
+# ksyms.awk - kernel symbol table as C, from `nm -n kEntry.elf`
+# - text symbols only, sorted by address; with no input it writes the
+#   empty table the first link pass uses
+# - linker-defined names (__text_start and friends) are left out
+
+BEGIN {
+	print "// generated by tools/ksyms.awk, do not edit"
+	print ""
+	print "#include <stdint.h>"
+	print "#include \"ksyms.h\""
+	print ""
+	print "const ksym_t ksyms[] = {"
+	n = 0
+}
+
+($2 == "T" || $2 == "t") && $3 !~ /^__/ {
+	printf "\t{ 0x%s, \"%s\" },\n", $1, $3
+	n++
+}
+
+END {
+	if (!n) print "\t{ 0, \"\" },"
+	print "};"
+	printf "const uint32_t ksyms_count = %d;\n", n
+}
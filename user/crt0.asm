@@ -0,0 +1,17 @@
+; crt0.asm - user program entry point
+; - the kernel leaves argc and argv on top of the stack, as main's
+;   arguments; main's return value goes to exit()
+
+BITS 32
+
+global _start
+extern main
+extern exit
+
+section .text
+
+_start:
+    xor ebp, ebp            ; end of the frame chain
+    call main
+    push eax
+    call exit
@@ -0,0 +1,12 @@
+// echo.c - print the arguments, the shell's echo in ring 3
+
+#include "ulib.h"
+
+int main(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		print(argv[i]);
+		if (i < argc - 1) print(" ");
+	}
+	print("\n");
+	return 0;
+}
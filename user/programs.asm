@@ -0,0 +1,32 @@
+; programs.asm - user programs linked into the kernel image
+; - user_programs is a table of name, image start, image end, ended by a
+;   NULL name (user_program_t in process.c); the images are the ELF files
+;   the Makefile builds from this directory
+
+BITS 32
+
+global user_programs
+
+; PROGRAM name, file
+%macro PROGRAM 2
+section .rodata
+    dd %%name, %%start, %%end
+section .rodata.user
+%%name:
+    db %1, 0
+align 16
+%%start:
+    incbin %2
+%%end:
+%endmacro
+
+section .rodata
+align 4
+user_programs:
+
+PROGRAM "echo", "echo.elf"
+PROGRAM "uptime", "uptime.elf"
+PROGRAM "sysbench", "sysbench.elf"
+
+section .rodata
+    dd 0, 0, 0
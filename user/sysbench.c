@@ -0,0 +1,41 @@
+// sysbench.c - system call round trip in cycles, int 0x80 against SYSENTER
+// - times batches of getpid(), which does nothing in the kernel but count
+//   the call, and keeps the fastest batch so interrupts and migrations
+//   landing in a batch don't count
+
+#include "ulib.h"
+
+#define BATCH		1000
+#define ROUNDS		20
+
+static uint32_t cycles_per_call(uint32_t entry) {
+	uint32_t best = 0xFFFFFFFF;
+	syscall_via(entry, SYS_GETPID, 0, 0, 0);		// warm up
+	for (int r = 0; r < ROUNDS; r++) {
+		uint32_t start = (uint32_t)rdtsc();
+		for (int i = 0; i < BATCH; i++)
+			syscall_via(entry, SYS_GETPID, 0, 0, 0);
+		uint32_t cycles = (uint32_t)rdtsc() - start;
+		if (cycles < best) best = cycles;
+	}
+	return best / BATCH;
+}
+
+int main(int argc, char** argv) {
+	(void)argc; (void)argv;
+	uint32_t slow = cycles_per_call(VSYS_INT80);
+	print("int 0x80:  "); print_uint(slow); print(" cycles/call\n");
+
+	if (*(volatile uint32_t*)VSYS_ENTRY != VSYS_SYSENTER) {
+		print("sysenter:  not supported by this CPU\n");
+		return 0;
+	}
+	uint32_t fast = cycles_per_call(VSYS_SYSENTER);
+	print("sysenter:  "); print_uint(fast); print(" cycles/call");
+	if (fast) {
+		print(", "); print_uint(slow * 10 / fast / 10); print(".");
+		print_uint(slow * 10 / fast % 10); print("x faster");
+	}
+	print("\n");
+	return 0;
+}
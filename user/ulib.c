@@ -0,0 +1,58 @@
+// ulib.c - runtime for user programs
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ulib.h"
+
+// call one of the vsyscall page's entry stubs; the stubs clobber ecx
+// and edx, and the SYSENTER one the flags
+int syscall_via(uint32_t entry, uint32_t nr, uint32_t a, uint32_t b, uint32_t c) {
+	int ret;
+	__asm__ __volatile__("call *%5"
+		: "=a"(ret), "+b"(a), "+S"(b), "+D"(c)
+		: "a"(nr), "m"(entry)
+		: "ecx", "edx", "memory", "cc");
+	return ret;
+}
+
+// through whichever entry the kernel picked for this CPU
+int syscall(uint32_t nr, uint32_t a, uint32_t b, uint32_t c) {
+	return syscall_via(*(volatile uint32_t*)VSYS_ENTRY, nr, a, b, c);
+}
+
+void exit(int code) {
+	syscall(SYS_EXIT, (uint32_t)code, 0, 0);
+	for (;;) {}
+}
+
+int write(const void* buf, size_t len) {
+	return syscall(SYS_WRITE, (uint32_t)buf, len, 0);
+}
+
+int getpid(void) {
+	return syscall(SYS_GETPID, 0, 0, 0);
+}
+
+void sleep(uint32_t ms) {
+	syscall(SYS_SLEEP, ms, 0, 0);
+}
+
+size_t strlen(const char* s) {
+	size_t n = 0;
+	while (s[n]) n++;
+	return n;
+}
+
+void print(const char* s) {
+	write(s, strlen(s));
+}
+
+void print_uint(uint32_t value) {
+	char buf[10];
+	int i = sizeof(buf);
+	do {
+		buf[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	write(&buf[i], sizeof(buf) - i);
+}
@@ -0,0 +1,29 @@
+// ulib.h - runtime for user programs: system call wrappers and printing
+
+#ifndef ULIB_H
+#define ULIB_H
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "syscall.h"
+
+int syscall_via(uint32_t entry, uint32_t nr, uint32_t a, uint32_t b, uint32_t c);
+int syscall(uint32_t nr, uint32_t a, uint32_t b, uint32_t c);
+
+void exit(int code) __attribute__((noreturn));
+int write(const void* buf, size_t len);
+int getpid(void);
+void sleep(uint32_t ms);
+
+size_t strlen(const char* s);
+void print(const char* s);
+void print_uint(uint32_t value);
+
+static inline uint64_t rdtsc(void) {
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+#endif
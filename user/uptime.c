@@ -0,0 +1,17 @@
+// uptime.c - time since boot, the shell's uptime in ring 3
+
+#include "ulib.h"
+
+int main(int argc, char** argv) {
+	(void)argc; (void)argv;
+	sys_uptime_t up;
+	if (syscall(SYS_UPTIME, (uint32_t)&up, 0, 0) < 0) return 1;
+
+	char frac[7];
+	uint32_t us = up.usec;
+	for (int i = 5; i >= 0; i--) { frac[i] = '0' + us % 10; us /= 10; }
+	frac[6] = '\0';
+
+	print("Uptime: "); print_uint(up.sec); print("."); print(frac); print(" s\n");
+	return 0;
+}